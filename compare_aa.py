@@ -0,0 +1,181 @@
+#!/usr/bin/python
+
+# Checks that --aa mip looks close enough to --aa supersample: plays the
+# same frames with each offscreen (--bench N --dump-frames), then compares
+# every screen of every frame and reports the PSNR and largest difference.
+# Exits with 1 if any frame is below the thresholds.
+
+from __future__ import print_function
+
+from subprocess import call
+import math
+import os
+import shutil
+import sys
+import tempfile
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+program_path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    "video_sphere")
+
+USAGE = """USAGE: compare_aa.py [--frames N] [--min-psnr DB] [--max-diff N]
+                     [--keep DIR] -- VIDEO_SPHERE_ARGS...
+
+Runs video_sphere --offscreen --bench N --dump-frames with --aa supersample
+and with --aa mip, and compares what every screen drew. VIDEO_SPHERE_ARGS
+pick the clip and screens, e.g.
+
+    compare_aa.py -- --headless --video clip.mp4 --config wall.xml --host node-0
+
+Defaults: 10 frames, at least 30 dB PSNR, no limit on the largest
+difference of a single channel (0-255). --keep DIR keeps the dumps."""
+
+def read_ppm(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    # header: P6, width, height, maxval, then one whitespace byte
+    fields = []
+    pos = 0
+    while len(fields) < 4:
+        while data[pos:pos+1].isspace():
+            pos += 1
+        start = pos
+        while not data[pos:pos+1].isspace():
+            pos += 1
+        fields.append(data[start:pos])
+
+    if fields[0] != b"P6" or fields[3] != b"255":
+        raise ValueError(path + ": not an 8 bit binary PPM")
+
+    width, height = int(fields[1]), int(fields[2])
+    pixels = data[pos+1:pos+1 + width*height*3]
+
+    return width, height, pixels
+
+# mean squared error and largest difference of one channel
+def compare(a, b):
+    if numpy:
+        x = numpy.frombuffer(a, dtype=numpy.uint8).astype(numpy.int32)
+        y = numpy.frombuffer(b, dtype=numpy.uint8).astype(numpy.int32)
+        d = x - y
+        return float((d * d).mean()), int(abs(d).max())
+
+    a = bytearray(a)
+    b = bytearray(b)
+    total = 0
+    largest = 0
+    for i in range(len(a)):
+        d = abs(a[i] - b[i])
+        total += d * d
+        if d > largest:
+            largest = d
+
+    return float(total) / len(a), largest
+
+def psnr(mse):
+    if mse == 0:
+        return float("inf")
+    return 10 * math.log10(255.0 * 255.0 / mse)
+
+def run(mode, frames, dump_dir, args):
+    cmd = [program_path, "--offscreen", "--bench", str(frames),
+        "--dump-frames", dump_dir, "--aa", mode] + args
+
+    print(" ".join(cmd))
+
+    # drawn by llvmpipe unless the caller says otherwise
+    env = dict(os.environ)
+    env.setdefault("EGL_PLATFORM", "surfaceless")
+    env.setdefault("LIBGL_ALWAYS_SOFTWARE", "1")
+
+    if call(cmd, env=env) != 0:
+        print("video_sphere --aa " + mode + " failed")
+        sys.exit(2)
+
+def main():
+    frames = 10
+    min_psnr = 30.0
+    max_diff = 255
+    keep = None
+
+    argv = sys.argv[1:]
+    if "--" not in argv or "--help" in argv[:argv.index("--")]:
+        print(USAGE)
+        sys.exit(2)
+
+    split = argv.index("--")
+    options, args = argv[:split], argv[split+1:]
+
+    i = 0
+    while i < len(options):
+        if options[i] == "--frames":
+            frames = int(options[i+1])
+        elif options[i] == "--min-psnr":
+            min_psnr = float(options[i+1])
+        elif options[i] == "--max-diff":
+            max_diff = int(options[i+1])
+        elif options[i] == "--keep":
+            keep = options[i+1]
+        else:
+            print(USAGE)
+            sys.exit(2)
+        i += 2
+
+    base = keep or tempfile.mkdtemp(prefix="compare_aa-")
+    if not os.path.isdir(base):
+        os.makedirs(base)
+    reference_dir = os.path.join(base, "supersample")
+    mip_dir = os.path.join(base, "mip")
+
+    try:
+        run("supersample", frames, reference_dir, args)
+        run("mip", frames, mip_dir, args)
+
+        names = sorted(n for n in os.listdir(reference_dir)
+            if n.endswith(".ppm"))
+
+        if not names:
+            print("Nothing was dumped")
+            sys.exit(2)
+
+        failed = 0
+        worst_psnr = float("inf")
+        worst_diff = 0
+
+        for name in names:
+            w, h, a = read_ppm(os.path.join(reference_dir, name))
+            w2, h2, b = read_ppm(os.path.join(mip_dir, name))
+
+            if (w, h) != (w2, h2):
+                print("%s: sizes differ (%dx%d, %dx%d)" % (name, w, h, w2, h2))
+                failed += 1
+                continue
+
+            mse, diff = compare(a, b)
+            p = psnr(mse)
+            worst_psnr = min(worst_psnr, p)
+            worst_diff = max(worst_diff, diff)
+
+            bad = p < min_psnr or diff > max_diff
+            if bad:
+                failed += 1
+
+            print("%s: PSNR %.2f dB, max difference %d%s" % (name, p, diff,
+                "  <-- FAIL" if bad else ""))
+
+        print("%d of %d screen frames below threshold; worst PSNR %.2f dB, "
+            "max difference %d" % (failed, len(names), worst_psnr, worst_diff))
+
+        sys.exit(1 if failed else 0)
+
+    finally:
+        if not keep:
+            shutil.rmtree(base, ignore_errors=True)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "window.h"
+
+#include <GL/glew.h>
+
+struct Player;
+
+// --bench: plays player.bench_frames frames from the start of the video as
+// fast as the decoder and GPU allow, ignoring the clock, the network and
+// input, and prints how long each stage of a frame took. Each stage ends
+// with a glFinish() so its GPU time is counted where it belongs.
+//
+// With --dump-frames, what each screen drew for each frame is saved as
+// <dump_dir>/screen<S>-frame<NNNNN>.ppm for comparison against golden
+// images. Every frame is drawn, in order, so runs are repeatable.
+void run_bench(Player& player, GLint Window_::* shader_program);
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "stats.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <string>
+
+#define CLOCK_SYNC_DEFAULT_PORT 4548
+
+// recent exchanges the estimate is picked from
+#define CLOCK_FILTER_SIZE 8
+
+// one request/response exchange with the server, all in the client's
+// av_gettime_relative() microseconds
+struct ClockSample
+{
+    int64_t offset;   // server clock minus client clock
+    int64_t delay;    // round trip, less the time the server held it
+    int64_t received; // when the response arrived
+};
+
+// Keeps a client's av_gettime_relative() in step with the server's, so
+// that 'F' can say exactly when its playback time was read, instead of
+// clients assuming it arrived the moment it was sent.
+//
+// The client sends the server a request over UDP a few times a second;
+// the server answers with when it got the request and when it sent the
+// answer. Receive times are the kernel's (SO_TIMESTAMPNS) where it gives
+// them, so time spent in socket queues and waiting for the thread doesn't
+// count as network delay. As in NTP, of the last CLOCK_FILTER_SIZE
+// exchanges only the one with the shortest round trip is used, since it
+// has the least room for asymmetric queueing. The offset and drift follow
+// it gradually rather than jumping with every exchange, except to get
+// started or to catch up with a large step.
+//
+// The estimate and its error bound (half the round trip of the exchange
+// used, plus what the clocks may have drifted since) are in the client's
+// stats as clock.offset_ms and clock.error_ms.
+struct ClockSync
+{
+    bool enabled;
+    unsigned short port;
+    
+    int fd;
+    pthread_t thread;
+    bool running;
+    bool exit_flag;
+    
+    // === client ===
+    struct sockaddr_in server_addr;
+    Stats* stats;
+    
+    pthread_mutex_t mutex; // protects everything below
+    
+    ClockSample samples[CLOCK_FILTER_SIZE];
+    int sample_count;
+    int sample_next;
+    int64_t used; // received time of the last sample used, 0 for none
+    
+    bool synced;
+    double offset;   // server minus client clock at reference
+    double drift;    // change in offset per microsecond
+    int64_t reference;
+    int64_t delay;   // of the sample last used
+    
+    ClockSync() : enabled(true), port(CLOCK_SYNC_DEFAULT_PORT), fd(-1),
+        running(false), exit_flag(false), stats(NULL), sample_count(0),
+        sample_next(0), used(0), synced(false), offset(0.0), drift(0.0),
+        reference(0), delay(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    // server: answers every client's requests on its own thread
+    void start_server();
+    
+    // client: keeps exchanging timestamps with server_address on its own
+    // thread
+    void start_client(const std::string& server_address, Stats* stats);
+    
+    // stops and joins the thread
+    void stop();
+    
+    // client: the server's clock at local time, once synced (false
+    // before). error (if given) gets the error bound.
+    bool to_server(int64_t local, int64_t& server, double* error = NULL);
+    
+    // client: the local time at server time, once synced
+    bool to_local(int64_t server, int64_t& local);
+    
+    // main loops for the thread
+    // do not call these directly; they will be run indirectly by
+    // start_server() and start_client()
+    void server_loop();
+    void client_loop();
+    
+    // client: filters in one exchange
+    void add_sample(const ClockSample& sample);
+};
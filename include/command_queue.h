@@ -0,0 +1,47 @@
+#pragma once
+
+#include "network.h"
+#include "clock_sync.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+// how far ahead of sending the server sets a command's time: enough for
+// it to reach every client and be queued before its frame is picked
+#define COMMAND_LEAD 50000
+
+// a control message waiting for the frame it applies to
+struct ScheduledCommand
+{
+    int64_t at; // av_gettime_relative() of the vblank it applies from
+    Message message;
+};
+
+// Control messages that change what's on screen ('S', 'X', 'K', 'Q') are
+// sent by the server wrapped in 'A' with a time COMMAND_LEAD ahead on its
+// clock. Each client converts that to its own clock (see ClockSync) and
+// holds the message until the frame being picked is the one presented at
+// or after that time, so that every screen pauses or seeks on the same
+// frame. The server queues its own copy of each the same way. (View angles
+// are timed the same way, but come with the server's time; see StateSync.)
+//
+// Main thread only.
+struct CommandQueue
+{
+    std::vector<ScheduledCommand> commands; // by at, then arrival
+    
+    // queues message to be handled at local time at
+    void push(int64_t at, const Message& message);
+    
+    // moves the 'A' messages out of messages into the queue, converting
+    // their times with clock (ones that can't be converted yet are due
+    // straight away)
+    void take(std::vector<Message>& messages, ClockSync& clock);
+    
+    // appends the messages due by the time present (in order) to out
+    void pop_due(int64_t present, std::vector<Message>& out);
+    
+    // the time of the next command, if any
+    bool next(int64_t& at);
+};
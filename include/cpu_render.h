@@ -0,0 +1,92 @@
+#pragma once
+
+#include "screen.h"
+
+#include <pthread.h>
+#include <vector>
+
+// rows handed to a thread at a time
+#define CPU_RENDER_BAND_ROWS 8
+
+// Where a screen's pixels look on the sphere: the direction through the
+// centre of pixel (col, row) is origin + col*step_x + row*step_y (rows go
+// top to bottom). Same as pos in simple-mono.vert, which is linear across
+// the screen.
+struct ScreenBasis
+{
+    float origin[3];
+    float step_x[3];
+    float step_y[3];
+    
+    void setup(const ScreenConfig& sc, float theta, float phi,
+        int width, int height);
+};
+
+// CPU version of simple-mono.vert + simple-mono.frag with an equirect
+// source: projects every pixel of a screen onto the equirect frame and
+// samples it bilinearly, like GL_LINEAR with GL_REPEAT does.
+//
+// Directions are turned into longitude and latitude four pixels at a time
+// (SSE2) with a polynomial atan2; latitude is atan2(z, |xy|), so no asin
+// or normalize is needed. The polynomial is off by at most 1.8e-6 radians,
+// or 0.005 texels of a 16K wide video. Rows are split into bands of
+// CPU_RENDER_BAND_ROWS and shared out between threads.
+//
+// Used as a reference for the shaders, to draw on nodes whose GL can't run
+// them (--cpu-render), and to render screens offline.
+struct CpuRenderer
+{
+    std::vector<pthread_t> threads; // helpers; the caller works too
+    
+    pthread_barrier_t start_barrier; // caller + helpers: job published
+    pthread_barrier_t done_barrier;  // caller + helpers: all rows drawn
+    
+    pthread_mutex_t mutex; // protects next_row
+    int next_row;
+    
+    bool exit_flag;
+    
+    // equirect RGB frame to sample, rows top to bottom, no padding
+    const unsigned char* source;
+    int source_width;
+    int source_height;
+    
+    // current job; written only while the helpers wait at start_barrier
+    ScreenBasis basis;
+    unsigned char* target;
+    int target_width;
+    int target_height;
+    
+    CpuRenderer() : next_row(0), exit_flag(false), source(NULL),
+        source_width(0), source_height(0), target(NULL), target_width(0),
+        target_height(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    // starts thread_count-1 helper threads (0 for one per CPU)
+    void start(int thread_count = 0);
+    
+    // frame to sample from. Must stay valid while render() uses it.
+    void set_source(const unsigned char* rgb, int width, int height)
+    {
+        source = rgb;
+        source_width = width;
+        source_height = height;
+    }
+    
+    // draws the screen as seen with the view turned by theta/phi into out:
+    // width x height RGB pixels, rows top to bottom, no padding
+    void render(const ScreenConfig& sc, float theta, float phi,
+        unsigned char* out, int width, int height);
+    
+    // stops and joins the helper threads
+    void stop();
+    
+    // main loop for a helper thread
+    // do not call this directly; it will be run indirectly by start()
+    void loop();
+    
+    // draws bands until none are left (any thread)
+    void draw_bands();
+};
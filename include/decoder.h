@@ -5,6 +5,7 @@ extern "C" {
     #include <libavformat/avformat.h>
     #include <libswscale/swscale.h>
     #include <libavutil/time.h>
+    #include <libavutil/spherical.h>
 }
 
 #include <pthread.h>
@@ -17,12 +18,26 @@ extern "C" {
 #include "audio.h"
 #endif
 
+#include "polar.h"
+
+// how the sphere is laid out in the video frame
+enum Projection
+{
+    PROJECTION_EQUIRECT,
+    PROJECTION_CUBEMAP, // 3x2, spherical video v2 "cbmp" layout
+    PROJECTION_EAC      // 3x2 equi-angular cubemap
+};
+
 struct DecoderFrame
 {
     AVFrame* frame;
     bool seek_result;
     
-    DecoderFrame() : frame(NULL), seek_result(false) {}
+    // GPU ring slot holding this frame's pixels (see UploadThread),
+    // or -1 if it has to be uploaded from frame->data
+    int slot;
+    
+    DecoderFrame() : frame(NULL), seek_result(false), slot(-1) {}
 };
 
 struct Decoder
@@ -53,6 +68,13 @@ struct Decoder
     int64_t duration; // of the whole stream in time_base units
     int64_t number_of_frames; // in the whole stream, or 0 if unknown
     
+    // layout from the container's spherical metadata (equirect if none)
+    Projection projection;
+    
+    // if set, frames are packed by this right after conversion to RGB
+    // (owned by Player)
+    const PolarPacking* polar_packing;
+    
     int video_stream_index;
     int audio_stream_index;
     
@@ -83,6 +105,9 @@ struct Decoder
         
         seek_flag = false;
         looping = false;
+        
+        projection = PROJECTION_EQUIRECT;
+        polar_packing = NULL;
     }
     
     // opens a video file, returning true if successful
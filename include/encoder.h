@@ -0,0 +1,58 @@
+#pragma once
+
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+    #include <libswscale/swscale.h>
+}
+
+#include <string>
+#include <stdint.h>
+
+// Writes RGB frames to a video file (container picked from the file name)
+// as H.264 with libx264, or MPEG-4 part 2 if libavcodec was built without
+// it. Frames keep the timestamps they are given, so a file written from a
+// decoded video plays back in step with the original.
+struct Encoder
+{
+    AVFormatContext* format_context;
+    AVCodecContext*  codec_context;
+    AVStream*        stream;
+    
+    struct SwsContext* sws_context; // RGB24 -> YUV420P
+    AVFrame* yuv_frame;
+    
+    std::string path;
+    int width;
+    int height;
+    
+    Encoder()
+    {
+        format_context = NULL;
+        codec_context = NULL;
+        stream = NULL;
+        
+        sws_context = NULL;
+        yuv_frame = NULL;
+        
+        width = 0;
+        height = 0;
+    }
+    
+    // creates the file for width x height frames (both even) whose pts are
+    // in time_base units. frame_rate only sets the keyframe interval.
+    // quits with an error on failure.
+    void open(const std::string& path, int width, int height,
+        AVRational time_base, AVRational frame_rate);
+    
+    // encodes one frame: width x height RGB pixels, rows top to bottom,
+    // no padding
+    void write(const unsigned char* rgb, int64_t pts);
+    
+    // drains the encoder, finishes the file, and frees everything
+    void close();
+    
+    // writes out whatever packets the encoder has ready
+    // do not call this directly; used by write() and close()
+    void write_packets();
+};
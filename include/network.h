@@ -19,19 +19,16 @@
 
 #include <pthread.h>
 #include <list>
+#include <deque>
 #include <stdexcept>
 
+#include "wakeup.h"
+#include "stats.h"
+
 #define VIDEO_SPHERE_PORT 4545
 
 struct Connection;
 
-enum IncomingMsgState
-{
-    MSG_STATE_NO_DATA,
-    MSG_STATE_WAIT_FOR_SIZE,
-    MSG_STATE_READING_DATA
-};
-
 struct ParseError : public std::runtime_error 
 {
     ParseError(const std::string& what_arg) : std::runtime_error(what_arg) {};
@@ -54,27 +51,6 @@ struct Message
         return bytes.size();
     }
     
-    void reply(const std::string& data)
-    {
-        uint32_t size = (uint32_t)data.size();
-        size = htonl(size);
-        ::send(fd, &size, sizeof(size), 0);
-        ::send(fd, &data[0], data.size(), 0);
-    }
-    
-    void reply(const std::vector<unsigned char>& data)
-    {
-        uint32_t size = (uint32_t)data.size();
-        size = htonl(size);
-        ::send(fd, &size, sizeof(size), 0);
-        ::send(fd, &data[0], data.size(), 0);
-    }
-    
-    void reply(const Message& m)
-    {
-        reply(m.bytes);
-    }
-    
     // message parsing
     int parse_pos;
     
@@ -119,13 +95,13 @@ struct Message
             throw ParseError("Not enough bytes in message to read int64");
         
         int64_t result = 0;
-        result |= bytes[parse_pos++] << 56;
-        result |= bytes[parse_pos++] << 48;
-        result |= bytes[parse_pos++] << 40;
-        result |= bytes[parse_pos++] << 32;
-        result |= bytes[parse_pos++] << 24;
-        result |= bytes[parse_pos++] << 16;
-        result |= bytes[parse_pos++] <<  8;
+        result |= (uint64_t)bytes[parse_pos++] << 56;
+        result |= (uint64_t)bytes[parse_pos++] << 48;
+        result |= (uint64_t)bytes[parse_pos++] << 40;
+        result |= (uint64_t)bytes[parse_pos++] << 32;
+        result |= (uint64_t)bytes[parse_pos++] << 24;
+        result |= (uint64_t)bytes[parse_pos++] << 16;
+        result |= (uint64_t)bytes[parse_pos++] <<  8;
         result |= bytes[parse_pos++];
         
         return result;
@@ -137,13 +113,13 @@ struct Message
             throw ParseError("Not enough bytes in message to read uint64");
         
         uint64_t result = 0;
-        result |= bytes[parse_pos++] << 56;
-        result |= bytes[parse_pos++] << 48;
-        result |= bytes[parse_pos++] << 40;
-        result |= bytes[parse_pos++] << 32;
-        result |= bytes[parse_pos++] << 24;
-        result |= bytes[parse_pos++] << 16;
-        result |= bytes[parse_pos++] <<  8;
+        result |= (uint64_t)bytes[parse_pos++] << 56;
+        result |= (uint64_t)bytes[parse_pos++] << 48;
+        result |= (uint64_t)bytes[parse_pos++] << 40;
+        result |= (uint64_t)bytes[parse_pos++] << 32;
+        result |= (uint64_t)bytes[parse_pos++] << 24;
+        result |= (uint64_t)bytes[parse_pos++] << 16;
+        result |= (uint64_t)bytes[parse_pos++] <<  8;
         result |= bytes[parse_pos++];
         
         return result;
@@ -170,13 +146,13 @@ struct Message
             throw ParseError("Not enough bytes in message to read double");
         
         uint64_t result = 0;
-        result |= bytes[parse_pos++] << 56;
-        result |= bytes[parse_pos++] << 48;
-        result |= bytes[parse_pos++] << 40;
-        result |= bytes[parse_pos++] << 32;
-        result |= bytes[parse_pos++] << 24;
-        result |= bytes[parse_pos++] << 16;
-        result |= bytes[parse_pos++] <<  8;
+        result |= (uint64_t)bytes[parse_pos++] << 56;
+        result |= (uint64_t)bytes[parse_pos++] << 48;
+        result |= (uint64_t)bytes[parse_pos++] << 40;
+        result |= (uint64_t)bytes[parse_pos++] << 32;
+        result |= (uint64_t)bytes[parse_pos++] << 24;
+        result |= (uint64_t)bytes[parse_pos++] << 16;
+        result |= (uint64_t)bytes[parse_pos++] <<  8;
         result |= bytes[parse_pos++];
         
         return *(double*)&result;
@@ -309,20 +285,54 @@ struct Message
     Message() : fd(0), parse_pos(0) {}
 };
 
+// a message waiting to go out to a client, with its length in front
+struct OutgoingMessage
+{
+    std::vector<unsigned char> bytes;
+    bool sync; // a time sync, made stale by the next one
+};
+
+// room a connection's receive buffer starts with, and the least it reads
+// into at a time (it grows for messages bigger than that)
+#define CONNECTION_RECV_SIZE 16384
+#define CONNECTION_RECV_MIN 4096
+
+// payload buffers up to this size are kept for reuse once the main thread
+// is done with the message (see NetworkThread::get_messages()), up to
+// MESSAGE_POOL_MAX of them
+#define MESSAGE_POOL_BUFFER_MAX 65536
+#define MESSAGE_POOL_MAX 256
+
+// most buffers a connection holds on to for the messages it's yet to get
+#define CONNECTION_SPARE_MAX 16
+
+typedef std::vector<std::vector<unsigned char> > BufferPool;
+
 struct Connection
 {
     int fd;
     
-    // recv info
-    IncomingMsgState state;
-    uint32_t expect_bytes;
-    std::vector<unsigned char> bytes;
+    // recv info: bytes in[in_start, in_end) have arrived but don't make up
+    // a whole message yet
+    std::vector<unsigned char> in;
+    size_t in_start;
+    size_t in_end;
+    std::vector<Message> ready; // whole, not yet handed over
+    BufferPool spare;           // taken from pool for the next ones
     
-    pthread_mutex_t* msg_mutex;
+    pthread_mutex_t* msg_mutex; // protects msg_queue and pool
     std::vector<Message>* msg_queue;
+    BufferPool* pool;
+    
+    // send info (server side; see Server)
+    std::deque<OutgoingMessage> out;
+    size_t out_offset; // bytes of out.front() already written
+    size_t out_bytes;  // not yet written
+    bool overflowed;   // fell too far behind; to be disconnected
     
-    Connection(int FD = 0) : fd(FD), state(MSG_STATE_NO_DATA), 
-        expect_bytes(0), msg_mutex(NULL), msg_queue(NULL) {}
+    Connection(int FD = 0) : fd(FD), in_start(0), in_end(0),
+        msg_mutex(NULL), msg_queue(NULL), pool(NULL), out_offset(0),
+        out_bytes(0), overflowed(false) {}
     
     void send(const std::string& data)
     {
@@ -340,52 +350,20 @@ struct Connection
         ::send(fd, &data[0], data.size(), 0);
     }
     
-    void on_data_byte(unsigned char byte)
-    {
-        switch(state)
-        {
-            case MSG_STATE_NO_DATA:
-                state = MSG_STATE_WAIT_FOR_SIZE;
-                // fallthrough
+    // Reads everything waiting on the socket straight into the receive
+    // buffer, splits it into messages a length prefix at a time, and
+    // hands them over under one lock. False once the other end has gone.
+    bool receive();
                 
-            case MSG_STATE_WAIT_FOR_SIZE:
-                bytes.push_back(byte);
+  private:
+    // somewhere to read at least CONNECTION_RECV_MIN bytes into
+    void make_room();
                 
-                if(bytes.size() == sizeof(uint32_t))
-                {
-                    expect_bytes = ntohl(*(uint32_t*)&bytes[0]);
-                    bytes.clear();
-                    state = MSG_STATE_READING_DATA;
-                }
-                break;
+    // moves the whole messages out of the receive buffer into ready
+    void parse();
             
-            case MSG_STATE_READING_DATA:
-                bytes.push_back(byte);
-                if(bytes.size() == expect_bytes)
-                {
-                    Message msg;
-                    msg.bytes.swap(bytes);
-                    msg.fd = fd;
-                    
-                    pthread_mutex_lock(msg_mutex);
-                    msg_queue->push_back(msg);
-                    pthread_mutex_unlock(msg_mutex);
-                    
-                    state = MSG_STATE_NO_DATA;
-                    bytes.clear();
-                }
-                break;
-        }
-    }
-    
-    void on_data(ssize_t size, unsigned char* data)
-    {
-        for(ssize_t i = 0; i < size; i++)
-        {
-            on_data_byte(*data);
-            data++;
-        }
-    }
+    // appends ready to msg_queue
+    void deliver();
 };
 
 class NetworkThread
@@ -394,23 +372,45 @@ class NetworkThread
   protected:
     pthread_mutex_t mutex;
     std::vector<Message> messages;
+    BufferPool pool; // payload buffers to reuse (under mutex)
     pthread_t thread;
     
     bool quit_flag;
   
   public:
+    // signaled whenever data arrives, if set (before start_thread())
+    Wakeup* wakeup;
+    
     NetworkThread()
     {
         pthread_mutex_init(&mutex, NULL);
         quit_flag = false;
+        wakeup = NULL;
+        pool.reserve(MESSAGE_POOL_MAX);
     }
     
     virtual ~NetworkThread();
     
+    // hands over the messages received since the last call; whatever was
+    // in into_buffer is done with, and its buffers are reused
     void get_messages(std::vector<Message>& into_buffer)
     {       
         pthread_mutex_lock(&mutex);
         
+        for(size_t i = 0; i < into_buffer.size(); i++)
+        {
+            std::vector<unsigned char>& bytes = into_buffer[i].bytes;
+            
+            if(pool.size() == MESSAGE_POOL_MAX || bytes.capacity() == 0 ||
+                bytes.capacity() > MESSAGE_POOL_BUFFER_MAX)
+            {
+                continue;
+            }
+            
+            pool.push_back(std::vector<unsigned char>());
+            pool.back().swap(bytes);
+        }
+        
         into_buffer.swap(messages);
         messages.clear();
         
@@ -425,6 +425,7 @@ class NetworkThread
     {
         pthread_mutex_lock(&mutex);
         quit_flag = true;
+        pthread_mutex_unlock(&mutex);
     }
     
     virtual void join()
@@ -447,27 +448,88 @@ class DummyNetworkingThread : public NetworkThread
     virtual void loop() {}
 };
 
+// most clients a server takes at once
+#define SERVER_MAX_CONNECTIONS 1024
+
+// a client with this much queued for it is behind: time syncs waiting for
+// it are dropped in favour of the newest
+#define SERVER_OUT_HIGH_WATER (256 * 1024)
+
+// a client with this much queued for it is disconnected
+#define SERVER_OUT_LIMIT (4 * 1024 * 1024)
+
+// Serves clients from one epoll (edge-triggered) loop. Connections live in
+// a table of SERVER_MAX_CONNECTIONS slots that is allocated once; free
+// slots are kept on a stack and live ones in a list that a slot can be
+// swapped out of, so a client connecting or leaving costs the same with
+// 100 others connected as with one. Each readable socket is read until it
+// would block.
+//
+// send() never blocks: it queues the message on every client's connection
+// and wakes the network thread, which writes each queue out (several
+// messages per system call) as far as the socket takes it, and carries on
+// when it has room again. A client that falls behind has its queued time
+// syncs dropped (see send_sync()), and one that gets SERVER_OUT_LIMIT
+// behind is disconnected rather than holding up the others.
 class Server : public NetworkThread
 {
-    std::vector<pollfd> pollfds;
-    std::vector<Connection> conns;
+    int epoll_fd;
+    int listen_fd;
+    int quit_fd; // eventfd that set_quit() writes to end loop()
+    int send_fd; // eventfd that send() writes to when there's output
+    
+    size_t out_total;      // queued for every client
+    size_t dropped_syncs;  // (counters since the last stats update)
+    size_t overflows;
+    
+    std::vector<Connection> conns; // by slot
+    std::vector<int> free_slots;
+    std::vector<int> live;       // slots in use, in no order
+    std::vector<int> live_index; // by slot: its position in live
+    
+    // protects the table (not the connections' read state, which is the
+    // network thread's alone) from send() on other threads
+    pthread_mutex_t conns_mutex;
     
     unsigned short port;
     
+    void add_connection(int fd);
+    void remove_connection(int slot);
+    
+    // queues data for the slot (conns_mutex locked)
+    void enqueue(int slot, const unsigned char* data, size_t size,
+        bool sync);
+    
+    // queues data for every client and wakes the network thread
+    void broadcast(const unsigned char* data, size_t size, bool sync);
+    
+    // writes out as much of the slot's queue as the socket takes; false
+    // if the client has gone or fell too far behind
+    bool flush(int slot);
+    
+    void update_stats();
+    
   public:
-    Server(unsigned short port = VIDEO_SPHERE_PORT) : NetworkThread(), port(port) {}
+    // counters for the outgoing queues go here, if set (before
+    // start_thread())
+    Stats* stats;
+    
+    Server(unsigned short port = VIDEO_SPHERE_PORT) : NetworkThread(),
+        epoll_fd(-1), listen_fd(-1), quit_fd(-1), send_fd(-1),
+        out_total(0), dropped_syncs(0), overflows(0), port(port),
+        stats(NULL)
+    {
+        conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
     
     virtual void send(const std::vector<unsigned char>& data)
     {
-        // starts from 1 since 0 is the listening socket
-        for(size_t i = 1; i < conns.size(); i++)
-            conns[i].send(data);
+        broadcast(data.size() ? &data[0] : NULL, data.size(), false);
     }
     
     virtual void send(const std::string& data)
     {
-        for(size_t i = 1; i < conns.size(); i++)
-            conns[i].send(data);
+        broadcast((const unsigned char*)data.data(), data.size(), false);
     }
     
     virtual void send(const Message& m)
@@ -475,8 +537,22 @@ class Server : public NetworkThread
         send(m.bytes);
     }
     
+    // sends a time sync: only the newest one matters, so a client that is
+    // behind gets it in place of the ones still waiting for it
+    void send_sync(const Message& m);
+    
+    // sends to the one client that m came from
+    void send_to(const Message& from, const Message& m);
+    
     virtual void start_thread();
     
+    // wakes loop() straight away to end it
+    virtual void set_quit();
+    
+    // waits for loop() to end, then closes the listening socket and the
+    // server's other descriptors, so the port is free again
+    virtual void join();
+    
     // don't call this directly; use start_thread()
     virtual void loop();
 };
@@ -5,6 +5,18 @@
 #include "decoder.h"
 #include "multicast.h"
 #include "window.h"
+#include "render.h"
+#include "uploader.h"
+#include "stats.h"
+#include "shader.h"
+#include "cpu_render.h"
+#include "quality.h"
+#include "wakeup.h"
+#include "swap_barrier.h"
+#include "clock_sync.h"
+#include "command_queue.h"
+#include "ready_barrier.h"
+#include "state_sync.h"
 
 #ifndef NO_AUDIO
 #include "audio.h"
@@ -34,6 +46,13 @@ enum StereoType
     STEREO_TOP_BOTTOM_INTERLEAVED
 };
 
+enum AntiAliasMode
+{
+    AA_NONE,        // single sample per pixel, no mipmaps
+    AA_SUPERSAMPLE, // 4x4 samples per pixel (aa-mono.frag)
+    AA_MIPMAP       // mipmapped, anisotropic sampling (mip-mono.frag)
+};
+
 struct Player
 {
     NetworkType type;
@@ -99,6 +118,118 @@ struct Player
     
     StereoType stereo_type;
     
+    // layout of the sphere in the video frames. Taken from the container
+    // metadata unless given with --projection.
+    Projection projection;
+    bool projection_set;
+    
+    // anti-aliasing used for mono output (and toggled by the 'K' message)
+    AntiAliasMode aa_mode;
+    
+    // draw each window from its own thread (see RenderThreads)
+    bool render_threads;
+    
+    // draw and swap on a thread separate from the control loop
+    // (see RenderLoop)
+    bool decoupled_render;
+    
+    // pack polar rows of equirect frames before upload (see PolarPacking)
+    bool polar_decimation;
+    PolarPacking polar;
+    
+    // split frames into a grid of textures (see TileGrid). Used when the
+    // frame is bigger than GL_MAX_TEXTURE_SIZE, or always if tile_size is
+    // given. Tiles no screen shows aren't uploaded if tile_culling is set.
+    int tile_size; // per layer including border, 0 to pick automatically
+    bool tiled;
+    bool tile_culling;
+    TileGrid tile_grid;
+    
+    // convert each video frame to a cubemap before drawing (mono only)
+    bool cubemap;
+    
+    // draw windows offscreen at a resolution that follows frame time
+    bool dynamic_resolution;
+    ResolutionScaler scaler;
+    
+    // every program a window might draw with (see get_program), and a
+    // lock so that windows drawn from their own threads don't compile
+    // a program they share twice
+    std::vector<ProgramSpec> programs;
+    pthread_mutex_t program_mutex;
+    
+    // where linked programs are cached between runs, empty for none
+    std::string shader_cache;
+    
+    // project each screen on the CPU and draw it with glDrawPixels, for
+    // nodes whose GL can't run the shaders (see CpuRenderer)
+    bool cpu_render;
+    int cpu_threads; // 0 for one per CPU
+    CpuRenderer cpu_renderer;
+    
+    // draw into offscreen EGL pbuffers (sized like the screens) instead
+    // of windows, e.g. on a test machine with no display
+    bool offscreen;
+    
+    // play this many frames as fast as possible and report how long each
+    // stage took (see run_bench), saving what each screen drew to
+    // dump_dir if set
+    int bench_frames;
+    std::string dump_dir;
+    
+    // --prewarp: write a pre-rendered stream per host into prewarp_dir
+    // instead of playing (see run_prewarp)
+    std::string prewarp_dir;
+    
+    // play a stream written by --prewarp: each window shows its own
+    // screen's part of the frame as it is, without projecting anything
+    bool prewarped;
+    int prewarp_width;  // size of this host's pre-warped frames
+    int prewarp_height;
+    
+    // --config is in CalVR's format rather than our own
+    bool config_calvr;
+    
+    // wakes the main loop when it's idle (see Wakeup)
+    Wakeup wakeup;
+    
+    // a window was exposed or resized and needs drawing even though
+    // nothing else changed (set by GLFW callbacks on the main thread)
+    bool redraw_requested;
+    
+    // timings and counters, printed periodically with --stats
+    Stats stats;
+    
+    // when the next frame will reach the screen (see VblankPredictor)
+    VblankPredictor vblank;
+    
+    // --auto-quality: picks the shader mode for the whole cluster from
+    // every node's frame time
+    QualityGovernor governor;
+    
+    // --swap-barrier: every node swaps only once the whole wall has drawn
+    // its frame
+    SwapBarrier swap_barrier;
+    
+    // keeps clients' clocks in step with the server's (see ClockSync)
+    ClockSync clock_sync;
+    
+    // control messages waiting for their frame (see CommandQueue)
+    CommandQueue commands;
+    
+    // --ready-frames: holds the clock at the start and after seeks until
+    // every node can play on
+    ReadyBarrier ready;
+    
+    // the server's time and view, sent as one snapshot (see StateSync)
+    StateSync state;
+    
+    // upload frames to the GPU ahead of time on their own thread
+    // (see UploadThread)
+    bool upload_thread;
+    int upload_ring; // number of frames held on the GPU
+    UploadThread uploader;
+    
     Player()
     {
         type = NT_UNDEFINED;
@@ -114,6 +245,30 @@ struct Player
         paused = false;
         
         stereo_type = STEREO_NONE;
+        aa_mode = AA_SUPERSAMPLE;
+        projection = PROJECTION_EQUIRECT;
+        projection_set = false;
+        render_threads = false;
+        decoupled_render = false;
+        cubemap = false;
+        polar_decimation = false;
+        tile_size = 0;
+        tiled = false;
+        tile_culling = false;
+        dynamic_resolution = false;
+        upload_thread = false;
+        upload_ring = 4;
+        program_mutex = PTHREAD_MUTEX_INITIALIZER;
+        cpu_render = false;
+        cpu_threads = 0;
+        offscreen = false;
+        bench_frames = 0;
+        prewarped = false;
+        prewarp_width = 0;
+        prewarp_height = 0;
+        config_calvr = false;
+        redraw_requested = false;
+        shader_cache = default_shader_cache();
         
         use_multicast = false;
         looping = false;
@@ -129,11 +284,43 @@ struct Player
     // assumes arguments are fully parsed first.
     void start_threads();
     
+    // sets up decoder.polar_packing if --polar-decimation applies to this
+    // video; call after opening the decoder and before starting it
+    void setup_polar_packing();
+    
     // opens GLFW windows based on settings in screen_config
     void create_windows();
     
-    // seek to time (in microseconds)
+    // seek to time (in microseconds). The server schedules it for the
+    // whole cluster (see schedule_command).
     void seek(int64_t target);
+    
+    // seek here, straight away
+    void seek_now(int64_t target);
+    
+    // server: sends a control message to every client to apply at the
+    // same frame, COMMAND_LEAD from now, and queues it to be handled here
+    // then too
+    void schedule_command(const Message& command);
+    
+    // next video frame, from the upload thread if there is one or
+    // straight from the decoder otherwise
+    DecoderFrame get_frame()
+    {
+        if(upload_thread)
+            return uploader.get_frame();
+        
+        return decoder.get_frame();
+    }
+    
+    // hands a frame from get_frame() back to wherever it came from
+    void return_frame(DecoderFrame df)
+    {
+        if(df.slot >= 0)
+            uploader.return_frame(df);
+        else
+            decoder.return_frame(df);
+    }
 };
 
 void parse_args(Player& player, int argc, char** argv);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+
+// rows of one band are all decimated by the same power of two
+struct PolarBand
+{
+    int first_row;  // in the decoded frame
+    int rows;
+    int per_row;    // frame rows packed side by side into each texture row
+    int packed_row; // first row of the band in the packed frame
+};
+
+// Equirect rows near the poles cover a circle of latitude much shorter than
+// the equator but still get the full frame width. This packs each row down
+// to the next power of two at or above the width its latitude needs --
+// width / 2^k for cos(lat) <= 1 / 2^k -- and fits the narrow rows side by
+// side, so the frame that gets uploaded has fewer rows. Nothing is lost:
+// every row keeps at least as many pixels as its circle of latitude needs
+// at the equator's pixel spacing.
+//
+// The shaders find rows again with sample_video() from sample-polar.frag.
+struct PolarPacking
+{
+    int width;
+    int height;        // rows in the decoded frame
+    int packed_height; // rows in the packed frame
+    
+    std::vector<PolarBand> bands; // top to bottom
+    
+    PolarPacking() : width(0), height(0), packed_height(0) {}
+    
+    // works out the bands for a frame of images equirects stacked on top
+    // of each other (2 for top/bottom stereo)
+    void setup(int width, int height, int images);
+    
+    // packs an RGB24 frame in place; its first packed_height rows are then
+    // the packed frame
+    void pack(unsigned char* rgb, int linesize) const;
+    
+    // sets the band uniforms of sample-polar.frag in program
+    void set_uniforms(GLuint program) const;
+};
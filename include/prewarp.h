@@ -0,0 +1,22 @@
+#pragma once
+
+#include "screen.h"
+
+#include <vector>
+
+struct Player;
+
+// Lays a host's screens out left to right, tops aligned, in config order,
+// the way they are packed into its pre-warped stream: sets each screen's
+// stream_x and returns the size of the stream's frames (rounded up to
+// even, as 4:2:0 video needs).
+void layout_prewarp(std::vector<ScreenConfig>& screens,
+    int& width, int& height);
+
+// --prewarp: renders the whole video, as seen from the starting view, for
+// every host in the screen config with CpuRenderer, and encodes each host's
+// screens into <prewarp_dir>/<host>.mp4 (see Encoder) at the resolution the
+// config gives them. Frames keep the source video's timestamps, so clients
+// playing these with --prewarped follow the server's clock like any other
+// client. The video is decoded only once for all the hosts.
+void run_prewarp(Player& player);
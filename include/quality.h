@@ -0,0 +1,105 @@
+#pragma once
+
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+// shader modes the governor chooses between, cheapest first
+enum QualityMode
+{
+    QUALITY_PLAIN, // plain mono shader
+    QUALITY_AA,    // the --aa shader
+    QUALITY_MODES
+};
+
+// what the server last heard from one node
+struct NodeQuality
+{
+    int mode; // being drawn, -1 before the first report
+    
+    // smoothed frame time last measured in each mode, and when
+    // (av_gettime_relative(), 0 if never)
+    double ms[QUALITY_MODES];
+    int64_t when[QUALITY_MODES];
+    
+    NodeQuality() : mode(-1)
+    {
+        for(int i = 0; i < QUALITY_MODES; i++)
+        {
+            ms[i] = 0.0;
+            when[i] = 0;
+        }
+    }
+};
+
+// --auto-quality: picks the best shader mode every node can draw within
+// the refresh interval, instead of waiting for someone to press 'K'.
+//
+// Each node times its windows like ResolutionScaler does (report/update)
+// and sends the smoothed frame time, with the mode it was drawn in, to the
+// server ('R'). The server drops to the plain shader as soon as any node
+// runs over budget, and tries the anti-aliased one again once every node
+// has plenty of headroom. A change is scheduled ('Q', see CommandQueue)
+// like a seek or pause, and every node, the server included, switches on
+// the same frame, so the wall never shows mixed quality.
+struct QualityGovernor
+{
+    pthread_mutex_t mutex; // protects everything below
+    
+    bool enabled;
+    double budget_ms; // refresh interval
+    
+    // === this node ===
+    int mode; // being drawn
+    
+    double frame_ms;   // slowest window of the frame being drawn
+    double average_ms; // smoothed frame time in mode
+    int samples;       // frames in average_ms
+    
+    // server: switch sent but not yet applied, or -1
+    int pending_mode;
+    
+    // === server only ===
+    std::map<std::string, NodeQuality> nodes; // by hostname
+    int64_t last_change; // av_gettime_relative() of the last decision
+    std::string reason;  // for the last decision
+    
+    QualityGovernor() : enabled(false), budget_ms(1000.0/60.0),
+        mode(QUALITY_AA), frame_ms(0.0), average_ms(0.0), samples(0),
+        pending_mode(-1), last_change(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    // called from each window's render (any thread) with its timings
+    // (gpu_ms is -1 when unknown)
+    void report(double gpu_ms, double cpu_ms);
+    
+    // called once per display frame after every window has been drawn
+    void update(Stats& stats);
+    
+    // the mode now being drawn; starts a new average if it changed, and
+    // ends a pending switch
+    void set_mode(int mode);
+    
+    // this node's smoothed frame time, if enough frames have been drawn
+    // in the current mode to go on
+    bool measurement(int& mode, double& ms);
+    
+    // server: record a node's measurement
+    void on_report(const std::string& host, int mode, double ms);
+    
+    // server: the mode every node should switch to, or -1 to stay.
+    // Sets reason when it returns a mode.
+    int decide();
+    
+    // server: a switch to mode has been scheduled; nothing else is
+    // decided until it has been applied (set_mode())
+    void schedule(int mode);
+};
+
+const char* quality_mode_name(int mode);
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "network.h"
+
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+// how long the server waits for every node before giving up on the slow
+// ones: longer at the start, while nodes are still being launched
+#define READY_START_TIMEOUT (10 * 1000000)
+#define READY_SEEK_TIMEOUT (3 * 1000000)
+
+// --ready-frames: holds the cluster's clock at the start and after every
+// seek until every node has frames to show from there, so the fastest
+// decoder doesn't run ahead while the others are still seeking.
+//
+// The server starts a round by scheduling 'H' (round, frames) right after
+// the seek (see CommandQueue), and every node, the server included, stops
+// its clock where the seek lands. Once a node's decoder has `frames` frames
+// queued, it reports 'Y' (round, host). When every member has, or the
+// timeout runs out, the server schedules 'G' (round) and every node starts
+// its clock again from the same frame. Nodes that didn't make it in time
+// are logged and left out of later rounds until they report again.
+//
+// Members are the hosts in the server's --config plus any node that has
+// ever reported, and the server itself. Main thread only.
+struct ReadyBarrier
+{
+    bool enabled;
+    int frames; // queued on a node before it's ready
+    
+    // === every node ===
+    bool holding;  // clock stopped, from 'H' until 'G'
+    int round;     // held for
+    bool reported; // ready for round
+    
+    // === server ===
+    int last_round;
+    bool waiting; // for last_round's nodes (until 'G' is sent)
+    int64_t started;  // av_gettime_relative()
+    int64_t deadline;
+    std::set<std::string> members;
+    std::set<std::string> ready; // in last_round
+    
+    ReadyBarrier() : enabled(false), frames(3), holding(false), round(0),
+        reported(false), last_round(0), waiting(false), started(0),
+        deadline(0) {}
+    
+    // server: starts a round (self being the server's own host), and
+    // returns the 'H' to schedule
+    Message begin(const std::string& self, int64_t timeout);
+    
+    // 'H': stop the clock for round
+    void on_hold(int round);
+    
+    // server: 'Y' from host
+    void on_ready(const std::string& host, int round);
+    
+    // server: true once the round is over, with the members that were
+    // given up on in stragglers (and dropped)
+    bool complete(std::vector<std::string>& stragglers);
+    
+    // 'G': start the clock again, if round is the one being held for
+    void on_release(int round);
+};
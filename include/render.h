@@ -0,0 +1,268 @@
+#pragma once
+
+#include "window.h"
+#include "decoder.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include <GL/glew.h>
+
+struct Player;
+
+// everything the windows need to draw one display frame
+struct RenderFrame
+{
+    float theta;
+    float phi;
+    
+    // playback time (microseconds since start of video) this frame was
+    // prepared for
+    int64_t now;
+    
+    // program to draw with (see Window_)
+    GLint Window_::* shader_program;
+    
+    // new RGB video data to upload before drawing, or NULL to redraw the
+    // texture already on the GPU. Must stay valid until rendering returns.
+    unsigned char* pixels;
+    int width;
+    int height;
+    
+    // decoder frame that pixels points into, if any. Whoever draws the
+    // frame last hands it back to the decoder (see RenderLoop).
+    DecoderFrame frame;
+    
+    RenderFrame() : theta(0.0), phi(0.0), now(0), shader_program(NULL),
+        pixels(NULL), width(0), height(0) {}
+};
+
+// Picks how much of each window's resolution to draw at when using
+// --dynamic-resolution. Windows are drawn into an offscreen buffer at
+// scale * window size (per axis) and stretched over the window, and scale
+// follows the measured frame time so that drawing fits inside the refresh
+// interval instead of missing vsync.
+struct ResolutionScaler
+{
+    pthread_mutex_t mutex; // protects everything below
+    
+    float scale;      // current fraction of full resolution, per axis
+    float min_scale;
+    double budget_ms; // refresh interval
+    
+    // slowest window of the frame being drawn (reset by update())
+    double frame_gpu_ms;
+    double frame_cpu_ms;
+    
+    double average_ms; // smoothed max(gpu, cpu) time per frame
+    
+    // hysteresis: scale only changes after the frame time has been on
+    // the same side of a threshold for a while, and then not again until
+    // the average has had time to settle
+    int over_count;
+    int under_count;
+    int cooldown;
+    
+    ResolutionScaler() : scale(1.0), min_scale(0.5), budget_ms(1000.0/60.0),
+        frame_gpu_ms(0.0), frame_cpu_ms(0.0), average_ms(-1.0),
+        over_count(0), under_count(0), cooldown(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    float get_scale()
+    {
+        pthread_mutex_lock(&mutex);
+        float result = scale;
+        pthread_mutex_unlock(&mutex);
+        
+        return result;
+    }
+    
+    // called from each window's render (any thread) with its timings
+    void report(double gpu_ms, double cpu_ms);
+    
+    // called once per display frame after every window has been drawn
+    void update(Stats& stats);
+};
+
+// Predicts when the next vblank will be, so that the main loop can pick
+// the video frame for when it will actually be seen rather than for when
+// the loop happened to look at the clock. Vblanks are modelled as a grid
+// (base + k*period) that is pulled towards each presentation time seen
+// (see Window_::present_time), with period following the measured spacing.
+// Times are av_gettime_relative() microseconds.
+struct VblankPredictor
+{
+    pthread_mutex_t mutex; // protects everything below
+    
+    double period; // between vblanks
+    double base;   // a point on the grid
+    int64_t last;  // last presentation time seen, 0 for none
+    int samples;
+    double jitter; // smoothed distance of presentation times from the grid
+    
+    VblankPredictor() : period(1000000.0/60.0), base(0.0), last(0),
+        samples(0), jitter(0.0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    // called once per display frame, after the swap, with when it was
+    // presented
+    void on_present(int64_t when, Stats& stats);
+    
+    // the first vblank at or after now, or now until enough presentations
+    // have been seen to go on
+    int64_t predict(int64_t now);
+};
+
+// How to build one of Window_'s programs. Programs are only compiled the
+// first time a window draws with them, so modes that are never selected
+// cost nothing at start-up.
+struct ProgramSpec
+{
+    GLint Window_::* program;
+    std::vector<std::string> files;
+    
+    ProgramSpec(GLint Window_::* program, 
+        const std::vector<std::string>& files) : 
+        program(program), files(files) {}
+};
+
+// the window's program, compiling it (or taking it from a window whose
+// context shares with this one and that is drawn on the same thread) on
+// first use. Texture units and the
+// uniforms fixed for the whole run are set on it then.
+// the window's context must be current on the calling thread
+GLuint get_program(Player& player, size_t index, GLint Window_::* program);
+
+// uploads (if needed) and draws one window
+// the window's context must be current on the calling thread
+void render_window(Player& player, size_t index, const RenderFrame& rf);
+
+// the two halves of render_window() without --dynamic-resolution, for
+// timing them separately (see run_bench): getting the frame's pixels onto
+// the GPU, and drawing the window from them
+void prepare_texture(Player& player, size_t index, const RenderFrame& rf);
+void draw_window(Player& player, size_t index, const RenderFrame& rf);
+
+// draws every window from the calling thread and then swaps them all
+void render_all_windows(Player& player, const RenderFrame& rf);
+
+// call once drawn has been drawn by every window. Frames uploaded from the
+// CPU go straight back to the decoder; a frame in the upload ring replaces
+// displayed (which is released) and is held until a newer one is drawn,
+// since redraws keep using its texture. Tiled frames are held the same way,
+// since tiles coming into view are uploaded from them, as are frames drawn
+// by --cpu-render, which reads them on every redraw.
+void retire_frame(Player& player, DecoderFrame& displayed, DecoderFrame drawn);
+
+
+struct RenderThreads;
+
+struct RenderThreadArg
+{
+    RenderThreads* threads;
+    size_t index;
+};
+
+// one thread per window, each owning its window's GL context, so that
+// windows on different GPUs (e.g. :0.0 and :0.1) are drawn at the same time
+// instead of one after another. Windows wait for each other at a barrier
+// before swapping so that they still flip together.
+struct RenderThreads
+{
+    Player* player;
+    
+    std::vector<pthread_t> threads;
+    std::vector<RenderThreadArg> args;
+    
+    pthread_barrier_t start_barrier; // main thread + windows: frame published
+    pthread_barrier_t swap_barrier;  // windows only: all drawn, swap now
+    pthread_barrier_t wall_barrier;  // windows only: the wall is ready too
+                                     // (--swap-barrier)
+    pthread_barrier_t done_barrier;  // main thread + windows: all swapped
+    
+    // written by the main thread only while the window threads are
+    // waiting at start_barrier
+    RenderFrame frame;
+    bool exit_flag;
+    
+    RenderThreads() : player(NULL), exit_flag(false) {}
+    
+    // releases every window's context from the calling thread and starts
+    // one render thread per window
+    void start(Player* player);
+    
+    // hands rf to every window thread and returns once all windows have
+    // drawn and swapped (so rf.pixels can be reused afterwards)
+    void render(const RenderFrame& rf);
+    
+    // stops and joins all render threads
+    void stop();
+    
+    // main loop for one window's thread
+    // do not call this directly; it will be run indirectly by start()
+    void loop(size_t index);
+};
+
+
+// Runs drawing and swapping on its own thread so that the control loop
+// (network messages, input, clock, frame selection) never waits on a swap
+// and a slow message never delays one. The control loop publishes a
+// RenderFrame snapshot each time around; the render thread always draws
+// the newest one.
+struct RenderLoop
+{
+    Player* player;
+    
+    // if set, the render thread drives these instead of drawing every
+    // window itself
+    RenderThreads* window_threads;
+    
+    pthread_t thread;
+    
+    pthread_mutex_t mutex;     // protects everything below
+    pthread_cond_t  published; // signaled when a new snapshot is available
+    pthread_cond_t  taken;     // signaled when the render thread takes one
+    
+    RenderFrame pending;
+    bool has_pending;
+    
+    // upload ring frame currently on screen (render thread only)
+    DecoderFrame displayed;
+    bool exit_flag;
+    bool running;
+    
+    RenderLoop() : player(NULL), window_threads(NULL), has_pending(false),
+        exit_flag(false), running(false)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+        published = PTHREAD_COND_INITIALIZER;
+        taken = PTHREAD_COND_INITIALIZER;
+    }
+    
+    // releases every window's context from the calling thread (unless
+    // window_threads already own them) and starts the render thread
+    void start(Player* player, RenderThreads* window_threads = NULL);
+    
+    // replaces the pending snapshot with rf. If rf has no pixels, an
+    // upload that the render thread hasn't picked up yet is kept; if it
+    // does, the decoder frame of the older snapshot is returned unshown.
+    void publish(const RenderFrame& rf);
+    
+    // waits until the render thread has taken the pending snapshot, or
+    // max_wait microseconds, whichever comes first
+    void wait_taken(int64_t max_wait);
+    
+    // stops and joins the render thread
+    void stop();
+    
+    // main loop for the render thread
+    // do not call this directly; it will be run indirectly by start()
+    void loop();
+};
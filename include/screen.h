@@ -36,9 +36,14 @@ struct ScreenConfig
     int x; // X11 position to create window. see also: pixel_width & pixel_size
     int y;
     
+    // left edge of this screen in its host's pre-warped stream, in pixels
+    // (see layout_prewarp)
+    int stream_x;
+    
     ScreenConfig() : index(-1), heading(0), pitch(0), roll(0),
         originX(0), originY(0), originZ(0), pixel_width(640), pixel_height(320),
-        fullscreen(true), override_redirect(false), mode(SCM_GLFW), x(0), y(0)
+        fullscreen(true), override_redirect(false), mode(SCM_GLFW), x(0), y(0),
+        stream_x(0)
         {}
         
     void debug_print() const;
@@ -54,4 +59,6 @@ void parse_calvr_screen_config(
     std::string filename, 
     std::string host);
 
-
+// the host attribute of every LOCAL section, in file order (works for
+// either config format)
+std::vector<std::string> list_config_hosts(std::string filename);
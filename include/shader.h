@@ -9,5 +9,18 @@
 
 // given a list of filenames, loads files, compiles, and links them
 // returns the program id if successful, or quits with error if not
+//
+// If a shader cache is set (see set_shader_cache), the linked program is
+// saved there with glGetProgramBinary() and later loads of the same files
+// on the same driver skip compiling and linking altogether.
 GLuint load_shaders(std::vector<std::string> filenames);
 
+// source of a shader file: the copy embedded in the binary at build time
+// (build/shaders.inc), or the file on disk if it wasn't embedded
+std::string shader_source(const std::string& filename);
+
+// directory to cache linked programs in; empty disables the cache
+void set_shader_cache(const std::string& dir);
+
+// $XDG_CACHE_HOME/video_sphere, or ~/.cache/video_sphere
+std::string default_shader_cache();
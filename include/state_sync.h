@@ -0,0 +1,138 @@
+#pragma once
+
+#include "network.h"
+
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+// layout of 'F' (big endian, each field at a fixed offset):
+//
+//   0  'F'
+//   1  version
+//   2  flags (STATE_PAUSED, STATE_HOLDING)
+//   3  (unused)
+//   4  seq     uint32
+//   8  now     int64   playback time
+//  16  wall    int64   server's av_gettime_relative() when now was read
+//  24  frame   int64   end of the frame on the server's screen (us)
+//  32  seeks   uint32  seeks applied so far
+//  36  theta   float
+//  40  phi     float
+//
+// Later versions may add fields at the end; a snapshot of another version
+// is ignored rather than misread.
+#define STATE_VERSION 1
+#define STATE_SIZE 44
+
+#define STATE_PAUSED  0x01
+#define STATE_HOLDING 0x02
+
+// most time between snapshots (they're time syncs as well), on the wall
+// clock so that they keep coming while playback is paused or held
+#define STATE_INTERVAL 100000
+
+// how long a client disagrees with the server's pause state or seek count,
+// with no commands queued that would explain it, before it goes with the
+// server's (it joined after a seek, say)
+#define STATE_RESYNC 250000
+
+// the server's state as of one frame
+struct StateSnapshot
+{
+    uint32_t seq;
+    int64_t now;
+    int64_t wall;
+    int64_t frame;
+    uint32_t seeks;
+    float theta;
+    float phi;
+    bool paused;
+    bool holding;
+    
+    StateSnapshot() : seq(0), now(0), wall(0), frame(0), seeks(0),
+        theta(0.0), phi(0.0), paused(false), holding(false) {}
+    
+    // replaces m's bytes with the snapshot, in one pass
+    void write(Message& m) const;
+    
+    // false if m isn't a snapshot this version understands
+    bool read(const Message& m);
+};
+
+// a view angle change waiting for its frame
+struct PendingView
+{
+    int64_t at; // av_gettime_relative() of the vblank it applies from
+    float theta;
+    float phi;
+};
+
+// Everything that changes continuously -- playback time and view angles
+// -- goes out from the server as one 'F' snapshot, sent whenever any of
+// it changes (so once per frame while the view is being turned) and
+// otherwise every 1/10 s as the time sync, and to each client as it
+// joins. Discrete events (seeks, pauses, shader switches, ready rounds)
+// are still sent only when they happen, as commands scheduled for a frame
+// (see CommandQueue); the snapshot's pause state and seek count let a
+// client tell whether it has applied the same ones as the server.
+//
+// Snapshots are sent as time syncs, so a client that is behind only gets
+// the newest (see Server::send_sync()), and a client takes only the
+// newest of those that arrive together. Time applies straight away (from
+// when the server read it); the view applies COMMAND_LEAD after the
+// server sent it, on the server too, like a scheduled 'T' did.
+//
+// Main thread only.
+struct StateSync
+{
+    // === server ===
+    uint32_t next_seq;
+    int64_t last_sent;      // playback time of the last snapshot
+    int64_t last_sent_wall; // and its av_gettime_relative()
+    StateSnapshot last;
+    
+    // === every node ===
+    uint32_t seeks; // 'S' commands applied
+    std::deque<PendingView> views; // by at
+    float last_theta; // of the newest in views (or applied)
+    float last_phi;
+    
+    // === client ===
+    bool have_seq;
+    uint32_t last_seq;
+    bool joined; // has taken the server's seek count
+    int64_t mismatch_since; // 0 while in step
+    
+    StateSync() : next_seq(0), last_sent(0), last_sent_wall(0), seeks(0),
+        last_theta(0.0), last_phi(0.0), have_seq(false), last_seq(0),
+        joined(false), mismatch_since(0) {}
+    
+    // server: whether s should go out
+    bool due(const StateSnapshot& s);
+    
+    // server: numbers s and makes it the last sent
+    void sent(StateSnapshot& s);
+    
+    // client: takes the 'F' messages out of messages, keeping the newest
+    // one that's newer than any before it in s
+    bool take(std::vector<Message>& messages, StateSnapshot& s);
+    
+    // client: whether s's time can be taken, that is, this node has
+    // applied the same seeks and pauses as the server. On the first
+    // snapshot, or after disagreeing for STATE_RESYNC, with no commands
+    // pending, goes with the server's seek count and sets resync (the
+    // caller takes the pause state).
+    bool in_step(const StateSnapshot& s, bool paused, bool pending,
+        int64_t wall, bool& resync);
+    
+    // queues a view change for time at, if it is one
+    void schedule_view(int64_t at, float theta, float phi);
+    
+    // the newest view due by the time present, dropping older ones
+    bool pop_view(int64_t present, float& theta, float& phi);
+    
+    // the time of the next view change, if any
+    bool next_view(int64_t& at);
+};
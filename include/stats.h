@@ -0,0 +1,61 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+// Named values (timings, counters, current modes...) that any thread can
+// update. If enabled with --stats, the main loop prints them all once per
+// interval.
+struct Stats
+{
+    pthread_mutex_t mutex; // protects values and notes
+    
+    std::map<std::string, double> values;
+    std::map<std::string, std::string> notes; // non-numeric values
+    
+    bool enabled;
+    int64_t interval;   // microseconds between prints
+    int64_t last_print; // av_gettime_relative() of last print
+    
+    Stats() : enabled(false), interval(1000000), last_print(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+    }
+    
+    void set(const std::string& name, double value)
+    {
+        pthread_mutex_lock(&mutex);
+        values[name] = value;
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    void add(const std::string& name, double value)
+    {
+        pthread_mutex_lock(&mutex);
+        values[name] += value;
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    void set_note(const std::string& name, const std::string& value)
+    {
+        pthread_mutex_lock(&mutex);
+        notes[name] = value;
+        pthread_mutex_unlock(&mutex);
+    }
+    
+    double get(const std::string& name)
+    {
+        pthread_mutex_lock(&mutex);
+        double result = values[name];
+        pthread_mutex_unlock(&mutex);
+        
+        return result;
+    }
+    
+    // prints everything if enabled and interval has passed since the last
+    // print. Call this regularly from one thread.
+    void print_if_due();
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "stats.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+#define SWAP_BARRIER_DEFAULT_PORT 4547
+
+// what the server knows about one node taking part
+struct BarrierMember
+{
+    struct sockaddr_in addr;
+    int64_t last_seen; // av_gettime_relative() of its last ready
+    uint32_t seq;      // of that ready, echoed in the release
+    bool waiting;      // has reported ready for the current round
+    int64_t arrived;   // when
+};
+
+// --swap-barrier: holds every node's swap until the whole wall has drawn
+// its frame, so that neighbouring screens flip together instead of a
+// refresh or two apart.
+//
+// Each node draws and glFinish()es its windows, then sends "ready" over
+// UDP to the server and waits for the release before swapping. The server
+// releases everyone once every node seen in the last second is ready, or
+// when the first one has waited timeout/2, whichever comes first. A node
+// that hears nothing within timeout swaps anyway, so a lost packet or a
+// node going away costs a frame, not the show.
+//
+// Wait times go to the stats (barrier.wait_ms on each node). The server
+// counts which node arrived last each round (barrier.held_by.<host>) and
+// how far behind the first it was (barrier.spread_ms), to show who is
+// holding the wall back.
+struct SwapBarrier
+{
+    bool enabled;
+    unsigned short port;
+    int64_t timeout; // microseconds
+    
+    // === node: waits for releases ===
+    int fd;
+    struct sockaddr_in server_addr;
+    std::string host;
+    uint32_t seq; // of the last ready sent
+    
+    // === server: runs the rounds on its own thread ===
+    int server_fd;
+    pthread_t thread;
+    bool running;
+    bool exit_flag;
+    Stats* stats;
+    std::map<std::string, BarrierMember> members; // by host (thread only)
+    
+    SwapBarrier() : enabled(false), port(SWAP_BARRIER_DEFAULT_PORT),
+        timeout(50000), fd(-1), seq(0), server_fd(-1), running(false),
+        exit_flag(false), stats(NULL) {}
+    
+    // joins the barrier run by the server at server_address
+    void setup_node(const std::string& server_address,
+        const std::string& host);
+    
+    // starts the server's thread
+    void start_server(Stats* stats);
+    
+    // node: reports ready and returns once released (or timed out). Call
+    // after the frame has been drawn and finished, right before swapping.
+    void wait(Stats& stats);
+    
+    // stops and joins the server's thread
+    void stop();
+    
+    // main loop for the server's thread
+    // do not call this directly; it will be run indirectly by start_server()
+    void loop();
+    
+    // server: releases every member waiting in the current round
+    void release(int64_t now);
+};
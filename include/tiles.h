@@ -0,0 +1,73 @@
+#pragma once
+
+#include "screen.h"
+
+#include <vector>
+
+#include <GL/glew.h>
+
+// How a frame too big for one texture is cut up: a grid of tiles of
+// tile_width x tile_height texels (the last column and row may be
+// narrower), each stored as one layer of a GL_TEXTURE_2D_ARRAY with a one
+// texel border around it. fetch-tiled.frag does the lookups.
+struct TileGrid
+{
+    int frame_width;
+    int frame_height;
+    int tile_width;  // not counting the border
+    int tile_height;
+    int columns;
+    int rows;
+    
+    TileGrid() : frame_width(0), frame_height(0), tile_width(0),
+        tile_height(0), columns(0), rows(0) {}
+    
+    // layer_size is the size of a layer including its border
+    void setup(int frame_width, int frame_height, int layer_size);
+    
+    int count() const { return columns * rows; }
+    
+    // sets the uniforms of fetch-tiled.frag in program
+    void set_uniforms(GLuint program) const;
+};
+
+// One window's copy of the tiles. Tiles are uploaded only when they're
+// needed and out of date, so tiles no screen looks at are never uploaded.
+struct TiledTexture
+{
+    GLuint texture;
+    
+    // newest frame handed over by set_frame(). Has to stay valid until the
+    // next one, since a tile coming into view uploads from it (see
+    // retire_frame).
+    const unsigned char* pixels;
+    
+    int serial; // bumped by set_frame()
+    std::vector<int> tile_serial; // frame each tile holds, -1 for none
+    
+    std::vector<bool> visible; // scratch for visible_tiles()
+    
+    TiledTexture() : texture(0), pixels(NULL), serial(0) {}
+    
+    // allocates the texture array on the current context
+    void create(const TileGrid& grid);
+    
+    void set_frame(const unsigned char* pixels)
+    {
+        this->pixels = pixels;
+        serial++;
+    }
+    
+    // uploads the tiles in needed (all of them if NULL) that don't hold
+    // the newest frame yet, and returns how many were uploaded. The
+    // texture must be bound to the active unit.
+    int update(const TileGrid& grid, const std::vector<bool>* needed);
+};
+
+// marks the tiles of an equirect frame (images of them stacked, 2 for
+// top/bottom stereo) that the screen can show with the view turned by
+// theta and phi. eye_offset is an extra longitude shift that one eye
+// samples at (interleaved stereo), or 0.
+void visible_tiles(const TileGrid& grid, const ScreenConfig& sc,
+    float theta, float phi, int images, float eye_offset,
+    std::vector<bool>& visible);
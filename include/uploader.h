@@ -0,0 +1,130 @@
+#pragma once
+
+#include "decoder.h"
+#include "window.h"
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+#include <GL/glx.h>
+
+#include <pthread.h>
+#include <vector>
+#include <list>
+
+struct Player;
+
+// A GL context on the upload thread that shares textures with one or more
+// windows. GLFW windows all share with each other, so they need only one,
+// as do offscreen windows; each X11 window has its own.
+struct UploadGroup
+{
+    // === GLFW: hidden window sharing with the first GLFW window ===
+    GLFWwindow* glfw_window;
+    
+    // === X11: context sharing with the window's, on a tiny pbuffer ===
+    Display* display;
+    GLXContext glx_context;
+    GLXPbuffer pbuffer;
+    
+    // === EGL: context sharing with the offscreen windows' ===
+    EGLDisplay egl_display;
+    EGLContext egl_context;
+    EGLSurface egl_surface;
+    
+    UploadGroup() : glfw_window(NULL), display(NULL), glx_context(NULL),
+        pbuffer(0), egl_display(EGL_NO_DISPLAY), egl_context(EGL_NO_CONTEXT),
+        egl_surface(EGL_NO_SURFACE) {}
+    
+    void make_current();
+    void release_current();
+};
+
+// One entry of the ring of video frames waiting on the GPU.
+struct UploadSlot
+{
+    // frame whose pixels are in this slot. The AVFrame is only handed back
+    // to the decoder once the slot is released.
+    DecoderFrame frame;
+    
+    bool ready;  // uploaded and waiting to be picked by the control loop
+    bool in_use; // picked, and maybe still on screen
+    
+    std::vector<GLuint> textures;    // one per UploadGroup
+    std::vector<GLsync> upload_done; // one per UploadGroup
+    std::vector<GLsync> draw_done;   // one per window (last draw using it)
+    
+    UploadSlot() : ready(false), in_use(false) {}
+};
+
+// Uploads decoded frames from the Decoder into a ring of GPU textures on
+// its own thread (with its own shared contexts), several frames ahead of
+// when they are shown. Each upload is followed by a fence, so the render
+// thread only has to wait on the GPU (glWaitSync) and bind the texture for
+// the current frame -- it never stalls on a glTexImage2D.
+//
+// Frames come out of get_frame() in decode order exactly like they do from
+// Decoder::get_frame(), with DecoderFrame::slot saying where on the GPU
+// they live, and go back through return_frame().
+struct UploadThread
+{
+    Player* player;
+    
+    pthread_mutex_t mutex;     // lock for exclusive access to rest of struct
+    pthread_cond_t  condition; // signaled when a slot is released
+    
+    pthread_t thread;
+    
+    bool exit_flag;
+    bool uploading; // a frame has been taken from the decoder but not yet
+                    // marked ready
+    
+    int width;
+    int height;
+    
+    std::vector<UploadGroup> groups;
+    std::vector<int> window_group; // UploadGroup index for each window
+    std::vector<int> bound_slot;   // slot each window last drew from
+    
+    std::vector<UploadSlot> slots;
+    std::list<int> ready_slots;    // in decode order
+    
+    UploadThread() : player(NULL), exit_flag(false), uploading(false),
+        width(0), height(0)
+    {
+        mutex = PTHREAD_MUTEX_INITIALIZER;
+        condition = PTHREAD_COND_INITIALIZER;
+    }
+    
+    // creates the upload contexts (call from the main thread, after the
+    // windows exist) and starts the upload thread with ring_size slots
+    void start(Player* player, size_t ring_size);
+    
+    // oldest uploaded frame, or a NULL frame if none is ready yet
+    DecoderFrame get_frame();
+    
+    // releases the frame's slot for reuse and returns the frame to the
+    // decoder
+    void return_frame(DecoderFrame df);
+    
+    // true once the decoder has finished and every frame has been handed
+    // out through get_frame()
+    bool drained();
+    
+    // decoded frames taken from the decoder and not yet handed out through
+    // get_frame(): the ones ready on the GPU and the one being uploaded
+    size_t frames_waiting();
+    
+    // render side: waits (on the GPU) for the slot's upload and binds its
+    // texture. The window's context must be current.
+    void bind(int slot, size_t window_index);
+    
+    // render side: fences the last draw from whichever slot the window has
+    // bound, so the slot isn't overwritten while the GPU still reads it
+    void after_draw(size_t window_index);
+    
+    void stop();
+    
+    // main loop for upload thread
+    // do not call this directly; it will be run indirectly by start()
+    void loop();
+};
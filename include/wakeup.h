@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// Lets the main loop sleep while nothing changes, and other threads wake
+// it up: the network threads signal() when messages arrive. With GLFW
+// windows the loop waits in glfwWaitEventsTimeout() so that input wakes it
+// too (signal() posts an empty event to end the wait); otherwise it waits
+// on an eventfd.
+struct Wakeup
+{
+    int fd; // eventfd, -1 until setup()
+    bool use_glfw;
+    
+    Wakeup() : fd(-1), use_glfw(false) {}
+    
+    // call before starting any thread that signals
+    void setup();
+    
+    // any thread
+    void signal();
+    
+    // main thread only: returns after a signal(), an input event (with
+    // use_glfw) or timeout microseconds, whichever comes first
+    void wait(int64_t timeout);
+};
@@ -6,9 +6,14 @@
 #include <X11/Xutil.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
+#include <EGL/egl.h>
 #include <cstdio>
+#include <vector>
+
+#include <pthread.h>
 
 #include "util.h"
+#include "tiles.h"
 
 // named with _ to avoid conflict with X11 "Window"
 struct Window_
@@ -22,21 +27,106 @@ struct Window_
     Display* display;
     Window x11_window;
     GLXContext glx_context;
+    GLXFBConfig fb_config;
     Colormap cmap;
     
+    // === EGL details (--offscreen: a pbuffer, no display needed) ===
+    EGLDisplay egl_display;
+    EGLConfig egl_config;
+    EGLContext egl_context;
+    EGLSurface egl_surface;
+    
     // === Rendering details specific to this window ===
+    // programs are 0 until first used (see get_program)
     GLuint tex;
     GLint no_distort_program;
     GLint mono_equirect_program;
     GLint aa_mono_equirect_program;
+    GLint mip_mono_equirect_program;
     GLint stereo_equirect_program;
     GLint stereo_interleaved_program;
     
+    // --cubemap: each new video frame is redrawn into cube_tex (one face at
+    // a time through cube_fbo) and the mono shaders sample that instead.
+    // Windows drawn one after another that share textures sample the same
+    // cube, which only cube_owner (the first of them) redraws.
+    GLint equirect_to_cube_program;
+    GLint cube_mono_program;
+    GLint aa_cube_mono_program;
+    GLuint cube_tex;
+    GLuint cube_fbo;
+    int cube_size; // per face, 0 until allocated
+    int cube_owner; // window index, -1 until set up
+    
+    // --cpu-render: this window's image, drawn by CpuRenderer
+    std::vector<unsigned char> cpu_image;
+    
+    // frames too big for one texture (see TileGrid)
+    TiledTexture tiles;
+    
+    // offscreen target for --dynamic-resolution. Allocated at the full
+    // window size; only a scaled corner of it is drawn to each frame.
+    GLuint scale_fbo;
+    GLuint scale_rbo;
+    int scale_fbo_width;
+    int scale_fbo_height;
+    
+    // GL_TIME_ELAPSED queries, used alternately so that the previous
+    // result can be read without waiting for the GPU
+    GLuint time_query[2];
+    bool time_query_pending[2];
+    int time_query_index;
+    
+    // whether the display has GLX_OML_sync_control (-1 until checked)
+    int oml_sync;
+    
+    // size from the last resize, for whichever thread draws the window
+    // next to apply (see take_resize())
+    pthread_mutex_t resize_mutex;
+    bool resized;
+    int resized_width;
+    int resized_height;
+    
     Window_()
     {
         glfw_window = NULL;
         display = NULL;
         x11_window = NULL;
+        
+        egl_display = EGL_NO_DISPLAY;
+        egl_context = EGL_NO_CONTEXT;
+        egl_surface = EGL_NO_SURFACE;
+        
+        no_distort_program = 0;
+        mono_equirect_program = 0;
+        aa_mono_equirect_program = 0;
+        mip_mono_equirect_program = 0;
+        stereo_equirect_program = 0;
+        stereo_interleaved_program = 0;
+        equirect_to_cube_program = 0;
+        cube_mono_program = 0;
+        aa_cube_mono_program = 0;
+        
+        cube_tex = 0;
+        cube_fbo = 0;
+        cube_size = 0;
+        cube_owner = -1;
+        
+        scale_fbo = 0;
+        scale_rbo = 0;
+        scale_fbo_width = 0;
+        scale_fbo_height = 0;
+        
+        time_query[0] = time_query[1] = 0;
+        time_query_pending[0] = time_query_pending[1] = false;
+        time_query_index = 0;
+        
+        oml_sync = -1;
+        
+        resize_mutex = PTHREAD_MUTEX_INITIALIZER;
+        resized = false;
+        resized_width = 0;
+        resized_height = 0;
     }
     
     void create_x11(
@@ -46,6 +136,10 @@ struct Window_
         bool override_redirect=false,
         int x = 0, int y = 0, int w = 1920, int h = 1080);
     
+    // renders into a w x h pbuffer instead of a window. Windows made with
+    // share (another offscreen window) share its textures and programs.
+    void create_offscreen(int w, int h, const Window_* share = NULL);
+    
     void close()
     {
         if(glfw_window)
@@ -64,6 +158,51 @@ struct Window_
             x11_window = NULL;
             display = NULL;
         }
+        else if(egl_context != EGL_NO_CONTEXT)
+        {
+            eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+            eglDestroySurface(egl_display, egl_surface);
+            eglDestroyContext(egl_display, egl_context);
+            
+            egl_context = EGL_NO_CONTEXT;
+            egl_surface = EGL_NO_SURFACE;
+        }
+    }
+    
+    // records a new size; called from the window system's callback, on
+    // the main thread, which may not be the one that draws
+    void on_resize(int w, int h)
+    {
+        pthread_mutex_lock(&resize_mutex);
+        resized = true;
+        resized_width = w;
+        resized_height = h;
+        pthread_mutex_unlock(&resize_mutex);
+    }
+    
+    // the new size, once, if the window was resized since the last call
+    bool take_resize(int& w, int& h)
+    {
+        pthread_mutex_lock(&resize_mutex);
+        bool result = resized;
+        w = resized_width;
+        h = resized_height;
+        resized = false;
+        pthread_mutex_unlock(&resize_mutex);
+        
+        return result;
+    }
+    
+    // whether textures and programs made in one window's context can be
+    // used in the other's. GLFW and offscreen windows are all created
+    // sharing with the first of their kind; each X11 window has a context
+    // of its own.
+    bool shares_objects_with(const Window_& other) const
+    {
+        return (glfw_window && other.glfw_window) ||
+            (egl_context != EGL_NO_CONTEXT && 
+             other.egl_context != EGL_NO_CONTEXT);
     }
     
     void make_current()
@@ -74,10 +213,39 @@ struct Window_
         {
             glXMakeCurrent(display, x11_window, glx_context);
         }
+        else if(egl_context != EGL_NO_CONTEXT)
+        {
+            // the API is per thread, and render threads start on ES
+            eglBindAPI(EGL_OPENGL_API);
+            eglMakeCurrent(egl_display, egl_surface, egl_surface, 
+                egl_context);
+        }
         else
             std::fprintf(stderr, "Can't make NULL window current!\n");
     }
     
+    // detaches this window's context from the calling thread so that
+    // another thread can make it current
+    void release_current()
+    {
+        if(glfw_window)
+            glfwMakeContextCurrent(NULL);
+        else if(x11_window)
+            glXMakeCurrent(display, None, NULL);
+        else if(egl_context != EGL_NO_CONTEXT)
+        {
+            eglBindAPI(EGL_OPENGL_API);
+            eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                EGL_NO_CONTEXT);
+        }
+    }
+    
+    // when the last frame reached the screen, in av_gettime_relative()
+    // microseconds: the last vblank's timestamp if the driver has
+    // GLX_OML_sync_control, otherwise now (right after a swap, which with
+    // vsync on returns close to the vblank)
+    int64_t present_time();
+    
     void swap_buffers()
     {
         make_current();
@@ -86,10 +254,15 @@ struct Window_
         {
             glfwSwapBuffers(glfw_window);
         }
-        else
+        else if(x11_window)
         {
             glXSwapBuffers(display, x11_window);
         }
+        else
+        {
+            // nothing to show; this only flushes the pbuffer
+            eglSwapBuffers(egl_display, egl_surface);
+        }
     }
 };
 
@@ -0,0 +1,38 @@
+#version 120
+
+// Supersampled mono output from the cubemap (see aa-mono.frag). Each sample
+// is a single cube lookup, and neighbouring samples land next to each other
+// in the same face instead of being spread across a row of the equirect.
+
+uniform samplerCube video_cube;
+uniform float phi;
+uniform float theta;
+
+varying vec3 pos;
+
+void main()
+{
+    int ix = 0;
+    int iy = 0;
+    
+    int xsteps = 4;
+    int ysteps = 4;
+    
+    float sx = 1.0 / xsteps;
+    float sy = 1.0 / ysteps;
+    
+    
+    vec4 color = vec4(0,0,0,0);
+    
+    for(iy = -ysteps/2; iy < ysteps/2; iy++)
+    for(ix = -xsteps/2; ix < xsteps/2; ix++)
+    {
+        vec3 p_step_x = ix * sx * dFdx(pos);
+        vec3 p_step_y = iy * sy * dFdy(pos);
+        vec3 p = pos + p_step_x + p_step_y;
+        
+        color += textureCube(video_cube, p);
+    }
+    
+    gl_FragColor = color / (xsteps * ysteps);
+}
@@ -0,0 +1,15 @@
+#version 120
+
+// Mono output from the cubemap made by equirect-to-cube.frag. The view
+// direction is the lookup, so there's no projection to do per pixel.
+
+uniform samplerCube video_cube;
+uniform float phi;
+uniform float theta;
+
+varying vec3 pos;
+
+void main()
+{
+    gl_FragColor = textureCube(video_cube, pos);
+}
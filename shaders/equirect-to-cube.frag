@@ -0,0 +1,36 @@
+#version 120
+
+// Fills one face of the cubemap from the video frame, in whatever layout it
+// comes in (see projection-*.frag). This runs once per cube texel per video
+// frame, so the sphere shaders can look the colour up by direction without
+// any trig of their own.
+
+uniform sampler2D video_texture;
+uniform int face; // 0-5: +X, -X, +Y, -Y, +Z, -Z
+
+varying vec2 face_coord;
+
+// from the projection-*.frag linked in for the source video's layout
+vec2 direction_to_uv(vec3 dir);
+
+// from sample-direct.frag or sample-polar.frag
+vec4 sample_video(vec2 uv);
+
+// direction of a texel on a face (see the cube map face selection table in
+// the GL spec; this is its inverse)
+vec3 face_direction(int f, float s, float t)
+{
+    if(f == 0) return vec3( 1.0,   -t,   -s);
+    if(f == 1) return vec3(-1.0,   -t,    s);
+    if(f == 2) return vec3(   s,  1.0,    t);
+    if(f == 3) return vec3(   s, -1.0,   -t);
+    if(f == 4) return vec3(   s,   -t,  1.0);
+    return            vec3(  -s,   -t, -1.0);
+}
+
+void main()
+{
+    vec3 dir = face_direction(face, face_coord.x, face_coord.y);
+    
+    gl_FragColor = sample_video(direction_to_uv(dir));
+}
@@ -0,0 +1,12 @@
+#version 120
+
+// one face of the cubemap: a quad covering the face, with face_coord going
+// from -1 to 1 across it
+
+varying vec2 face_coord;
+
+void main()
+{
+    face_coord = gl_Vertex.xy;
+    gl_Position = gl_Vertex;
+}
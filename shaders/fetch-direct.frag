@@ -0,0 +1,12 @@
+#version 120
+
+// Uploaded frame in a single texture. Linked in under sample_video() (and
+// no-distort.frag), which call fetch_video() with a coordinate in the frame
+// as uploaded.
+
+uniform sampler2D video_texture;
+
+vec4 fetch_video(vec2 texcoord)
+{
+    return texture2D(video_texture, texcoord);
+}
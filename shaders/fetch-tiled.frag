@@ -0,0 +1,32 @@
+#version 120
+#extension GL_EXT_texture_array : enable
+
+// Uploaded frame split into a grid of tiles, one array layer each, for
+// frames larger than GL_MAX_TEXTURE_SIZE (see TileGrid). Linked in under
+// sample_video() (and no-distort.frag), which call fetch_video() with a
+// coordinate in the frame as uploaded.
+//
+// Every layer has a one texel border copied from the neighbouring tiles
+// (wrapping around horizontally, repeating the edge rows vertically), so
+// bilinear filtering near a tile edge reads the same texels it would have
+// in one big texture.
+
+uniform sampler2DArray video_tiles;
+
+uniform vec2 tile_grid;  // columns, rows
+uniform vec2 tile_size;  // texels per tile, not counting the border
+uniform vec2 frame_size; // texels in the whole frame
+
+vec4 fetch_video(vec2 texcoord)
+{
+    vec2 texel = vec2(fract(texcoord.x), clamp(texcoord.y, 0.0, 1.0))
+        * frame_size;
+    
+    vec2 tile = min(floor(texel / tile_size), tile_grid - 1.0);
+    vec2 local = texel - tile * tile_size + 1.0; // past the border
+    
+    float layer = tile.y * tile_grid.x + tile.x;
+    
+    return texture2DArray(video_tiles, 
+        vec3(local / (tile_size + 2.0), layer));
+}
@@ -5,45 +5,39 @@
 uniform sampler2D video_texture;
 uniform float phi;
 uniform float theta;
-uniform float stereo_half;
 
 varying vec3 pos;
 
 const float TURN = 6.283185307179586;
 
-vec2 vec3_to_latlong(vec3 vec)
-{
-    float out_long = atan(vec.y, vec.x);
-    if(vec.y < 0)
-        out_long += TURN;
-    
-    float out_lat = (vec.z == 1.0 ? TURN/4 :
-        (vec.z == -1.0? -TURN/4 :
-        (asin(vec.z))));
-    
-    return vec2(out_lat, out_long);
-}
+// from the projection-*.frag linked in for the source video's layout
+vec2 direction_to_uv(vec3 dir);
+
+// from sample-direct.frag or sample-polar.frag
+vec4 sample_video(vec2 uv);
 
 void main()
 {
-    vec2 latlong = vec3_to_latlong(normalize(pos));
+    // single pass: each row shows the eye that belongs to it, so no work is
+    // wasted on fragments that would be discarded. Even rows get
+    // stereo_half = 1 and odd rows stereo_half = 0, the same rows each eye
+    // kept when it was drawn as its own quad.
+    float stereo_half = 1.0 - mod(floor(gl_FragCoord.y), 2.0);
     
     // eye separation angle to add, based on empirical testing w/ Dan on CAVE2
     float empirical_eye_sep = stereo_half * 0.9 * 2.0 / 30.0 * TURN/16.0;
 
-    float lat = latlong.x;
-    float lon = mod(latlong.y - empirical_eye_sep, TURN);
-    
-    float x = lon / TURN;
-    float y = ((lat / (0.25*TURN) + 1.0)) / 2.0;
+    // take it off the longitude by turning the view direction about z
+    float c = cos(empirical_eye_sep);
+    float s = sin(empirical_eye_sep);
+    vec3 dir = vec3(c*pos.x + s*pos.y, -s*pos.x + c*pos.y, pos.z);
     
-    y /= 2;
-    y += stereo_half * 0.5;
+    vec2 uv = direction_to_uv(dir);
     
-    if(mod(floor(gl_FragCoord.y),2) == stereo_half)
-        discard;
+    uv.y /= 2;
+    uv.y += (1.0 - stereo_half) * 0.5;
     
-    gl_FragColor = texture2D(video_texture, vec2(1-x,1-y));
+    gl_FragColor = sample_video(uv);
     //gl_FragColor = vec4(0,1,0,1);
 }
 
@@ -0,0 +1,34 @@
+#version 120
+#extension GL_ARB_shader_texture_lod : enable
+
+// Anti-aliased mono output using the texture's mipmap chain instead of
+// supersampling. Only one projection is done per pixel; the footprint of the
+// pixel in the video is passed to the sampler as explicit gradients so that
+// anisotropic filtering picks the right mip level and sample pattern.
+
+uniform sampler2D video_texture;
+uniform float phi;
+uniform float theta;
+
+varying vec3 pos;
+
+// from the projection-*.frag linked in for the source video's layout
+vec2 direction_to_uv(vec3 dir);
+vec2 fix_gradient(vec2 g);
+
+void main()
+{
+    vec2 uv = direction_to_uv(pos);
+
+#ifdef GL_ARB_shader_texture_lod
+    // derivatives jump where the layout wraps or changes face
+    vec2 du = fix_gradient(dFdx(uv));
+    vec2 dv = fix_gradient(dFdy(uv));
+
+    gl_FragColor = texture2DGradARB(video_texture, uv, du, dv);
+#else
+    // implicit derivatives: correct everywhere except one pixel wide lines
+    // along the seams, which get the blurriest mip level
+    gl_FragColor = texture2D(video_texture, uv);
+#endif
+}
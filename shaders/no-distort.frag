@@ -1,9 +1,11 @@
 #version 120
 
-uniform sampler2D video_texture;
 varying vec4 tex_coord;
 
+// from fetch-direct.frag or fetch-tiled.frag
+vec4 fetch_video(vec2 texcoord);
+
 void main()
 {
-    gl_FragColor = texture2D(video_texture, tex_coord.xy);
+    gl_FragColor = fetch_video(tex_coord.xy);
 }
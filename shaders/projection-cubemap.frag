@@ -0,0 +1,56 @@
+#version 120
+
+// 3x2 cubemap source, in the default layout of the spherical video v2
+// "cbmp" box:
+//
+//     right | left  | up
+//     down  | front | back
+//
+// Front is the middle of an equirect frame of the same video, up and down
+// faces have their top edge towards the back and front respectively.
+// Linked into the sphere shaders, which call direction_to_uv().
+
+// keeps bilinear filtering from reaching into the neighbouring face
+const float EDGE = 1.0 / 1024.0;
+
+vec2 direction_to_uv(vec3 dir)
+{
+    // player axes: x back, y right, z up
+    float r =  dir.y;
+    float u =  dir.z;
+    float f = -dir.x;
+    vec3 a = abs(vec3(r, u, f));
+    
+    vec2 st;   // -1 to 1 across the face, y pointing down
+    vec2 tile; // column, row
+    
+    if(a.z >= a.x && a.z >= a.y)
+    {
+        if(f > 0.0) { st = vec2( r, -u) / f; tile = vec2(1, 1); } // front
+        else        { st = vec2( r,  u) / f; tile = vec2(2, 1); } // back
+    }
+    else if(a.x >= a.y)
+    {
+        if(r > 0.0) { st = vec2(-f, -u) / r; tile = vec2(0, 0); } // right
+        else        { st = vec2(-f,  u) / r; tile = vec2(1, 0); } // left
+    }
+    else
+    {
+        if(u > 0.0) { st = vec2( r,  f) / u; tile = vec2(2, 0); } // up
+        else        { st = vec2(-r,  f) / u; tile = vec2(0, 1); } // down
+    }
+    
+    st = clamp(st, -1.0 + EDGE, 1.0 - EDGE);
+    
+    return (tile + 0.5*st + 0.5) / vec2(3.0, 2.0);
+}
+
+// neighbouring pixels on different faces have no sensible footprint, so
+// take the finest level there rather than the blurriest
+vec2 fix_gradient(vec2 g)
+{
+    if(max(abs(g.x), abs(g.y)) > 0.1)
+        return vec2(0.0);
+    
+    return g;
+}
@@ -0,0 +1,68 @@
+#version 120
+
+// 3x2 equi-angular cubemap (EAC) source, as YouTube delivers it:
+//
+//     left | front | right
+//     down | back  | up
+//
+// The bottom row is one continuous strip around the back of the sphere,
+// turned 90 degrees clockwise. Within a face, position is proportional to
+// angle rather than to the tangent, which spreads the pixels evenly instead
+// of crowding them into the corners.
+// Linked into the sphere shaders, which call direction_to_uv().
+
+const float TURN = 6.283185307179586;
+
+// keeps bilinear filtering from reaching into the neighbouring face
+const float EDGE = 1.0 / 1024.0;
+
+vec2 direction_to_uv(vec3 dir)
+{
+    // player axes: x back, y right, z up
+    float r =  dir.y;
+    float u =  dir.z;
+    float f = -dir.x;
+    vec3 a = abs(vec3(r, u, f));
+    
+    vec2 st;   // -1 to 1 across the face (as a cube face), y pointing down
+    vec2 tile; // column, row
+    int turn;  // 0 = as is, 1 = clockwise, 2 = counter-clockwise
+    
+    if(a.z >= a.x && a.z >= a.y)
+    {
+        if(f > 0.0) { st = vec2( r, -u) / f; tile = vec2(1, 0); turn = 0; }
+        else        { st = vec2( r,  u) / f; tile = vec2(1, 1); turn = 1; }
+    }
+    else if(a.x >= a.y)
+    {
+        if(r > 0.0) { st = vec2(-f, -u) / r; tile = vec2(2, 0); turn = 0; }
+        else        { st = vec2(-f,  u) / r; tile = vec2(0, 0); turn = 0; }
+    }
+    else
+    {
+        if(u > 0.0) { st = vec2( r,  f) / u; tile = vec2(2, 1); turn = 2; }
+        else        { st = vec2(-r,  f) / u; tile = vec2(0, 1); turn = 2; }
+    }
+    
+    // equi-angular: tan(angle) -> angle, scaled back to -1..1
+    st = atan(st) * (8.0 / TURN);
+    
+    if(turn == 1)
+        st = vec2(-st.y, st.x);
+    else if(turn == 2)
+        st = vec2(st.y, -st.x);
+    
+    st = clamp(st, -1.0 + EDGE, 1.0 - EDGE);
+    
+    return (tile + 0.5*st + 0.5) / vec2(3.0, 2.0);
+}
+
+// neighbouring pixels on different faces have no sensible footprint, so
+// take the finest level there rather than the blurriest
+vec2 fix_gradient(vec2 g)
+{
+    if(max(abs(g.x), abs(g.y)) > 0.1)
+        return vec2(0.0);
+    
+    return g;
+}
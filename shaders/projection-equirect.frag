@@ -0,0 +1,40 @@
+#version 120
+
+// Equirectangular source: longitude across the frame, latitude down it.
+// Linked into the sphere shaders, which call direction_to_uv().
+
+const float TURN = 6.283185307179586;
+
+vec2 vec3_to_latlong(vec3 vec)
+{
+    float out_long = atan(vec.y, vec.x);
+    if(vec.y < 0)
+        out_long += TURN;
+    
+    float out_lat = (vec.z == 1.0 ? TURN/4 :
+        (vec.z == -1.0? -TURN/4 :
+        (asin(vec.z))));
+    
+    return vec2(out_lat, out_long);
+}
+
+vec2 direction_to_uv(vec3 dir)
+{
+    vec2 latlong = vec3_to_latlong(normalize(dir));
+
+    float lat = latlong.x;
+    float lon = mod(latlong.y, TURN);
+    
+    float x = lon / TURN;
+    float y = ((lat / (0.25*TURN) + 1.0)) / 2.0;
+
+    return vec2(1-x,1-y);
+}
+
+// the longitude wraps around at the seam, so a derivative across it comes
+// out as almost a whole turn -- fold it back to the short way around
+vec2 fix_gradient(vec2 g)
+{
+    g.x = fract(g.x + 0.5) - 0.5;
+    return g;
+}
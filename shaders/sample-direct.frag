@@ -0,0 +1,12 @@
+#version 120
+
+// Video frame uploaded as decoded. Linked into the sphere shaders, which
+// call sample_video() with a position in the decoded frame.
+
+// from fetch-direct.frag or fetch-tiled.frag
+vec4 fetch_video(vec2 texcoord);
+
+vec4 sample_video(vec2 uv)
+{
+    return fetch_video(uv);
+}
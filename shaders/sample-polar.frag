@@ -0,0 +1,67 @@
+#version 120
+
+// Video frame uploaded with its polar rows packed by PolarPacking
+// (--polar-decimation). Linked into the sphere shaders, which call
+// sample_video() with a position in the decoded frame.
+//
+// Neighbouring rows of the frame aren't neighbours in the texture any more,
+// so rows are filtered by hand: each lookup samples the two nearest rows
+// (bilinear along the row only) and blends them.
+
+// from fetch-direct.frag or fetch-tiled.frag
+vec4 fetch_video(vec2 texcoord);
+
+const int MAX_BANDS = 16; // MAX_POLAR_BANDS in polar.cpp
+
+uniform int band_count;
+uniform float band_first_row[MAX_BANDS];  // in the decoded frame
+uniform float band_per_row[MAX_BANDS];    // frame rows per texture row
+uniform float band_packed_row[MAX_BANDS]; // in the texture
+
+uniform vec3 video_size; // width, decoded rows, packed rows
+
+vec2 packed_coord(float row, float u)
+{
+    float first = band_first_row[0];
+    float per = band_per_row[0];
+    float packed_first = band_packed_row[0];
+    
+    for(int i = 1; i < MAX_BANDS; i++)
+    {
+        if(i < band_count && row >= band_first_row[i])
+        {
+            first = band_first_row[i];
+            per = band_per_row[i];
+            packed_first = band_packed_row[i];
+        }
+    }
+    
+    float local = row - first;
+    float texture_row = packed_first + floor(local / per);
+    float slot = mod(local, per);
+    
+    // a packed row shares its texture row with others, so stay half a
+    // texel inside it instead of wrapping around
+    if(per > 1.0)
+    {
+        float edge = 0.5 * per / video_size.x;
+        u = clamp(u, edge, 1.0 - edge);
+    }
+    
+    return vec2((slot + u) / per, (texture_row + 0.5) / video_size.z);
+}
+
+vec4 sample_video(vec2 uv)
+{
+    float y = uv.y * video_size.y - 0.5;
+    float row = floor(y);
+    float u = fract(uv.x);
+    
+    float a = clamp(row,       0.0, video_size.y - 1.0);
+    float b = clamp(row + 1.0, 0.0, video_size.y - 1.0);
+    
+    return mix(
+        fetch_video(packed_coord(a, u)),
+        fetch_video(packed_coord(b, u)),
+        y - row);
+}
@@ -0,0 +1,257 @@
+#include "bench.h"
+#include "player.h"
+#include "render.h"
+#include "util.h"
+
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/types.h>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+enum BenchStage
+{
+    BENCH_DECODE,   // waiting for the decoder (or upload thread)
+    BENCH_UPLOAD,   // prepare_texture(), all windows
+    BENCH_DRAW,     // draw_window(), all windows
+    BENCH_READBACK, // --dump-frames
+    BENCH_SWAP,
+    BENCH_STAGES
+};
+
+static const char* stage_names[BENCH_STAGES] =
+{
+    "decode", "upload", "draw", "readback", "swap"
+};
+
+struct StageTimes
+{
+    double total_ms;
+    double min_ms;
+    double max_ms;
+    int count;
+    
+    StageTimes() : total_ms(0.0), min_ms(0.0), max_ms(0.0), count(0) {}
+    
+    void add(double ms)
+    {
+        if(count == 0 || ms < min_ms)
+            min_ms = ms;
+        if(count == 0 || ms > max_ms)
+            max_ms = ms;
+        
+        total_ms += ms;
+        count++;
+    }
+};
+
+static double ms_since(int64_t start)
+{
+    return (av_gettime_relative() - start) / 1000.0;
+}
+
+// next frame from the start of the video, waiting for it if need be.
+// NULL frame once the video has run out.
+static DecoderFrame wait_for_frame(Player& player)
+{
+    while(true)
+    {
+        DecoderFrame df = player.get_frame();
+        if(df.frame)
+            return df;
+        
+        bool done;
+        
+        if(player.upload_thread)
+            done = player.uploader.drained();
+        else
+        {
+            player.decoder.lock();
+            done = player.decoder.decoded_all_flag;
+            player.decoder.unlock();
+        }
+        
+        if(done)
+            return df;
+        
+        av_usleep(500);
+    }
+}
+
+// saves the window's back buffer (before the swap) as a PPM
+static void dump_window(Player& player, size_t index, int frame)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    int width = viewport[2];
+    int height = viewport[3];
+    
+    vector<unsigned char> pixels(width * height * 3);
+    
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(viewport[0], viewport[1], width, height, 
+        GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    
+    char name[64];
+    snprintf(name, sizeof(name), "/screen%d-frame%05d.ppm", (int)index,
+        frame);
+    
+    string path = player.dump_dir + name;
+    
+    FILE* file = fopen(path.c_str(), "wb");
+    if(!file)
+        fatal("Failed to write " + path);
+    
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    
+    // GL's rows go bottom to top
+    for(int y = height-1; y >= 0; y--)
+        fwrite(&pixels[y * width * 3], 1, width * 3, file);
+    
+    fclose(file);
+}
+
+void run_bench(Player& player, GLint Window_::* shader_program)
+{
+    Decoder& decoder = player.decoder;
+    
+    if(!player.dump_dir.empty())
+        mkdir(player.dump_dir.c_str(), 0755);
+    
+    StageTimes stages[BENCH_STAGES];
+    DecoderFrame displayed;
+    
+    // draw time of each screen on its own, since it grows with resolution
+    vector<StageTimes> screen_draw(player.windows.size());
+    vector<int> screen_width(player.windows.size());
+    vector<int> screen_height(player.windows.size());
+    
+    int frames = 0;
+    int64_t bench_start = av_gettime_relative();
+    
+    while(frames < player.bench_frames)
+    {
+        int64_t stage_start = av_gettime_relative();
+        
+        DecoderFrame df = wait_for_frame(player);
+        if(!df.frame)
+        {
+            cerr << "Video ended after " << frames << " frames\n";
+            break;
+        }
+        
+        stages[BENCH_DECODE].add(ms_since(stage_start));
+        
+        RenderFrame rf;
+        rf.now = av_rescale(df.frame->pts * AV_TIME_BASE, 
+            decoder.time_base.num, decoder.time_base.den);
+        rf.shader_program = shader_program;
+        
+        // frames from the upload thread are on the GPU already
+        if(df.slot < 0)
+            rf.pixels = df.frame->data[0];
+        
+        rf.width = decoder.codec_context->width;
+        rf.height = decoder.codec_context->height;
+        
+        if(decoder.polar_packing)
+            rf.height = player.polar.packed_height;
+        rf.frame = df;
+        
+        double upload_ms = 0.0;
+        double draw_ms = 0.0;
+        double readback_ms = 0.0;
+        
+        for(size_t i = 0; i < player.windows.size(); i++)
+        {
+            player.windows[i]->make_current();
+            
+            stage_start = av_gettime_relative();
+            prepare_texture(player, i, rf);
+            glFinish();
+            upload_ms += ms_since(stage_start);
+            
+            stage_start = av_gettime_relative();
+            draw_window(player, i, rf);
+            
+            if(player.upload_thread)
+                player.uploader.after_draw(i);
+            
+            glFinish();
+            
+            double ms = ms_since(stage_start);
+            draw_ms += ms;
+            screen_draw[i].add(ms);
+            
+            GLint viewport[4];
+            glGetIntegerv(GL_VIEWPORT, viewport);
+            screen_width[i] = viewport[2];
+            screen_height[i] = viewport[3];
+            
+            if(!player.dump_dir.empty())
+            {
+                stage_start = av_gettime_relative();
+                dump_window(player, i, frames);
+                readback_ms += ms_since(stage_start);
+            }
+        }
+        
+        stages[BENCH_UPLOAD].add(upload_ms);
+        stages[BENCH_DRAW].add(draw_ms);
+        
+        if(!player.dump_dir.empty())
+            stages[BENCH_READBACK].add(readback_ms);
+        
+        stage_start = av_gettime_relative();
+        
+        for(size_t i = 0; i < player.windows.size(); i++)
+            player.windows[i]->swap_buffers();
+        
+        stages[BENCH_SWAP].add(ms_since(stage_start));
+        
+        retire_frame(player, displayed, df);
+        frames++;
+    }
+    
+    double total_ms = ms_since(bench_start);
+    
+    if(displayed.frame)
+        player.return_frame(displayed);
+    
+    cout << "--- Benchmark: " << frames << " frames, " 
+         << player.windows.size() << " screens ---\n";
+    cout << fixed << setprecision(3);
+    cout << "total: " << total_ms << " ms (" 
+         << (total_ms > 0.0 ? 1000.0 * frames / total_ms : 0.0) 
+         << " fps)\n";
+    
+    for(int i = 0; i < BENCH_STAGES; i++)
+    {
+        const StageTimes& st = stages[i];
+        if(st.count == 0)
+            continue;
+        
+        cout << stage_names[i] << ": avg " << st.total_ms / st.count
+             << " ms, min " << st.min_ms << " ms, max " << st.max_ms 
+             << " ms\n";
+    }
+    
+    for(size_t i = 0; i < screen_draw.size(); i++)
+    {
+        const StageTimes& st = screen_draw[i];
+        if(st.count == 0)
+            continue;
+        
+        cout << "draw, screen " << i << " (" << screen_width[i] << "x" 
+             << screen_height[i] << "): avg " << st.total_ms / st.count
+             << " ms, min " << st.min_ms << " ms, max " << st.max_ms 
+             << " ms\n";
+    }
+}
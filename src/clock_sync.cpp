@@ -0,0 +1,427 @@
+#include "clock_sync.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// packets: type, then big endian timestamps
+#define CLOCK_REQUEST  'C' // client send time
+#define CLOCK_RESPONSE 'c' // client send, server receive, server send time
+#define CLOCK_REQUEST_SIZE  (1 + 8)
+#define CLOCK_RESPONSE_SIZE (1 + 3*8)
+
+// time between requests, quicker until the filter has filled
+#define CLOCK_INTERVAL 250000
+#define CLOCK_FAST_INTERVAL 50000
+
+// offsets further than this from the estimate are taken as they are
+// (the server restarted, or this is the first)
+#define CLOCK_STEP 10000
+
+// how quickly the estimate follows new samples
+#define CLOCK_PHASE_GAIN 0.25
+#define CLOCK_FREQ_GAIN (1.0/16)
+
+// most any sane pair of clocks drift apart (as in NTP, 15 ppm), and the
+// most the drift estimate is allowed to correct for
+#define CLOCK_MAX_DRIFT 15e-6
+#define CLOCK_MAX_CORRECTION 500e-6
+
+static void write_time(unsigned char* p, int64_t t)
+{
+    uint64_t u = (uint64_t)t;
+    
+    for(int i = 7; i >= 0; i--)
+    {
+        p[i] = u & 0xFF;
+        u >>= 8;
+    }
+}
+
+static int64_t read_time(const unsigned char* p)
+{
+    uint64_t u = 0;
+    
+    for(int i = 0; i < 8; i++)
+        u = (u << 8) | p[i];
+    
+    return (int64_t)u;
+}
+
+static void open_socket(int& fd)
+{
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    
+    #ifdef SO_TIMESTAMPNS
+    // not fatal: receive times are then taken after the fact
+    unsigned int yes = 1;
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof(yes)) < 0)
+        perror("setsockopt SO_TIMESTAMPNS");
+    #endif
+}
+
+// receives one packet without blocking; when is set to the time it
+// arrived, in av_gettime_relative() microseconds
+static ssize_t receive(int fd, unsigned char* buffer, size_t size,
+    struct sockaddr_in* from, int64_t& when)
+{
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    
+    char control[256];
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = from ? sizeof(*from) : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    ssize_t result = recvmsg(fd, &msg, MSG_DONTWAIT);
+    
+    when = av_gettime_relative();
+    
+    #ifdef SO_TIMESTAMPNS
+    // the kernel's timestamp is wall clock time, so it's converted by how
+    // long ago it was rather than directly
+    struct cmsghdr* cmsg;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_TIMESTAMPNS)
+        {
+            continue;
+        }
+        
+        struct timespec arrived, real;
+        memcpy(&arrived, CMSG_DATA(cmsg), sizeof(arrived));
+        clock_gettime(CLOCK_REALTIME, &real);
+        
+        int64_t age = (int64_t)(real.tv_sec - arrived.tv_sec) * 1000000 +
+            (real.tv_nsec - arrived.tv_nsec) / 1000;
+        
+        // (unless the wall clock was just set)
+        if(age >= 0 && age < 1000000)
+            when -= age;
+    }
+    #endif
+    
+    return result;
+}
+
+static void* clock_sync_server_main(void* arg)
+{
+    ClockSync* sync = (ClockSync*)arg;
+    sync->server_loop();
+    
+    return NULL;
+}
+
+static void* clock_sync_client_main(void* arg)
+{
+    ClockSync* sync = (ClockSync*)arg;
+    sync->client_loop();
+    
+    return NULL;
+}
+
+void ClockSync::start_server()
+{
+    open_socket(fd);
+    
+    unsigned int yes = 1;
+    
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+    {
+        perror("setsockopt SO_REUSEADDR");
+        exit(EXIT_FAILURE);
+    }
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    
+    running = true;
+    pthread_create(&thread, NULL, clock_sync_server_main, this);
+}
+
+void ClockSync::start_client(const string& server_address, Stats* stats)
+{
+    this->stats = stats;
+    
+    struct hostent* he;
+    
+    if((he = gethostbyname(server_address.c_str())) == NULL)
+    {
+        perror("gethostbyname");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    
+    open_socket(fd);
+    
+    running = true;
+    pthread_create(&thread, NULL, clock_sync_client_main, this);
+}
+
+void ClockSync::stop()
+{
+    if(!running)
+        return;
+    
+    exit_flag = true;
+    
+    void* unused;
+    pthread_join(thread, &unused);
+    
+    close(fd);
+    fd = -1;
+    running = false;
+}
+
+void ClockSync::server_loop()
+{
+    unsigned char packet[CLOCK_RESPONSE_SIZE];
+    
+    while(!exit_flag)
+    {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        int status = poll(&pfd, 1, 100);
+        
+        if(status < 0 && errno != EINTR)
+        {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        
+        if(status <= 0)
+            continue;
+        
+        struct sockaddr_in from;
+        int64_t received;
+        
+        ssize_t size = receive(fd, packet, sizeof(packet), &from, received);
+        
+        if(size != CLOCK_REQUEST_SIZE || packet[0] != CLOCK_REQUEST)
+            continue;
+        
+        // the client's send time is already in place
+        packet[0] = CLOCK_RESPONSE;
+        write_time(packet + 1 + 8, received);
+        write_time(packet + 1 + 16, av_gettime_relative());
+        
+        sendto(fd, packet, CLOCK_RESPONSE_SIZE, 0,
+            (struct sockaddr*)&from, sizeof(from));
+    }
+}
+
+void ClockSync::client_loop()
+{
+    unsigned char packet[CLOCK_RESPONSE_SIZE];
+    
+    int64_t next_request = 0;
+    
+    while(!exit_flag)
+    {
+        int64_t wall = av_gettime_relative();
+        
+        if(wall >= next_request)
+        {
+            packet[0] = CLOCK_REQUEST;
+            write_time(packet + 1, wall);
+            
+            sendto(fd, packet, CLOCK_REQUEST_SIZE, 0,
+                (struct sockaddr*)&server_addr, sizeof(server_addr));
+            
+            pthread_mutex_lock(&mutex);
+            bool filled = sample_count == CLOCK_FILTER_SIZE;
+            pthread_mutex_unlock(&mutex);
+            
+            next_request = wall +
+                (filled ? CLOCK_INTERVAL : CLOCK_FAST_INTERVAL);
+        }
+        
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        int wait_ms = (int)((next_request - wall + 999) / 1000);
+        int status = poll(&pfd, 1, wait_ms);
+        
+        if(status < 0 && errno != EINTR)
+        {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        
+        if(status <= 0)
+            continue;
+        
+        int64_t received;
+        ssize_t size = receive(fd, packet, sizeof(packet), NULL, received);
+        
+        if(size != CLOCK_RESPONSE_SIZE || packet[0] != CLOCK_RESPONSE)
+            continue;
+        
+        int64_t sent = read_time(packet + 1);
+        int64_t server_received = read_time(packet + 1 + 8);
+        int64_t server_sent = read_time(packet + 1 + 16);
+        
+        // (a response to someone else's request, or garbage)
+        if(sent > received || received - sent > 1000000)
+            continue;
+        
+        ClockSample sample;
+        sample.offset = ((server_received - sent) +
+            (server_sent - received)) / 2;
+        sample.delay = (received - sent) - (server_sent - server_received);
+        sample.received = received;
+        
+        if(sample.delay < 0)
+            sample.delay = 0;
+        
+        add_sample(sample);
+    }
+}
+
+void ClockSync::add_sample(const ClockSample& sample)
+{
+    pthread_mutex_lock(&mutex);
+    
+    samples[sample_next] = sample;
+    sample_next = (sample_next + 1) % CLOCK_FILTER_SIZE;
+    
+    if(sample_count < CLOCK_FILTER_SIZE)
+        sample_count++;
+    
+    int best = 0;
+    for(int i = 1; i < sample_count; i++)
+    {
+        if(samples[i].delay < samples[best].delay)
+            best = i;
+    }
+    
+    const ClockSample& s = samples[best];
+    
+    // only ever move forward to newer samples, as NTP does; an old one
+    // has been followed already
+    if(s.received > used)
+    {
+        double dt = (double)(s.received - reference);
+        double predicted = offset + drift * dt;
+        double error = s.offset - predicted;
+        
+        if(!synced || fabs(error) > CLOCK_STEP)
+        {
+            offset = s.offset;
+            drift = 0.0;
+        }
+        else
+        {
+            offset = predicted + CLOCK_PHASE_GAIN * error;
+            
+            if(dt > 0)
+                drift += CLOCK_FREQ_GAIN * error / dt;
+            
+            if(drift > CLOCK_MAX_CORRECTION)
+                drift = CLOCK_MAX_CORRECTION;
+            if(drift < -CLOCK_MAX_CORRECTION)
+                drift = -CLOCK_MAX_CORRECTION;
+        }
+        
+        reference = s.received;
+        used = s.received;
+        delay = s.delay;
+        synced = true;
+    }
+    
+    double drift_ppm = drift * 1e6;
+    
+    pthread_mutex_unlock(&mutex);
+    
+    int64_t wall = av_gettime_relative();
+    int64_t server;
+    double error;
+    
+    if(stats && to_server(wall, server, &error))
+    {
+        stats->set("clock.offset_ms", (server - wall) / 1000.0);
+        stats->set("clock.error_ms", error / 1000.0);
+        stats->set("clock.delay_ms", sample.delay / 1000.0);
+        stats->set("clock.drift_ppm", drift_ppm);
+    }
+}
+
+bool ClockSync::to_server(int64_t local, int64_t& server, double* error)
+{
+    pthread_mutex_lock(&mutex);
+    
+    bool result = synced;
+    
+    if(synced)
+    {
+        double since = (double)(local - reference);
+        server = local + (int64_t)llround(offset + drift * since);
+        
+        if(error)
+            *error = delay / 2.0 + fabs((double)(local - used)) *
+                CLOCK_MAX_DRIFT;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+bool ClockSync::to_local(int64_t server, int64_t& local)
+{
+    pthread_mutex_lock(&mutex);
+    
+    bool result = synced;
+    
+    // (drift over the difference between the clocks is negligible)
+    if(synced)
+    {
+        double since = (double)(server - offset - reference);
+        local = server - (int64_t)llround(offset + drift * since);
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
@@ -0,0 +1,87 @@
+#include "command_queue.h"
+
+#include <iostream>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+void CommandQueue::push(int64_t at, const Message& message)
+{
+    ScheduledCommand command;
+    command.at = at;
+    command.message = message;
+    command.message.rewind();
+    
+    // after everything due at the same time, so ties keep their order
+    vector<ScheduledCommand>::iterator it = commands.end();
+    while(it != commands.begin() && (it - 1)->at > at)
+        it--;
+    
+    commands.insert(it, command);
+}
+
+void CommandQueue::take(vector<Message>& messages, ClockSync& clock)
+{
+    size_t kept = 0;
+    
+    for(size_t i = 0; i < messages.size(); i++)
+    {
+        Message& m = messages[i];
+        
+        if(m.size() == 0 || m.bytes[0] != 'A')
+        {
+            if(kept != i)
+                messages[kept] = m;
+            
+            kept++;
+            continue;
+        }
+        
+        try
+        {
+            m.rewind();
+            m.read_char();
+            int64_t server_at = m.read_int64();
+            
+            Message inner;
+            inner.fd = m.fd;
+            inner.bytes.assign(m.bytes.begin() + m.parse_pos, m.bytes.end());
+            
+            int64_t at;
+            if(!clock.to_local(server_at, at))
+                at = av_gettime_relative();
+            
+            push(at, inner);
+        }
+        catch(ParseError pe)
+        {
+            cerr << "Network parse error: " << pe.what() << '\n';
+        }
+    }
+    
+    messages.resize(kept);
+}
+
+void CommandQueue::pop_due(int64_t present, vector<Message>& out)
+{
+    size_t due = 0;
+    
+    while(due < commands.size() && commands[due].at <= present)
+    {
+        out.push_back(commands[due].message);
+        due++;
+    }
+    
+    commands.erase(commands.begin(), commands.begin() + due);
+}
+
+bool CommandQueue::next(int64_t& at)
+{
+    if(commands.empty())
+        return false;
+    
+    at = commands[0].at;
+    return true;
+}
@@ -0,0 +1,388 @@
+#include "cpu_render.h"
+
+#include <cmath>
+#include <unistd.h>
+using namespace std;
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const float TURN = 6.283185307179586f;
+
+// rotationMatrix() from simple-mono.vert (which is column major)
+static void rotation_matrix(float m[3][3], float ax, float ay, float az,
+    float angle)
+{
+    float s = -sin(angle);
+    float c = cos(angle);
+    float oc = 1.0f - c;
+    
+    // rows of the matrix, i.e. the shader's columns read across
+    m[0][0] = oc * ax * ax + c;
+    m[1][0] = oc * ax * ay - az * s;
+    m[2][0] = oc * az * ax + ay * s;
+    
+    m[0][1] = oc * ax * ay + az * s;
+    m[1][1] = oc * ay * ay + c;
+    m[2][1] = oc * ay * az - ax * s;
+    
+    m[0][2] = oc * az * ax - ay * s;
+    m[1][2] = oc * ay * az + ax * s;
+    m[2][2] = oc * az * az + c;
+}
+
+static void multiply(float out[3][3], const float a[3][3],
+    const float b[3][3])
+{
+    for(int i = 0; i < 3; i++)
+    {
+        for(int j = 0; j < 3; j++)
+        {
+            out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] +
+                a[i][2] * b[2][j];
+        }
+    }
+}
+
+static void transform(float out[3], const float m[3][3], const float v[3])
+{
+    for(int i = 0; i < 3; i++)
+        out[i] = m[i][0] * v[0] + m[i][1] * v[1] + m[i][2] * v[2];
+}
+
+static float deg2rad(float d)
+{
+    return 3.1415926535f / 180.0f * d;
+}
+
+void ScreenBasis::setup(const ScreenConfig& sc, float theta, float phi,
+    int width, int height)
+{
+    float rot_r[3][3], rot_p[3][3], rot_h[3][3];
+    rotation_matrix(rot_r, 0, 1, 0, deg2rad(sc.roll));
+    rotation_matrix(rot_p, 1, 0, 0, deg2rad(sc.pitch));
+    rotation_matrix(rot_h, 0, 0, 1, deg2rad(sc.heading));
+    
+    float rot_theta[3][3], rot_phi[3][3];
+    rotation_matrix(rot_theta, 0, 0, 1, theta);
+    rotation_matrix(rot_phi, 1, 0, 0, phi);
+    
+    float rot_hp[3][3], rot_rph[3][3], rot_view[3][3];
+    multiply(rot_hp, rot_h, rot_p);
+    multiply(rot_rph, rot_hp, rot_r);
+    multiply(rot_view, rot_theta, rot_phi);
+    
+    // pos = view * (rph * (width/2 * x, 0, height/2 * y) + center), with x
+    // and y going from -1 to 1 across the screen
+    float center[3] = {sc.originX, sc.originY, sc.originZ};
+    float half_x[3] = {sc.width / 2, 0, 0};
+    float half_y[3] = {0, 0, sc.height / 2};
+    
+    float c[3], hx[3], hy[3], tmp[3];
+    transform(c, rot_view, center);
+    transform(tmp, rot_rph, half_x);
+    transform(hx, rot_view, tmp);
+    transform(tmp, rot_rph, half_y);
+    transform(hy, rot_view, tmp);
+    
+    // pixel centres: x = 2*(col+0.5)/width - 1, y = 1 - 2*(row+0.5)/height
+    float x0 = 1.0f / width - 1.0f;
+    float y0 = 1.0f - 1.0f / height;
+    
+    for(int i = 0; i < 3; i++)
+    {
+        origin[i] = c[i] + x0 * hx[i] + y0 * hy[i];
+        step_x[i] = hx[i] * 2.0f / width;
+        step_y[i] = -hy[i] * 2.0f / height;
+    }
+}
+
+// atan(t) for t in [0, 1]; odd minimax polynomial, max error 1.8e-6
+#define ATAN_POLY(t, s) ((t) * (0.99997726f + (s) * (-0.33262347f + \
+    (s) * (0.19354346f + (s) * (-0.11643287f + (s) * (0.05265332f + \
+    (s) * -0.01172120f))))))
+
+#ifdef __SSE2__
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 atan2_ps(__m128 y, __m128 x)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    
+    __m128 ax = _mm_andnot_ps(sign, x);
+    __m128 ay = _mm_andnot_ps(sign, y);
+    
+    // fold into [0, 1] and unfold the result afterwards. The tiny
+    // denominator keeps (0, 0) at 0 instead of NaN.
+    __m128 t = _mm_div_ps(_mm_min_ps(ax, ay),
+        _mm_max_ps(_mm_max_ps(ax, ay), _mm_set1_ps(1e-30f)));
+    __m128 s = _mm_mul_ps(t, t);
+    
+    __m128 r = _mm_set1_ps(-0.01172120f);
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.05265332f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(-0.11643287f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.19354346f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(-0.33262347f));
+    r = _mm_add_ps(_mm_mul_ps(r, s), _mm_set1_ps(0.99997726f));
+    r = _mm_mul_ps(r, t);
+    
+    r = select_ps(_mm_cmpgt_ps(ay, ax),
+        _mm_sub_ps(_mm_set1_ps(TURN / 4), r), r);
+    r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()),
+        _mm_sub_ps(_mm_set1_ps(TURN / 2), r), r);
+    
+    // copy y's sign onto the result
+    return _mm_or_ps(r, _mm_and_ps(sign, y));
+}
+
+#else
+
+static inline float atan2_poly(float y, float x)
+{
+    float ax = fabs(x);
+    float ay = fabs(y);
+    
+    float big = ax > ay ? ax : ay;
+    float t = (ax < ay ? ax : ay) / (big > 1e-30f ? big : 1e-30f);
+    float r = ATAN_POLY(t, t * t);
+    
+    if(ay > ax)
+        r = TURN / 4 - r;
+    if(x < 0)
+        r = TURN / 2 - r;
+    
+    return y < 0 ? -r : r;
+}
+
+#endif
+
+// Where 4 directions land in the equirect frame, as direction_to_uv() in
+// projection-equirect.frag works them out: the texel to the top left of
+// each sample point (GL_LINEAR convention, texel centres at +0.5) and the
+// weights of the texels to its right and below, out of 256. Texels are
+// offset by one whole frame so that they are never negative.
+static void project(const float* x, const float* y, const float* z,
+    float w, float h, int* texel_x, int* texel_y, int* weight_x,
+    int* weight_y)
+{
+#ifdef __SSE2__
+    __m128 vx = _mm_loadu_ps(x);
+    __m128 vy = _mm_loadu_ps(y);
+    __m128 vz = _mm_loadu_ps(z);
+    
+    __m128 lon = atan2_ps(vy, vx);
+    lon = _mm_add_ps(lon, _mm_and_ps(_mm_cmplt_ps(lon, _mm_setzero_ps()),
+        _mm_set1_ps(TURN)));
+    
+    __m128 xy = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vx, vx),
+        _mm_mul_ps(vy, vy)));
+    __m128 lat = atan2_ps(vz, xy);
+    
+    // u = 1 - lon/TURN, v = 1 - (lat/(TURN/4) + 1)/2 = 0.5 - lat/(TURN/2),
+    // and then + 1 - 0.5 texel to move to the sampling convention
+    __m128 u = _mm_sub_ps(_mm_set1_ps(2.0f),
+        _mm_mul_ps(lon, _mm_set1_ps(1.0f / TURN)));
+    __m128 v = _mm_sub_ps(_mm_set1_ps(1.5f),
+        _mm_mul_ps(lat, _mm_set1_ps(2.0f / TURN)));
+    
+    __m128 s = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(w)), _mm_set1_ps(0.5f));
+    __m128 t = _mm_sub_ps(_mm_mul_ps(v, _mm_set1_ps(h)), _mm_set1_ps(0.5f));
+    
+    // positive, so truncating is flooring
+    __m128i is = _mm_cvttps_epi32(s);
+    __m128i it = _mm_cvttps_epi32(t);
+    
+    const __m128 scale = _mm_set1_ps(256.0f);
+    __m128i ws = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_sub_ps(s, _mm_cvtepi32_ps(is)), scale));
+    __m128i wt = _mm_cvtps_epi32(_mm_mul_ps(
+        _mm_sub_ps(t, _mm_cvtepi32_ps(it)), scale));
+    
+    _mm_storeu_si128((__m128i*)texel_x, is);
+    _mm_storeu_si128((__m128i*)texel_y, it);
+    _mm_storeu_si128((__m128i*)weight_x, ws);
+    _mm_storeu_si128((__m128i*)weight_y, wt);
+#else
+    for(int i = 0; i < 4; i++)
+    {
+        float lon = atan2_poly(y[i], x[i]);
+        if(lon < 0)
+            lon += TURN;
+        
+        float lat = atan2_poly(z[i], sqrt(x[i] * x[i] + y[i] * y[i]));
+        
+        float s = (2.0f - lon / TURN) * w - 0.5f;
+        float t = (1.5f - lat * 2.0f / TURN) * h - 0.5f;
+        
+        texel_x[i] = (int)s;
+        texel_y[i] = (int)t;
+        weight_x[i] = (int)((s - texel_x[i]) * 256.0f + 0.5f);
+        weight_y[i] = (int)((t - texel_y[i]) * 256.0f + 0.5f);
+    }
+#endif
+}
+
+// GL_LINEAR with GL_REPEAT, with 8 bits of sub-texel precision like most
+// GPUs. x and y are within two frames of the origin (see project()).
+static inline void sample(const unsigned char* src, int w, int h,
+    int x, int y, int wx, int wy, unsigned char* out)
+{
+    int x0 = x >= w ? x - w : x;
+    int y0 = y >= h ? y - h : y;
+    x0 = x0 >= w ? x0 - w : x0;
+    y0 = y0 >= h ? y0 - h : y0;
+    
+    int x1 = x0 + 1 == w ? 0 : x0 + 1;
+    int y1 = y0 + 1 == h ? 0 : y0 + 1;
+    
+    const unsigned char* p00 = src + 3 * ((size_t)y0 * w + x0);
+    const unsigned char* p01 = src + 3 * ((size_t)y0 * w + x1);
+    const unsigned char* p10 = src + 3 * ((size_t)y1 * w + x0);
+    const unsigned char* p11 = src + 3 * ((size_t)y1 * w + x1);
+    
+    for(int c = 0; c < 3; c++)
+    {
+        int top = p00[c] * (256 - wx) + p01[c] * wx;
+        int bottom = p10[c] * (256 - wx) + p11[c] * wx;
+        
+        out[c] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+    }
+}
+
+static void draw_row(const CpuRenderer& cr, int row)
+{
+    const ScreenBasis& b = cr.basis;
+    
+    float base[3];
+    for(int i = 0; i < 3; i++)
+        base[i] = b.origin[i] + row * b.step_y[i];
+    
+    unsigned char* out = cr.target + 3 * (size_t)row * cr.target_width;
+    
+    float x[4], y[4], z[4];
+    int texel_x[4], texel_y[4], weight_x[4], weight_y[4];
+    
+    for(int col = 0; col < cr.target_width; col += 4)
+    {
+        for(int i = 0; i < 4; i++)
+        {
+            x[i] = base[0] + (col + i) * b.step_x[0];
+            y[i] = base[1] + (col + i) * b.step_x[1];
+            z[i] = base[2] + (col + i) * b.step_x[2];
+        }
+        
+        project(x, y, z, cr.source_width, cr.source_height, 
+            texel_x, texel_y, weight_x, weight_y);
+        
+        int count = cr.target_width - col < 4 ? cr.target_width - col : 4;
+        
+        for(int i = 0; i < count; i++)
+        {
+            sample(cr.source, cr.source_width, cr.source_height,
+                texel_x[i], texel_y[i], weight_x[i], weight_y[i], 
+                out + 3 * (col + i));
+        }
+    }
+}
+
+void CpuRenderer::draw_bands()
+{
+    while(true)
+    {
+        pthread_mutex_lock(&mutex);
+        int first = next_row;
+        next_row += CPU_RENDER_BAND_ROWS;
+        pthread_mutex_unlock(&mutex);
+        
+        if(first >= target_height)
+            return;
+        
+        int end = first + CPU_RENDER_BAND_ROWS;
+        if(end > target_height)
+            end = target_height;
+        
+        for(int row = first; row < end; row++)
+            draw_row(*this, row);
+    }
+}
+
+static void* cpu_render_main(void* arg)
+{
+    CpuRenderer* cr = (CpuRenderer*)arg;
+    cr->loop();
+    
+    return NULL;
+}
+
+void CpuRenderer::start(int thread_count)
+{
+    if(thread_count <= 0)
+        thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    if(thread_count < 1)
+        thread_count = 1;
+    
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    pthread_barrier_init(&done_barrier, NULL, thread_count);
+    
+    threads.resize(thread_count - 1);
+    
+    for(size_t i = 0; i < threads.size(); i++)
+        pthread_create(&threads[i], NULL, cpu_render_main, this);
+}
+
+void CpuRenderer::render(const ScreenConfig& sc, float theta, float phi,
+    unsigned char* out, int width, int height)
+{
+    if(!source)
+        return;
+    
+    basis.setup(sc, theta, phi, width, height);
+    target = out;
+    target_width = width;
+    target_height = height;
+    next_row = 0;
+    
+    if(threads.empty())
+    {
+        draw_bands();
+        return;
+    }
+    
+    pthread_barrier_wait(&start_barrier); // go!
+    draw_bands();
+    pthread_barrier_wait(&done_barrier);
+}
+
+void CpuRenderer::stop()
+{
+    if(threads.empty())
+        return;
+    
+    exit_flag = true;
+    pthread_barrier_wait(&start_barrier);
+    
+    for(size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+    
+    threads.clear();
+}
+
+void CpuRenderer::loop()
+{
+    while(true)
+    {
+        pthread_barrier_wait(&start_barrier);
+        
+        if(exit_flag)
+            return;
+        
+        draw_bands();
+        pthread_barrier_wait(&done_barrier);
+    }
+}
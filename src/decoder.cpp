@@ -169,6 +169,24 @@ bool Decoder::open(const std::string& path)
     duration = format_context->streams[video_stream_index]->duration;
     number_of_frames = format_context->streams[video_stream_index]->nb_frames;
     
+    // spherical video metadata (v2 "sv3d" box in MP4/MKV)
+    int spherical_size = 0;
+    AVSphericalMapping* spherical = (AVSphericalMapping*)
+        av_stream_get_side_data(format_context->streams[video_stream_index],
+            AV_PKT_DATA_SPHERICAL, &spherical_size);
+    
+    if(spherical)
+    {
+        if(spherical->projection == AV_SPHERICAL_CUBEMAP)
+            projection = PROJECTION_CUBEMAP;
+        else if(spherical->projection == AV_SPHERICAL_EQUIRECTANGULAR)
+            projection = PROJECTION_EQUIRECT;
+        else
+            cerr << "Unsupported spherical projection in metadata: " 
+                 << av_spherical_projection_name(spherical->projection)
+                 << "; assuming equirect\n";
+    }
+    
     
     #ifndef NO_AUDIO
     if(audio_stream_index != -1 && audio->setup_state != AuSS_NO_AUDIO)
@@ -476,6 +494,12 @@ continue_point:         // loop start
                         rgb_frame->data,
                         rgb_frame->linesize);
                     
+                    if(polar_packing)
+                    {
+                        polar_packing->pack(rgb_frame->data[0], 
+                            rgb_frame->linesize[0]);
+                    }
+                    
                     rgb_frame->pts = yuv_frame->pts;
                     rgb_frame->pkt_duration = yuv_frame->pkt_duration;
                     
@@ -0,0 +1,183 @@
+#include "encoder.h"
+#include "util.h"
+
+#include <iostream>
+#include <cerrno>
+using namespace std;
+
+static string error_string(int status)
+{
+    char buf[256];
+    av_strerror(status, buf, sizeof(buf));
+    return buf;
+}
+
+void Encoder::open(const string& path, int width, int height,
+    AVRational time_base, AVRational frame_rate)
+{
+    this->path = path;
+    this->width = width;
+    this->height = height;
+    
+    avformat_alloc_output_context2(&format_context, NULL, NULL, path.c_str());
+    if(!format_context)
+        fatal("Can't work out a container format for " + path);
+    
+    AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    if(!codec)
+    {
+        cerr << "libx264 not available; encoding " << path
+             << " as MPEG-4 instead\n";
+        codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+    }
+    
+    if(!codec)
+        fatal("No video encoder available for " + path);
+    
+    stream = avformat_new_stream(format_context, NULL);
+    if(!stream)
+        fatal("Failed to add a stream to " + path);
+    
+    codec_context = avcodec_alloc_context3(codec);
+    codec_context->width = width;
+    codec_context->height = height;
+    codec_context->pix_fmt = AV_PIX_FMT_YUV420P;
+    codec_context->time_base = time_base;
+    codec_context->framerate = frame_rate;
+    
+    // a keyframe every second or so, since clients seek to wherever the
+    // server's clock is when they join
+    codec_context->gop_size = 30;
+    if(frame_rate.num > 0 && frame_rate.den > 0)
+        codec_context->gop_size = (int)(av_q2d(frame_rate) + 0.5);
+    if(codec_context->gop_size < 1)
+        codec_context->gop_size = 1;
+    
+    if(format_context->oformat->flags & AVFMT_GLOBALHEADER)
+        codec_context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    
+    AVDictionary* opts = NULL;
+    if(codec->id == AV_CODEC_ID_H264)
+    {
+        // these get watched up close, so keep the quality high
+        av_dict_set(&opts, "crf", "18", 0);
+        av_dict_set(&opts, "preset", "medium", 0);
+    }
+    else
+    {
+        codec_context->bit_rate = (int64_t)width * height * 8;
+    }
+    
+    int status = avcodec_open2(codec_context, codec, &opts);
+    av_dict_free(&opts);
+    
+    if(status < 0)
+        fatal("Failed to open encoder for " + path + ": " +
+            error_string(status));
+    
+    avcodec_parameters_from_context(stream->codecpar, codec_context);
+    stream->time_base = time_base;
+    
+    if(!(format_context->oformat->flags & AVFMT_NOFILE))
+    {
+        status = avio_open(&format_context->pb, path.c_str(),
+            AVIO_FLAG_WRITE);
+        
+        if(status < 0)
+            fatal("Can't write " + path + ": " + error_string(status));
+    }
+    
+    status = avformat_write_header(format_context, NULL);
+    if(status < 0)
+        fatal("Failed to write header of " + path + ": " +
+            error_string(status));
+    
+    yuv_frame = av_frame_alloc();
+    yuv_frame->format = AV_PIX_FMT_YUV420P;
+    yuv_frame->width = width;
+    yuv_frame->height = height;
+    
+    if(av_frame_get_buffer(yuv_frame, 32) < 0)
+        fatal("Failed to allocate encoder frame");
+    
+    sws_context = sws_getContext(
+        width, height, AV_PIX_FMT_RGB24,
+        width, height, AV_PIX_FMT_YUV420P,
+        SWS_BILINEAR, NULL, NULL, NULL);
+    
+    if(!sws_context)
+        fatal("Failed to set up RGB to YUV conversion");
+}
+
+void Encoder::write(const unsigned char* rgb, int64_t pts)
+{
+    // the encoder may still hold on to the last frame's buffer
+    if(av_frame_make_writable(yuv_frame) < 0)
+        fatal("Failed to get a writable encoder frame");
+    
+    const uint8_t* src[1] = { rgb };
+    int src_stride[1] = { width * 3 };
+    
+    sws_scale(sws_context, src, src_stride, 0, height,
+        yuv_frame->data, yuv_frame->linesize);
+    
+    yuv_frame->pts = pts;
+    
+    int status = avcodec_send_frame(codec_context, yuv_frame);
+    if(status < 0)
+        fatal("Failed to encode a frame of " + path + ": " +
+            error_string(status));
+    
+    write_packets();
+}
+
+void Encoder::write_packets()
+{
+    while(true)
+    {
+        AVPacket packet;
+        av_init_packet(&packet);
+        packet.data = NULL;
+        packet.size = 0;
+        
+        int status = avcodec_receive_packet(codec_context, &packet);
+        if(status == AVERROR(EAGAIN) || status == AVERROR_EOF)
+            return;
+        
+        if(status < 0)
+            fatal("Encoder failed for " + path + ": " + error_string(status));
+        
+        av_packet_rescale_ts(&packet, codec_context->time_base,
+            stream->time_base);
+        packet.stream_index = stream->index;
+        
+        // takes ownership of the packet's data
+        status = av_interleaved_write_frame(format_context, &packet);
+        if(status < 0)
+            fatal("Failed to write to " + path + ": " + error_string(status));
+    }
+}
+
+void Encoder::close()
+{
+    if(!format_context)
+        return;
+    
+    // flush the frames still buffered for B-frames and lookahead
+    avcodec_send_frame(codec_context, NULL);
+    write_packets();
+    
+    av_write_trailer(format_context);
+    
+    if(!(format_context->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&format_context->pb);
+    
+    sws_freeContext(sws_context);
+    av_frame_free(&yuv_frame);
+    avcodec_free_context(&codec_context);
+    avformat_free_context(format_context);
+    
+    format_context = NULL;
+    stream = NULL;
+    sws_context = NULL;
+}
@@ -25,7 +25,10 @@ using namespace std;
 #include "network.h"
 #include "screen.h"
 #include "player.h"
+#include "render.h"
 #include "shader.h"
+#include "bench.h"
+#include "prewarp.h"
 #include "util.h"
 
 #include <GL/glew.h>
@@ -44,14 +47,16 @@ using namespace std;
 
 int main(int argc, char* argv[]) 
 {        
-    if(!glfwInit())
-    {
-        glfwTerminate();
-        cerr << "Failed to init GLFW3\n";
-        return EXIT_FAILURE;
-    }
+    // must come before any other Xlib call (including the ones glfwInit
+    // makes) in case windows are drawn from their own threads later
+    XInitThreads();
+    
+    // --offscreen runs without GLFW, so failing here only matters once the
+    // arguments say windows are wanted
+    bool glfw_ok = glfwInit();
     
-    monitor_test();
+    if(glfw_ok)
+        monitor_test();
     
     Player player;
     
@@ -76,14 +81,95 @@ int main(int argc, char* argv[])
 #endif
 
     parse_args(player, argc, argv);
+    
+    if(!player.prewarp_dir.empty())
+    {
+        run_prewarp(player);
+        return EXIT_SUCCESS;
+    }
+    
+    if(!glfw_ok && !player.offscreen)
+    {
+        glfwTerminate();
+        cerr << "Failed to init GLFW3\n";
+        return EXIT_FAILURE;
+    }
+    
+    if(!player.dump_dir.empty() && player.bench_frames == 0)
+        fatal("--dump-frames only applies to --bench");
+    
+    if(player.bench_frames > 0)
+    {
+        if(player.use_multicast && player.type == NT_CLIENT)
+            fatal("--bench needs to decode the video itself; not available to multicast clients");
+        
+        // the benchmark drives every window itself, at full resolution so
+        // that timings and dumped images are comparable between runs
+        player.render_threads = false;
+        player.decoupled_render = false;
+        player.dynamic_resolution = false;
+        player.swap_barrier.enabled = false;
+    }
 
+    if(player.cpu_render)
+    {
+        if(player.stereo || player.type == NT_SERVER)
+            fatal("--cpu-render only draws mono screens");
+        
+        // CpuRenderer reads the frame as decoded, straight from memory,
+        // and already uses every core
+        if(player.polar_decimation || player.cubemap || player.tile_size ||
+            player.upload_thread)
+        {
+            cerr << "--cpu-render ignores --polar-decimation, --cubemap, "
+                 << "--tile-size and --upload-thread\n";
+        }
+        
+        player.polar_decimation = false;
+        player.cubemap = false;
+        player.tile_size = 0;
+        player.upload_thread = false;
+        player.render_threads = false;
+        player.dynamic_resolution = false;
+    }
+    
+    if(player.prewarped)
+    {
+        if(player.type == NT_SERVER)
+            fatal("--prewarped is for clients; the server plays the source video");
+        
+        if(player.stereo || player.cpu_render)
+            fatal("--prewarped streams are drawn as they are; --stereo and --cpu-render don't apply");
+        
+        // the frames are already what the screens show
+        if(player.polar_decimation || player.cubemap)
+            cerr << "--prewarped ignores --polar-decimation and --cubemap\n";
+        
+        player.polar_decimation = false;
+        player.cubemap = false;
+    }
+    
     Server*& server = player.server;
     Client*& client = player.client;
     NetworkThread*& nt = player.nt;
     
     Decoder& decoder = player.decoder;
     
+    player.wakeup.setup();
     player.start_threads();
+    
+    if(player.swap_barrier.enabled)
+    {
+        if(server)
+            player.swap_barrier.start_server(&player.stats);
+        
+        // the server's own windows are only a preview, not part of the wall
+        if(player.type == NT_HEADLESS)
+            player.swap_barrier.setup_node("127.0.0.1", player.hostname);
+        else if(client)
+            player.swap_barrier.setup_node(player.server_address,
+                player.hostname);
+    }
 
     if(server && player.screen_config.size() == 0)
     {
@@ -104,11 +190,26 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
     
+    // GLFW windows need their events handled even while the loop is idle
+    for(size_t i = 0; i < player.windows.size(); i++)
+    {
+        if(player.windows[i]->glfw_window)
+            player.wakeup.use_glfw = true;
+    }
+    
     //glfwMakeContextCurrent(player.windows[0]);
     player.windows[0]->make_current();
         
     // initialize GLEW
     GLenum glew_error = glewInit();
+    
+    // GLEW built for GLX can't find a GLX display under EGL, but has
+    // loaded the GL entry points by then
+    #ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if(player.offscreen && glew_error == GLEW_ERROR_NO_GLX_DISPLAY)
+        glew_error = GLEW_OK;
+    #endif
+    
     if (GLEW_OK != glew_error)
     {
       cerr << "GLEW Error: " << glewGetErrorString(glew_error);
@@ -116,6 +217,69 @@ int main(int argc, char* argv[])
       return EXIT_FAILURE;
     }
     
+    // frames too big for one texture are drawn from a grid of tiles
+    {
+        GLint max_texture_size = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_texture_size);
+        
+        int frame_width = decoder.codec_context ? 
+            decoder.codec_context->width : 0;
+        int frame_height = decoder.codec_context ?
+            decoder.codec_context->height : 0;
+        
+        if(player.use_multicast && player.type == NT_CLIENT)
+        {
+            frame_width = player.mc_client.width;
+            frame_height = player.mc_client.height;
+        }
+        else if(decoder.polar_packing)
+        {
+            frame_height = player.polar.packed_height;
+        }
+        
+        if(player.tile_size == 0 && !player.cpu_render &&
+            (frame_width > max_texture_size || 
+             frame_height > max_texture_size))
+        {
+            player.tile_size = min(max_texture_size, 2048);
+        }
+        
+        if(player.tile_size > 0)
+            player.tiled = true;
+        
+        if(player.tiled && !GLEW_EXT_texture_array)
+            fatal("Video is larger than the maximum texture size and tiling it needs GL_EXT_texture_array");
+        
+        if(player.tiled)
+        {
+            player.tile_grid.setup(frame_width, frame_height,
+                min(player.tile_size, (int)max_texture_size));
+            
+            GLint max_layers = 0;
+            glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS_EXT, &max_layers);
+            
+            if(player.tile_grid.count() > max_layers)
+                fatal("Too many tiles for this GPU; try a bigger --tile-size");
+            
+            cout << "Tiling " << frame_width << "x" << frame_height 
+                 << " video as " << player.tile_grid.columns << "x" 
+                 << player.tile_grid.rows << " tiles\n";
+            
+            if(player.aa_mode == AA_MIPMAP)
+            {
+                cerr << "--aa mip isn't available with tiled textures; "
+                     << "using supersample\n";
+                player.aa_mode = AA_SUPERSAMPLE;
+            }
+            
+            if(player.upload_thread)
+            {
+                cerr << "--upload-thread isn't available with tiled textures\n";
+                player.upload_thread = false;
+            }
+        }
+    }
+    
     // Fixes weird X Cursor bug when you have two GPUs on CentOS 7
     // This is very important for the SunCAVE
     if(player.suncave_workarounds)
@@ -139,6 +303,22 @@ int main(int argc, char* argv[])
     aa_mono_equirect_files.push_back("shaders/simple-mono.vert");
     aa_mono_equirect_files.push_back("shaders/aa-mono.frag");
     
+    vector<string> mip_mono_equirect_files;
+    mip_mono_equirect_files.push_back("shaders/simple-mono.vert");
+    mip_mono_equirect_files.push_back("shaders/mip-mono.frag");
+    
+    vector<string> equirect_to_cube_files;
+    equirect_to_cube_files.push_back("shaders/equirect-to-cube.vert");
+    equirect_to_cube_files.push_back("shaders/equirect-to-cube.frag");
+    
+    vector<string> cube_mono_files;
+    cube_mono_files.push_back("shaders/simple-mono.vert");
+    cube_mono_files.push_back("shaders/cube-mono.frag");
+    
+    vector<string> aa_cube_mono_files;
+    aa_cube_mono_files.push_back("shaders/simple-mono.vert");
+    aa_cube_mono_files.push_back("shaders/aa-cube-mono.frag");
+    
     vector<string> stereo_equirect_files;
     stereo_equirect_files.push_back("shaders/simple-stereo.vert");
     stereo_equirect_files.push_back("shaders/simple-stereo.frag");
@@ -147,22 +327,139 @@ int main(int argc, char* argv[])
     stereo_interleaved_files.push_back("shaders/simple-stereo.vert");
     stereo_interleaved_files.push_back("shaders/interleaved-stereo.frag");
     
-    // need to compile shaders for each window
-    for(size_t i = 0; i < player.windows.size(); i++)
-    {    
-        player.windows[i]->make_current();
+    // every shader that looks up the video by direction gets the layout's
+    // direction_to_uv() linked in
+    if(!player.projection_set)
+        player.projection = decoder.projection;
+    
+    if(player.cpu_render && player.projection != PROJECTION_EQUIRECT)
+        fatal("--cpu-render only reads equirect video");
+    
+    string projection_file = "shaders/projection-equirect.frag";
+    
+    if(player.projection == PROJECTION_CUBEMAP)
+        projection_file = "shaders/projection-cubemap.frag";
+    else if(player.projection == PROJECTION_EAC)
+        projection_file = "shaders/projection-eac.frag";
+    
+    mono_equirect_files.push_back(projection_file);
+    aa_mono_equirect_files.push_back(projection_file);
+    mip_mono_equirect_files.push_back(projection_file);
+    equirect_to_cube_files.push_back(projection_file);
+    stereo_equirect_files.push_back(projection_file);
+    stereo_interleaved_files.push_back(projection_file);
+    
+    // ... and sample_video(), which has to undo --polar-decimation, on top
+    // of fetch_video(), which finds the texel in one texture or in tiles
+    string fetch_file = player.tiled ? 
+        "shaders/fetch-tiled.frag" : "shaders/fetch-direct.frag";
+    
+    no_distort_files.push_back(fetch_file);
+    mono_equirect_files.push_back(fetch_file);
+    aa_mono_equirect_files.push_back(fetch_file);
+    equirect_to_cube_files.push_back(fetch_file);
+    stereo_equirect_files.push_back(fetch_file);
+    stereo_interleaved_files.push_back(fetch_file);
+    
+    string sample_file = decoder.polar_packing ? 
+        "shaders/sample-polar.frag" : "shaders/sample-direct.frag";
+    
+    mono_equirect_files.push_back(sample_file);
+    aa_mono_equirect_files.push_back(sample_file);
+    equirect_to_cube_files.push_back(sample_file);
+    stereo_equirect_files.push_back(sample_file);
+    stereo_interleaved_files.push_back(sample_file);
+    
+    // programs are compiled when a window first draws with one (see
+    // get_program), so only the modes actually used are ever built
+    set_shader_cache(player.shader_cache);
+        
+    player.programs.push_back(ProgramSpec(
+        &Window_::no_distort_program, no_distort_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::mono_equirect_program, mono_equirect_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::aa_mono_equirect_program, aa_mono_equirect_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::mip_mono_equirect_program, mip_mono_equirect_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::stereo_equirect_program, stereo_equirect_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::stereo_interleaved_program, stereo_interleaved_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::equirect_to_cube_program, equirect_to_cube_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::cube_mono_program, cube_mono_files));
+    player.programs.push_back(ProgramSpec(
+        &Window_::aa_cube_mono_program, aa_cube_mono_files));
         
-        player.windows[i]->no_distort_program = load_shaders(no_distort_files);
-        player.windows[i]->mono_equirect_program = load_shaders(mono_equirect_files);
-        player.windows[i]->aa_mono_equirect_program = load_shaders(aa_mono_equirect_files);
-        player.windows[i]->stereo_equirect_program = load_shaders(stereo_equirect_files);
-        player.windows[i]->stereo_interleaved_program = load_shaders(stereo_interleaved_files);
+    if(player.tiled)
+    {
+        for(size_t i = 0; i < player.windows.size(); i++)
+        {
+            player.windows[i]->make_current();
+            
+            // tiles live on texture unit 2 (see TileGrid::set_uniforms)
+            glActiveTexture(GL_TEXTURE2);
+            player.windows[i]->tiles.create(player.tile_grid);
+            glActiveTexture(GL_TEXTURE0);
+        }
+    }
+    
+    if(player.cubemap && 
+        (player.stereo || (server && player.type != NT_HEADLESS)))
+    {
+        cerr << "--cubemap only applies to mono output; ignoring it\n";
+        player.cubemap = false;
+    }
+    
+    // converting costs about as much as drawing a screen with the plain
+    // shader, which only 16 samples per pixel make worth saving on
+    if(player.cubemap && player.aa_mode != AA_SUPERSAMPLE)
+    {
+        cerr << "Warning: --cubemap only pays off with --aa supersample; "
+             << "it will cost more than it saves\n";
     }
     
+    // culling works out visible tiles from the equirect mapping, so
+    // anything that reads the frame some other way needs every tile
+    player.tile_culling = player.tiled && !player.cubemap && 
+        !decoder.polar_packing && !player.prewarped && 
+        player.projection == PROJECTION_EQUIRECT &&
+        !(server && player.type != NT_HEADLESS);
+    
     // select which shader to use
     // note use of pointer-to-member so we can access it on each window
     GLint Window_::* shader_program;
     
+    // anti-aliased mono shader; the 'K' message toggles between this
+    // and the plain mono shader
+    GLint Window_::* aa_shader_program;
+    GLint Window_::* plain_shader_program;
+    
+    if(player.cubemap)
+    {
+        // mip mode needs no shader of its own: the cube is mipmapped and
+        // has no seam to fix gradients across
+        plain_shader_program = &Window_::cube_mono_program;
+        
+        if(player.aa_mode == AA_SUPERSAMPLE)
+            aa_shader_program = &Window_::aa_cube_mono_program;
+        else
+            aa_shader_program = &Window_::cube_mono_program;
+    }
+    else
+    {
+        plain_shader_program = &Window_::mono_equirect_program;
+        
+        if(player.aa_mode == AA_MIPMAP)
+            aa_shader_program = &Window_::mip_mono_equirect_program;
+        else if(player.aa_mode == AA_SUPERSAMPLE)
+            aa_shader_program = &Window_::aa_mono_equirect_program;
+        else
+            aa_shader_program = &Window_::mono_equirect_program;
+    }
+    
     if(server && player.type != NT_HEADLESS)
         shader_program = &Window_::no_distort_program;
     else
@@ -175,7 +472,7 @@ int main(int argc, char* argv[])
                 shader_program = &Window_::stereo_equirect_program;
         }
         else
-            shader_program = &Window_::aa_mono_equirect_program;
+            shader_program = aa_shader_program;
     }
     
     if(player.stereo_type == STEREO_HALF_TOP || 
@@ -184,15 +481,36 @@ int main(int argc, char* argv[])
         shader_program = &Window_::stereo_equirect_program;
     }
     
+    if(player.governor.enabled)
+        player.stats.set_note("quality.mode", 
+            quality_mode_name(player.governor.mode));
+    
+    // pre-warped frames are copied to the screens as they are, so 'K' has
+    // nothing to switch between
+    if(player.prewarped)
+    {
+        shader_program = &Window_::no_distort_program;
+        aa_shader_program = shader_program;
+        plain_shader_program = shader_program;
+    }
+    
     
     float theta = 0.0;
     float phi = 0.0;
     
+    // view being drawn; a headless server's follows its input (theta,
+    // phi) at the frame the clients apply it (see CommandQueue)
+    float view_theta = 0.0;
+    float view_phi = 0.0;
+    
     for(size_t i = 0; i < player.windows.size(); i++)
     {
         //glfwMakeContextCurrent(player.windows[i]);
         player.windows[i]->make_current();
-        glUseProgram(player.windows[i]->*shader_program);
+        
+        // the starting program is built now rather than on the first frame
+        if(!player.cpu_render)
+            glUseProgram(get_program(player, i, shader_program));
         glEnable(GL_TEXTURE_2D);
         
         glGenTextures(1, &player.windows[i]->tex);
@@ -202,22 +520,105 @@ int main(int argc, char* argv[])
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT); // FIXME
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        
+        if(player.aa_mode == AA_MIPMAP && !player.cubemap)
+        {
+            // mipmaps are regenerated after every upload (see below)
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
+                GL_LINEAR_MIPMAP_LINEAR);
+            
+            if(GLEW_EXT_texture_filter_anisotropic)
+            {
+                GLfloat max_aniso = 1.0;
+                glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_aniso);
+                glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT,
+                    max_aniso);
+            }
+            else
+            {
+                cerr << "Warning: no anisotropic filtering support; "
+                     << "--aa mip will look blurry near the poles\n";
+            }
+        }
     
         glActiveTexture(GL_TEXTURE0);
         glBindTexture(GL_TEXTURE_2D, player.windows[i]->tex);
-        GLint video_texture_ = glGetUniformLocation(
-            player.windows[i]->*shader_program, 
-            "video_texture");
-        glUniform1i(video_texture_, 0);
+        
+        if(player.cubemap)
+        {
+            Window_* w = player.windows[i];
+            
+            // every window converts the same frame, so windows drawn one
+            // after another that share textures take the first one's cube
+            // instead of converting it again (with --render-threads each
+            // converts its own, at the same time as the others)
+            w->cube_owner = i;
+            
+            for(size_t j = 0; j < i && !player.render_threads; j++)
+            {
+                if(w->shares_objects_with(*player.windows[j]))
+                {
+                    w->cube_owner = j;
+                    break;
+                }
+            }
+            
+            // the cube lives on texture unit 1 so it never displaces the
+            // equirect texture it's made from
+            glActiveTexture(GL_TEXTURE1);
+            
+            if(w->cube_owner != (int)i)
+            {
+                w->cube_tex = player.windows[w->cube_owner]->cube_tex;
+                glBindTexture(GL_TEXTURE_CUBE_MAP, w->cube_tex);
+            }
+            else
+            {
+                glGenTextures(1, &w->cube_tex);
+                glBindTexture(GL_TEXTURE_CUBE_MAP, w->cube_tex);
+            
+                glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, 
+                    GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, 
+                    GL_CLAMP_TO_EDGE);
+                glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, 
+                    GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, 
+                    player.aa_mode == AA_MIPMAP ? 
+                        GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+                
+                if(player.aa_mode == AA_MIPMAP && 
+                    GLEW_EXT_texture_filter_anisotropic)
+                {
+                    GLfloat max_aniso = 1.0;
+                    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, 
+                        &max_aniso);
+                    glTexParameterf(GL_TEXTURE_CUBE_MAP, 
+                        GL_TEXTURE_MAX_ANISOTROPY_EXT, max_aniso);
+                }
+            }
+            
+            // filter across face edges instead of clamping at them
+            if(GLEW_ARB_seamless_cube_map)
+                glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+            
+            glActiveTexture(GL_TEXTURE0);
+            
+            if(w->cube_owner == (int)i)
+            {
+                glGenFramebuffers(1, &w->cube_fbo);
+            
+                get_program(player, i, &Window_::equirect_to_cube_program);
+            }
+        }
     }
     
-    int64_t last_server_seek = -AV_TIME_BASE;
-    
     bool decoded_all = false;
     
     double current_frame_end = -1;
     
     vector<Message> messages;
+    Message state_message; // (reused, so it's never reallocated)
     
     bool left_down = false;
     bool right_down = false;
@@ -240,17 +641,78 @@ int main(int argc, char* argv[])
     
     bool dump_frame_flag = false;
     
+    // needs the windows' contexts, so start it before they're handed over
+    // to render threads
+    if(player.upload_thread)
+        player.uploader.start(&player, player.upload_ring);
+    
+    // upload ring frame on screen (see retire_frame)
+    DecoderFrame displayed_frame;
+    
+    if(player.cpu_render)
+        player.cpu_renderer.start(player.cpu_threads);
+    
+    if(player.bench_frames > 0)
+    {
+        run_bench(player, shader_program);
+        quit = true;
+    }
+    
+    RenderThreads render_threads;
+    
+    if(player.render_threads)
+        render_threads.start(&player);
+    
+    RenderLoop render_loop;
+    
+    if(player.decoupled_render)
+        render_loop.start(&player, 
+            player.render_threads ? &render_threads : NULL);
+    
     int64_t last_frame_start = av_gettime_relative();
     int64_t current_frame_start = av_gettime_relative();
+    int64_t last_quality_report = 0;
+    
+    // what's on screen, to tell whether anything changed since
+    float drawn_theta = 0.0;
+    float drawn_phi = 0.0;
+    GLint Window_::* drawn_program = NULL;
+    
+    // av_gettime_relative() to sleep until before going around again, or
+    // 0 to go straight on (see the end of the loop)
+    int64_t wake_at = 0;
+    
+    // the clock starts once every node is ready to play (see ReadyBarrier)
+    if(server && player.ready.enabled)
+    {
+        if(player.config_path.size())
+        {
+            vector<string> hosts = list_config_hosts(player.config_path);
+            player.ready.members.insert(hosts.begin(), hosts.end());
+        }
+        
+        player.ready.begin(player.hostname, READY_START_TIMEOUT);
+        player.ready.on_hold(player.ready.last_round);
+    }
+    
     while(!quit)
     {
+        if(wake_at)
+        {
+            int64_t wait = wake_at - av_gettime_relative();
+            if(wait > 0)
+                player.wakeup.wait(wait);
+            
+            wake_at = 0;
+        }
+        
         last_frame_start = current_frame_start;
         current_frame_start = av_gettime_relative();
         
         double dt = current_frame_start - last_frame_start;
         dt /= AV_TIME_BASE;
         
-        bool send_pos = false;
+        player.stats.print_if_due();
         
         glfwPollEvents();
         
@@ -280,7 +742,7 @@ int main(int argc, char* argv[])
                         Message k;
                         k.write_char('K');
                          
-                        server->send(k);
+                        player.schedule_command(k);
                     }
                 }
                 
@@ -299,19 +761,11 @@ int main(int argc, char* argv[])
                 if(js_curr.button_start && !js_prev.button_start)
                 {
                     cout << "pause pressed\n";
-                    player.paused = !player.paused;
-                    #ifndef NO_AUDIO
-                    player.audio.lock();
-                        player.audio.paused = player.paused;
-                    player.audio.unlock();
-                    #endif
                     
-                    if(server)
-                    {
-                        Message x;
-                        x.write_char('X');
-                        server->send(x);
-                    }
+                    // pauses here too when it's due (see the 'X' handler)
+                    Message x;
+                    x.write_char('X');
+                    player.schedule_command(x);
                 }
                 
                 // this debug tool helps to discover button numbers
@@ -322,8 +776,6 @@ int main(int argc, char* argv[])
 //                            cout << "Button " << i << " pressed\n";
 //                    }
             }
-         
-            send_pos = true;
              
             if(js_curr.valid)
             {
@@ -378,18 +830,21 @@ int main(int argc, char* argv[])
         {
             if(!space_down)
             {
-                player.paused = !player.paused;
-                #ifndef NO_AUDIO
-                player.audio.lock();
-                    player.audio.paused = player.paused;
-                player.audio.unlock();
-                #endif
-                
                 if(server)
                 {
+                    // pauses here too when it's due (see the 'X' handler)
                     Message x;
                     x.write_char('X');
-                    server->send(x);
+                    player.schedule_command(x);
+                }
+                else
+                {
+                    player.paused = !player.paused;
+                    #ifndef NO_AUDIO
+                    player.audio.lock();
+                        player.audio.paused = player.paused;
+                    player.audio.unlock();
+                    #endif
                 }
             }
             
@@ -414,7 +869,6 @@ int main(int argc, char* argv[])
                 else
                 {
                     theta += TURN / 25;
-                    send_pos = true;
                 }
             }
             
@@ -441,7 +895,6 @@ int main(int argc, char* argv[])
                 else
                 {
                     theta -= TURN / 25;
-                    send_pos = true;
                 }
             }
             
@@ -455,7 +908,6 @@ int main(int argc, char* argv[])
             if(!up_down)
             {
                 phi += (TURN/4) / 10.0;
-                send_pos = true;
             }
             
             up_down = true;
@@ -468,7 +920,6 @@ int main(int argc, char* argv[])
             if(!down_down)
             {
                 phi -= (TURN/4) / 10.0;
-                send_pos = true;
             }
             
             down_down = true;
@@ -488,16 +939,6 @@ int main(int argc, char* argv[])
             phi = -TURN/4;
 
         
-        if(send_pos && player.server)
-        {
-            Message turn;
-            turn.write_byte('T');
-            turn.write_float(phi);
-            turn.write_float(theta);
-            
-            server->send(turn);
-        }
-        
         player.audio.lock();
         player.audio.direction = fmod(theta, TURN);
         player.audio.unlock();
@@ -507,13 +948,21 @@ int main(int argc, char* argv[])
         //    player.audio.direction / TURN,
         //    qb.A, qb.B, qb.fraction_a, qb.fraction_b);
         
-        decoder.lock();
-        decoded_all = decoder.decoded_all_flag;
-        decoder.unlock();
+        if(player.upload_thread)
+        {
+            decoded_all = player.uploader.drained();
+        }
+        else
+        {
+            decoder.lock();
+            decoded_all = decoder.decoded_all_flag;
+            decoder.unlock();
+        }
         
         int64_t now_prev = now;
+        int64_t now_wall = av_gettime_relative(); // when now was read
         
-        if(!player.paused)
+        if(!player.paused && !player.ready.holding)
         {
             #ifndef NO_AUDIO
             if(player.audio.setup_state == AuSS_PLAYING)
@@ -528,10 +977,10 @@ int main(int argc, char* argv[])
             }
             else
             {
-                now = av_gettime_relative() - start;
+                now = now_wall - start;
             }
             #else
-            now = av_gettime_relative() - start;
+            now = now_wall - start;
             #endif
         }
         
@@ -544,19 +993,109 @@ int main(int argc, char* argv[])
         
         double now_f = now / 1000000.0;
 
-        // send a server time sync every 1/10th of a second
-        if(server && abs(now-last_server_seek) > AV_TIME_BASE/10)
+        // frames are picked for when they'll actually be on screen: the
+        // next vblank, up to a refresh interval from now. Playing the
+        // frame whose interval holds that time, rather than the first one
+        // not yet due, spreads 24/30 fps pulldown evenly at 60 Hz, and the
+        // same way on every node.
+        int64_t lead = 0;
+        if(!player.paused && !player.ready.holding)
         {
-            //cout << "Sync\n";
-            Message seek;
-            seek.write_char('N');
-            seek.write_int64(now);
-            server->send(seek);
-            last_server_seek = now;
+            int64_t wall = av_gettime_relative();
+            lead = player.vblank.predict(wall) - wall;
+        }
+        
+        double present_f = (now + lead) / 1000000.0;
+        
+        // the server's time and view, whenever either has moved on (see
+        // StateSync)
+        StateSnapshot current;
+        if(server)
+        {
+            current.now = now;
+            current.wall = now_wall;
+            current.frame = (int64_t)(current_frame_end * AV_TIME_BASE);
+            current.seeks = player.state.seeks;
+            current.theta = theta;
+            current.phi = phi;
+            current.paused = player.paused;
+            current.holding = player.ready.holding;
+            
+            if(player.state.due(current))
+            {
+                StateSnapshot snapshot = current;
+                player.state.sent(snapshot);
+                snapshot.write(state_message);
+                server->send_sync(state_message);
+                
+                // turns here at the frame the clients do
+                player.state.schedule_view(now_wall + COMMAND_LEAD, theta,
+                    phi);
+            }
         }
         
         // FIXME: factor out message parsing. Handle client/server separately?
         nt->get_messages(messages);
+        
+        // commands sent ahead ('A') wait for the frame they're for, and
+        // are handled with everything else once it's being picked
+        player.commands.take(messages, player.clock_sync);
+        player.commands.pop_due(now_wall + lead, messages);
+        
+        StateSnapshot snapshot;
+        if(!server && player.state.take(messages, snapshot))
+        {
+            int64_t pending;
+            bool resync;
+            bool in_step = player.state.in_step(snapshot, player.paused,
+                player.commands.next(pending), now_wall, resync);
+            
+            // missed a pause (or joined during one)
+            if(resync && snapshot.paused != player.paused)
+            {
+                cerr << "Out of step with the server; "
+                     << (snapshot.paused ? "pausing" : "playing") << '\n';
+                
+                player.paused = snapshot.paused;
+                #ifndef NO_AUDIO
+                player.audio.lock();
+                    player.audio.paused = player.paused;
+                player.audio.unlock();
+                #endif
+            }
+            
+            // time from across a seek or pause that hasn't happened here
+            // yet would be wrong; while held, the clock stays where the
+            // seek landed here, which is where it lands on the server too
+            if(in_step && !player.ready.holding && !snapshot.holding)
+            {
+                // with synced clocks, count from when the server read its
+                // time rather than from when it got here
+                int64_t local;
+                if(player.clock_sync.to_local(snapshot.wall, local))
+                    start = local - snapshot.now;
+                else
+                    start = av_gettime_relative() - snapshot.now;
+                
+                now = snapshot.now;
+                
+                if(current_frame_end >= 0)
+                {
+                    player.stats.set("state.frame_skew_ms",
+                        (current_frame_end * AV_TIME_BASE - snapshot.frame)
+                            / 1000.0);
+                }
+            }
+            
+            int64_t at;
+            if(player.clock_sync.to_local(snapshot.wall, at))
+                at += COMMAND_LEAD;
+            else
+                at = av_gettime_relative() + COMMAND_LEAD;
+            
+            player.state.schedule_view(at, snapshot.theta, snapshot.phi);
+        }
+        
         for(size_t i = 0; i < messages.size(); i++)
         {
             try
@@ -584,8 +1123,39 @@ int main(int argc, char* argv[])
                     seek.write_char('S');
                     seek.write_int64(now);
                     
-                    m.reply(path);
-                    m.reply(seek);
+                    server->send_to(m, path);
+                    server->send_to(m, seek);
+                    
+                    // and whether it's paused, which nothing else would
+                    // tell it until the next change
+                    // (numbered, but not taken as the last one broadcast)
+                    Message state;
+                    StateSnapshot snapshot = current;
+                    snapshot.seq = player.state.next_seq++;
+                    snapshot.write(state);
+                    server->send_to(m, state);
+                    
+                    // new nodes join in the current mode, and start
+                    // reporting their frame times
+                    if(player.governor.enabled)
+                    {
+                        Message quality;
+                        quality.write_char('Q');
+                        quality.write_int32(player.governor.mode);
+                        
+                        server->send_to(m, quality);
+                    }
+                    
+                    // and hold with everyone else if a round is on
+                    if(player.ready.waiting)
+                    {
+                        Message hold;
+                        hold.write_char('H');
+                        hold.write_int32(player.ready.last_round);
+                        hold.write_int32(player.ready.frames);
+                        
+                        server->send_to(m, hold);
+                    }
                     
 //                    cout << "Now: " << now << '\n';
 //                    unsigned char* ptr = (unsigned char*)& now;
@@ -604,6 +1174,11 @@ int main(int argc, char* argv[])
                     case 'X':
                     {
                         player.paused = !player.paused;
+                        #ifndef NO_AUDIO
+                        player.audio.lock();
+                            player.audio.paused = player.paused;
+                        player.audio.unlock();
+                        #endif
                     }
                     break;
                     
@@ -618,46 +1193,101 @@ int main(int argc, char* argv[])
                     {
                         int64_t value = m.read_int64();
                         //decoder.seek(value);
-                        player.seek(value);
+                        player.seek_now(value);
+                        player.state.seeks++;
                     }
                     break;
                     
-                    case 'T':
+                    case 'K':
                     {
-                        phi = m.read_float();
-                        theta = m.read_float();
-                        //cout << "T";
+                        // the governor has the final say with --auto-quality
+                        if((server && player.type != NT_HEADLESS) ||
+                            player.governor.enabled)
+                        {
+                            break;
+                        }
+                        
+                        // picked up by render_window() on the next draw
+                        if(shader_program == plain_shader_program)
+                            shader_program = aa_shader_program;
+                        else
+                            shader_program = plain_shader_program;
                     }
                     break;
                     
-                    // seek with just 'now' value
-                    case 'N':
+                    // frame time of a node (see QualityGovernor)
+                    case 'R':
                     {
-                        int64_t server_now = m.read_int64();
-                        start = av_gettime_relative() - server_now;
-                        now = server_now;
+                        string host = m.read_string();
+                        int mode = m.read_int32();
+                        double ms = m.read_double();
+                        
+                        if(server && mode >= 0 && mode < QUALITY_MODES)
+                            player.governor.on_report(host, mode, ms);
                     }
                     break;
                     
-                    case 'K':
+                    // quality mode to draw in from this frame
+                    case 'Q':
                     {
-                        if(server)
+                        int mode = m.read_int32();
+                        
+                        if(mode < 0 || mode >= QUALITY_MODES)
                             break;
                         
-                        if(shader_program == &Window_::mono_equirect_program)
-                            shader_program = &Window_::aa_mono_equirect_program;
-                        else
-                            shader_program = &Window_::mono_equirect_program;
+                        player.governor.enabled = true;
+                        player.governor.set_mode(mode);
                         
-                        for(size_t i = 0; i < player.windows.size(); i++)
+                        // stereo and the server's own window have just
+                        // the one
+                        if(shader_program == plain_shader_program ||
+                            shader_program == aa_shader_program)
                         {
-                            //glfwMakeContextCurrent(player.windows[i]);
-                            player.windows[i]->make_current();
-                            glUseProgram(player.windows[i]->*shader_program);
-                            glEnable(GL_TEXTURE_2D);
+                            if(mode == QUALITY_AA)
+                                shader_program = aa_shader_program;
+                            else
+                                shader_program = plain_shader_program;
                         }
-                        //glfwMakeContextCurrent(player.windows[0]);
-                        player.windows[0]->make_current();
+                        
+                        cout << "Quality: drawing with " 
+                             << quality_mode_name(mode) << '\n';
+                        player.stats.set_note("quality.mode",
+                            quality_mode_name(mode));
+                    }
+                    break;
+                    
+                    // hold the clock until everyone's ready (ReadyBarrier)
+                    case 'H':
+                    {
+                        int round = m.read_int32();
+                        player.ready.frames = m.read_int32();
+                        player.ready.on_hold(round);
+                    }
+                    break;
+                    
+                    // a node is ready
+                    case 'Y':
+                    {
+                        int round = m.read_int32();
+                        string host = m.read_string();
+                        
+                        if(server)
+                            player.ready.on_ready(host, round);
+                    }
+                    break;
+                    
+                    // go on from where the clock was held
+                    case 'G':
+                    {
+                        int round = m.read_int32();
+                        
+                        if(!player.ready.holding)
+                            break;
+                        
+                        player.ready.on_release(round);
+                        
+                        if(!player.ready.holding)
+                            start = now_wall - now;
                     }
                     break;
                     
@@ -674,9 +1304,151 @@ int main(int argc, char* argv[])
             }
         } // for each message
         
+        // ready once the frames from where the clock is held are decoded
+        if(player.ready.holding && !player.ready.reported && !seek_flag)
+        {
+            bool ready = true;
+            
+            if(!(player.use_multicast && player.type == NT_CLIENT))
+            {
+                // frames the upload thread has taken count too. It's asked
+                // first so that a frame moving over in between is missed
+                // (ready a loop later) rather than counted twice.
+                size_t frames = 0;
+                if(player.upload_thread)
+                    frames = player.uploader.frames_waiting();
+                
+                decoder.lock();
+                frames += decoder.showable_frames.size();
+                ready = decoder.decoded_all_flag ||
+                    frames >= (size_t)player.ready.frames;
+                decoder.unlock();
+            }
+            
+            if(ready)
+            {
+                player.ready.reported = true;
+                
+                if(server)
+                    player.ready.on_ready(player.hostname, player.ready.round);
+                else
+                {
+                    Message y;
+                    y.write_char('Y');
+                    y.write_int32(player.ready.round);
+                    y.write_string(player.hostname);
+                    client->send(y.bytes);
+                }
+            }
+        }
+        
+        vector<string> stragglers;
+        if(server && player.ready.complete(stragglers))
+        {
+            double waited = (av_gettime_relative() - player.ready.started)
+                / 1000.0;
+            
+            string names;
+            for(size_t i = 0; i < stragglers.size(); i++)
+                names += (i ? ", " : "") + stragglers[i];
+            
+            if(stragglers.size())
+            {
+                cerr << "Not every node was ready after " << waited
+                     << " ms; going on without: " << names << '\n';
+            }
+            
+            player.stats.set("ready.wait_ms", waited);
+            player.stats.set_note("ready.stragglers", names);
+            
+            Message go;
+            go.write_char('G');
+            go.write_int32(player.ready.last_round);
+            player.schedule_command(go);
+        }
+        
+        // view changes due by the frame being picked
+        float due_theta, due_phi;
+        if(player.state.pop_view(now_wall + lead, due_theta, due_phi))
+        {
+            // the server's own input comes back at the frame the clients
+            // turn on
+            if(server)
+            {
+                view_theta = due_theta;
+                view_phi = due_phi;
+            }
+            else
+            {
+                theta = due_theta;
+                phi = due_phi;
+            }
+        }
+        
+        // a preview turns straight away
+        if(!(server && player.type == NT_HEADLESS))
+        {
+            view_theta = theta;
+            view_phi = phi;
+        }
+        
+        if(player.governor.enabled)
+        {
+            int64_t wall = av_gettime_relative();
+            int mode;
+            double ms;
+            
+            // every node that draws the sphere tells the server how it's
+            // doing twice a second
+            if(wall - last_quality_report > AV_TIME_BASE/2 &&
+                player.governor.measurement(mode, ms))
+            {
+                if(client)
+                {
+                    Message report;
+                    report.write_char('R');
+                    report.write_string(player.hostname);
+                    report.write_int32(mode);
+                    report.write_double(ms);
+                    client->send(report.bytes);
+                }
+                else if(player.type == NT_HEADLESS)
+                    player.governor.on_report(player.hostname, mode, ms);
+                
+                last_quality_report = wall;
+            }
+            
+            if(server)
+            {
+                mode = player.governor.decide();
+                
+                if(mode >= 0)
+                {
+                    cout << "Quality: " << quality_mode_name(mode) 
+                         << ": " << player.governor.reason << '\n';
+                    player.stats.set_note("quality.reason",
+                        player.governor.reason);
+                    
+                    // every node, this one too, switches on the same frame
+                    Message quality;
+                    quality.write_char('Q');
+                    quality.write_int32(mode);
+                    player.schedule_command(quality);
+                    
+                    player.governor.schedule(mode);
+                }
+            }
+        }
+        
         DecoderFrame show_frame;
         DecoderFrame show_frame_prev;
         
+        RenderFrame rf;
+        rf.theta = view_theta;
+        rf.phi = view_phi;
+        rf.now = now;
+        rf.shader_program = shader_program;
+        
 //        if(seek_flag)
 //        {
 //            cout << "Seek flag!\n";
@@ -693,11 +1465,11 @@ int main(int argc, char* argv[])
 //        }
         
     if(!(player.type == NT_CLIENT && player.use_multicast)) {
-        while(seek_flag || now_f > current_frame_end)
+        while(seek_flag || present_f >= current_frame_end)
         //while(now_f > current_frame_end)
         {
             show_frame_prev = show_frame;
-            show_frame = decoder.get_frame();
+            show_frame = player.get_frame();
             
             // adjust time if we're seeking and got a seek frame
             if(show_frame.frame && show_frame.seek_result)
@@ -713,12 +1485,14 @@ int main(int argc, char* argv[])
                 
                 seek_flag = false;
                 cout << "SEEK DETECTED, NEW NOW: " << now << '\n';
+                
+                present_f = (now + lead) / 1000000.0;
             }
             
             if(show_frame.frame && show_frame_prev.frame)
             {
-                decoder.return_frame(show_frame_prev);
-                show_frame_prev.frame = NULL;
+                player.return_frame(show_frame_prev);
+                show_frame_prev = DecoderFrame();
             }
             
             if(!show_frame.frame && decoded_all)
@@ -730,7 +1504,10 @@ int main(int argc, char* argv[])
                 break;
             }
             
-            current_frame_end = show_frame.frame->pts;
+            // shown until the next one starts (or until its own start,
+            // if the container doesn't say how long frames last)
+            current_frame_end = show_frame.frame->pts + 
+                show_frame.frame->pkt_duration;
             current_frame_end /= decoder.time_base.den;
             current_frame_end *= decoder.time_base.num;
             
@@ -750,8 +1527,8 @@ int main(int argc, char* argv[])
             // lagged frame is ready, but current data not available
             // show it anyway as current frame (better late than nothing)
             //cout << "lagged\n";
-            show_frame.frame = show_frame_prev.frame;
-            show_frame_prev.frame = NULL;
+            show_frame = show_frame_prev;
+            show_frame_prev = DecoderFrame();
         }
         
         //printf("Frame end: %f, NOW: %f\n", current_frame_end, now_f);
@@ -776,31 +1553,32 @@ int main(int argc, char* argv[])
         
     } // only update decoder if not client multicast
     
-        //glfwMakeContextCurrent(player.windows[0]);
-        //player.windows[0]->make_current();
-        
         if(player.use_multicast && player.type == NT_CLIENT)
         {
             // clients running multicast should load frame from mc_client
+            // (the render thread does this itself with --decoupled-render)
+            if(player.decoupled_render)
+                goto REDRAW;
+            
             player.mc_client.player_poll();
             
-            for(size_t i = 0; i < player.windows.size(); i++)
-            {
-                player.windows[i]->make_current();
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-                    player.mc_client.width, player.mc_client.height,
-                    0, GL_RGB, GL_UNSIGNED_BYTE, &player.mc_client.buffer[0][0]);
-            }
+            rf.pixels = &player.mc_client.buffer[0][0];
+            rf.width = player.mc_client.width;
+            rf.height = player.mc_client.height;
         }
         else
         {
-            for(size_t i = 0; i < player.windows.size(); i++)
-            {
-                player.windows[i]->make_current();
-                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-                    decoder.codec_context->width, decoder.codec_context->height,
-                    0, GL_RGB, GL_UNSIGNED_BYTE, show_frame.frame->data[0]);
-            }
+            // frames from the upload thread are on the GPU already
+            if(show_frame.slot < 0)
+                rf.pixels = show_frame.frame->data[0];
+            
+            rf.width = decoder.codec_context->width;
+            rf.height = decoder.codec_context->height;
+            
+            // only the packed rows hold anything
+            if(decoder.polar_packing)
+                rf.height = player.polar.packed_height;
+            rf.frame = show_frame;
         }
         
         if(player.use_multicast && player.type == NT_SERVER)
@@ -814,8 +1592,6 @@ int main(int argc, char* argv[])
         }
         
         
-        //glGenerateMipmap(GL_TEXTURE_2D);
-        
         if(dump_frame_flag)
         {
             SaveFrame(show_frame.frame, 
@@ -826,159 +1602,114 @@ int main(int argc, char* argv[])
             dump_frame_flag = false;
         }
         
-        decoder.return_frame(show_frame);
-        
-REDRAW:        
-        for(size_t i = 0; i < player.windows.size(); i++)
+REDRAW:
+        if(!rf.pixels && !rf.frame.frame && rf.theta == drawn_theta &&
+            rf.phi == drawn_phi && rf.shader_program == drawn_program &&
+            !player.redraw_requested &&
+            !(player.use_multicast && player.type == NT_CLIENT))
         {
-            //glfwMakeContextCurrent(player.windows[i]);
-            player.windows[i]->make_current();
-            GLuint sp = player.windows[i]->*shader_program;
-            
-            GLint theta_ = glGetUniformLocation(sp, "theta");
-            GLint phi_   = glGetUniformLocation(sp, "phi");
-            GLint pos = glGetAttribLocation(sp, "pos_in");
-            
-            GLint roll_    = glGetUniformLocation(sp, "roll");
-            GLint pitch_   = glGetUniformLocation(sp, "pitch");
-            GLint heading_ = glGetUniformLocation(sp, "heading");
-            GLint originX_ = glGetUniformLocation(sp, "originX");
-            GLint originY_ = glGetUniformLocation(sp, "originY");
-            GLint originZ_ = glGetUniformLocation(sp, "originZ");
-            GLint width_   = glGetUniformLocation(sp, "width");
-            GLint height_  = glGetUniformLocation(sp, "height");
-            
-            // for 'pos', using convention where x goes to the right, y goes in,
-            // and z goes up.
-            glUniform1f(theta_, theta);
-            glUniform1f(phi_, phi);
-            
-            glUniform1f(roll_, player.screen_config[i].roll);
-            glUniform1f(pitch_, player.screen_config[i].pitch);
-            glUniform1f(heading_, player.screen_config[i].heading);
-            glUniform1f(originX_, player.screen_config[i].originX);
-            glUniform1f(originY_, player.screen_config[i].originY);
-            glUniform1f(originZ_, player.screen_config[i].originZ);
-            glUniform1f(width_, player.screen_config[i].width);
-            glUniform1f(height_, player.screen_config[i].height);
+            // nothing new to show: sleep until the next frame is due, or
+            // a message or input arrives, rather than drawing the same
+            // thing again. Multicast frames come with no deadline, so
+            // multicast clients keep drawing every time around.
+            int64_t wait = AV_TIME_BASE/4;
             
-            if(player.stereo_type == STEREO_TOP_BOTTOM_INTERLEAVED)
+            if(!player.paused)
             {
-                // top/bottom stereo
-                GLint stereo_  = 
-                    glGetUniformLocation(sp, "stereo_half");
-                    
-                glUniform1f(stereo_, 1.0);
-                glBegin(GL_QUADS);
-                    glVertexAttrib3f(pos, -1, 1, 0);
-                    glVertex2f(-1, 1);
-                    glVertexAttrib3f(pos, -1, -1, 0);
-                    glVertex2f(-1, -1);
-                    glVertexAttrib3f(pos, 1, -1, 0);
-                    glVertex2f(1,-1);
-                    glVertexAttrib3f(pos, 1, 1, 0);
-                    glVertex2f(1,1);
-                glEnd();
-                    
-                glUniform1f(stereo_, 0.0);
-                glBegin(GL_QUADS);
-                    glVertexAttrib3f(pos, -1, 1, 0);
-                    glVertex2f(-1, 1);
-                    glVertexAttrib3f(pos, -1, -1, 0);
-                    glVertex2f(-1, -1);
-                    glVertexAttrib3f(pos, 1, -1, 0);
-                    glVertex2f(1,-1);
-                    glVertexAttrib3f(pos, 1, 1, 0);
-                    glVertex2f(1,1);
-                glEnd();
-            }
-            else if(server || !player.stereo)
-            {
-                if(player.stereo_type == STEREO_HALF_TOP)
-                {
-                    GLint stereo_  = 
-                        glGetUniformLocation(sp, "stereo_half");
-                    
-                    glUniform1f(stereo_, 1.0);
-                }
-                else if(player.stereo_type == STEREO_HALF_BOTTOM)
-                {
-                    GLint stereo_  = 
-                        glGetUniformLocation(sp, "stereo_half");
-                        
-                    glUniform1f(stereo_, 0.0);                
-                }
+                // the frame after this one was due already but isn't
+                // decoded yet, so check back shortly
+                int64_t due = (int64_t)(current_frame_end * AV_TIME_BASE);
+                int64_t present = now + lead;
+                
+                if(seek_flag || due <= present)
+                    wait = 2000;
+                else if(due - present < wait)
+                    wait = due - present;
+            }
+                
+            // snapshots to the clients, paused or not
+            int64_t sync = player.state.last_sent_wall + STATE_INTERVAL -
+                av_gettime_relative();
+            if(server && sync < wait)
+                wait = sync > 0 ? sync : 0;
             
-                glBegin(GL_QUADS);
-                    // top left
-                    //glVertexAttrib3f(pos, -11, 2*1.5, 6);
-                    glVertexAttrib3f(pos, -1, 1, 0);
-                    glTexCoord2f(0, 0); // only used by server
-                    glVertex2f(-1, 1);
-                    
-                    // bottom left
-                    //glVertexAttrib3f(pos, -11, 2*1.5, -6);
-                    glVertexAttrib3f(pos, -1, -1, 0);
-                    glTexCoord2f(0, 1);
-                    glVertex2f(-1, -1);
-
-                    // bottom right
-                    //glVertexAttrib3f(pos, 11, 2*1.5, -6);
-                    glVertexAttrib3f(pos, 1, -1, 0);
-                    glTexCoord2f(1,1);
-                    glVertex2f(1,-1);
-                    
-                    // top right
-                    //glVertexAttrib3f(pos, 11, 2*1.5, 6);
-                    glVertexAttrib3f(pos, 1, 1, 0);
-                    glTexCoord2f(1, 0);
-                    glVertex2f(1,1);            
-                glEnd();
+            // still decoding to be ready
+            if(player.ready.holding && wait > 10000)
+                wait = 10000;
+            
+            // commands and view changes waiting for their frame
+            int64_t at;
+            if(player.commands.next(at))
+            {
+                int64_t until = at - lead - av_gettime_relative();
+                if(until < wait)
+                    wait = until > 0 ? until : 0;
             }
-            else
+            
+            if(player.state.next_view(at))
             {
-                // top/bottom stereo
-                GLint stereo_  = 
-                    glGetUniformLocation(sp, "stereo_half");
-                    
-                glUniform1f(stereo_, 1.0);
-                glBegin(GL_QUADS);
-                    glVertexAttrib3f(pos, -1, 1, 0);
-                    glVertex2f(-1, 1);
-                    glVertexAttrib3f(pos, -1, -1, 0);
-                    glVertex2f(-1, 0);
-                    glVertexAttrib3f(pos, 1, -1, 0);
-                    glVertex2f(1,0);
-                    glVertexAttrib3f(pos, 1, 1, 0);
-                    glVertex2f(1,1);
-                glEnd();
-                    
-                glUniform1f(stereo_, 0.0);
-                glBegin(GL_QUADS);
-                    glVertexAttrib3f(pos, -1, 1, 0);
-                    glVertex2f(-1, 0);
-                    glVertexAttrib3f(pos, -1, -1, 0);
-                    glVertex2f(-1, -1);
-                    glVertexAttrib3f(pos, 1, -1, 0);
-                    glVertex2f(1,-1);
-                    glVertexAttrib3f(pos, 1, 1, 0);
-                    glVertex2f(1,0);
-                glEnd();
-            }            
-        }
-        
-        // swap all together after drawing
-        for(size_t i = 0; i < player.windows.size(); i++)
+                int64_t until = at - lead - av_gettime_relative();
+                if(until < wait)
+                    wait = until > 0 ? until : 0;
+            }
+            
+            // joystick state is only ever polled
+            if(js_curr.valid && wait > 16000)
+                wait = 16000;
+            
+            if(player.stats.enabled && wait > player.stats.interval)
+                wait = player.stats.interval;
+            
+            wake_at = av_gettime_relative() + wait;
+            continue;
+        }
+        
+        drawn_theta = rf.theta;
+        drawn_phi = rf.phi;
+        drawn_program = rf.shader_program;
+        player.redraw_requested = false;
+        
+        if(player.decoupled_render)
         {
-            player.windows[i]->swap_buffers();
+            // the render thread returns the frame once it's drawn.
+            // Wait a little for it to be taken so that we go around about
+            // once per display frame, but not so long that network
+            // messages pile up behind a swap.
+            render_loop.publish(rf);
+            render_loop.wait_taken(4000);
+            continue;
         }
+        
+        if(player.render_threads)
+            render_threads.render(rf);
+        else
+            render_all_windows(player, rf);
+        
+        // the frame has been drawn by every window by now
+        retire_frame(player, displayed_frame, show_frame);
     }
     
 end_of_video:
     cout << "end of video detected\n";
+    render_loop.stop();
+    render_threads.stop();
+    
+    if(displayed_frame.frame)
+        player.return_frame(displayed_frame);
+    
+    player.uploader.stop();
+    player.cpu_renderer.stop();
+    player.swap_barrier.stop();
+    player.clock_sync.stop();
     decoder.set_quit();
     decoder.join();
     
+    if(server)
+    {
+        server->set_quit();
+        server->join();
+    }
+    
     if(server)
         joystick.shutdown();
     
@@ -2,9 +2,151 @@
 using namespace std;
 
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+// epoll tags for the server's own descriptors (connections are tagged
+// with their slot)
+#define EVENT_LISTEN SERVER_MAX_CONNECTIONS
+#define EVENT_QUIT   (SERVER_MAX_CONNECTIONS + 1)
+#define EVENT_SEND   (SERVER_MAX_CONNECTIONS + 2)
+
+// most messages written per system call
+#define SERVER_IOV_MAX 64
 
 NetworkThread::~NetworkThread() {}
 
+bool Connection::receive()
+{
+    bool open = true;
+    
+    while(true)
+    {
+        make_room();
+        
+        ssize_t size = recv(
+            fd, 
+            &in[in_end], 
+            in.size() - in_end, 
+            MSG_DONTWAIT);
+        
+        if(size > 0)
+        {
+            in_end += size;
+            parse();
+            continue;
+        }
+        
+        if(size < 0 && errno == EINTR)
+            continue;
+        
+        // everything has been read
+        if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        
+        if(size < 0)
+            perror("recv");
+        
+        open = false;
+        break;
+    }
+    
+    // (whatever came before a hang up still counts)
+    deliver();
+    
+    return open;
+}
+
+void Connection::make_room()
+{
+    if(in.empty())
+        in.resize(CONNECTION_RECV_SIZE);
+    
+    if(in.size() - in_end >= CONNECTION_RECV_MIN)
+        return;
+    
+    // the start of the next message goes to the front
+    if(in_start > 0)
+    {
+        memmove(&in[0], &in[in_start], in_end - in_start);
+        in_end -= in_start;
+        in_start = 0;
+    }
+    
+    // (still no room: it's one big message)
+    if(in.size() - in_end < CONNECTION_RECV_MIN)
+        in.resize(in.size() * 2);
+}
+
+void Connection::parse()
+{
+    while(in_end - in_start >= sizeof(uint32_t))
+    {
+        uint32_t length;
+        memcpy(&length, &in[in_start], sizeof(length));
+        length = ntohl(length);
+        
+        if(in_end - in_start - sizeof(length) < length)
+            break; // not all here yet
+        
+        const unsigned char* payload = &in[in_start + sizeof(length)];
+        
+        ready.push_back(Message());
+        Message& m = ready.back();
+        m.fd = fd;
+        
+        if(spare.size())
+        {
+            m.bytes.swap(spare.back());
+            spare.pop_back();
+        }
+        
+        m.bytes.assign(payload, payload + length);
+        
+        in_start += sizeof(length) + length;
+    }
+    
+    if(in_start == in_end)
+    {
+        in_start = 0;
+        in_end = 0;
+        
+        // back down to size after a big message
+        if(in.size() > CONNECTION_RECV_SIZE)
+            std::vector<unsigned char>(CONNECTION_RECV_SIZE).swap(in);
+    }
+}
+
+void Connection::deliver()
+{
+    if(ready.empty())
+        return;
+    
+    pthread_mutex_lock(msg_mutex);
+    
+    for(size_t i = 0; i < ready.size(); i++)
+    {
+        msg_queue->push_back(Message());
+        msg_queue->back().fd = fd;
+        msg_queue->back().bytes.swap(ready[i].bytes);
+    }
+    
+    // buffers for the next ones, from those the main thread is done with
+    while(spare.size() < CONNECTION_SPARE_MAX && pool->size())
+    {
+        spare.push_back(std::vector<unsigned char>());
+        spare.back().swap(pool->back());
+        pool->pop_back();
+    }
+    
+    pthread_mutex_unlock(msg_mutex);
+    
+    ready.clear();
+}
+
 static void* network_thread_main(void* arg)
 {
     NetworkThread* nt = (NetworkThread*)arg;
@@ -50,118 +192,451 @@ void Server::start_thread()
         close(EXIT_FAILURE);
     }
     
-    pollfd listen_pfd;
-    memset(&listen_pfd, 0, sizeof(listen_pfd));
-    listen_pfd.fd = listen_sock_fd;
-    listen_pfd.events = POLLIN;
+    // edge-triggered, so every connection waiting is accepted each time
+    fcntl(listen_sock_fd, F_SETFL, 
+        fcntl(listen_sock_fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    listen_fd = listen_sock_fd;
+    
+    quit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    send_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    
+    if(quit_fd < 0 || send_fd < 0 || epoll_fd < 0)
+    {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u32 = EVENT_LISTEN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_QUIT;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, quit_fd, &ev);
+    
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_SEND;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, send_fd, &ev);
+    
+    // the whole table up front, so slots never move
+    conns.resize(SERVER_MAX_CONNECTIONS);
+    live_index.resize(SERVER_MAX_CONNECTIONS, -1);
     
-    pollfds.push_back(listen_pfd);
-    conns.push_back(Connection(listen_sock_fd)); // placeholder
+    for(int i = SERVER_MAX_CONNECTIONS-1; i >= 0; i--)
+        free_slots.push_back(i);
     
     // ----------------------------------------
     
     pthread_create(&thread, NULL, network_thread_main, this);
 }
 
-void Server::loop()
+void Server::set_quit()
 {
-    while(true)
+    NetworkThread::set_quit();
+    
+    uint64_t one = 1;
+    ssize_t unused = write(quit_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+void Server::join()
+{
+    NetworkThread::join();
+    
+    // (the clients were closed by loop() on its way out)
+    int* fds[] = {&listen_fd, &epoll_fd, &quit_fd, &send_fd};
+    
+    for(size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
     {
-        pthread_mutex_lock(&mutex);
-        bool quit = quit_flag;
-        pthread_mutex_unlock(&mutex);
+        if(*fds[i] >= 0)
+            close(*fds[i]);
         
-        if(quit)
-            break;
+        *fds[i] = -1;
+    }
+}
+
+void Server::add_connection(int fd)
+{
+    if(free_slots.empty())
+    {
+        cerr << "Too many clients (" << SERVER_MAX_CONNECTIONS 
+             << "); turning one away\n";
+        close(fd);
+        return;
+    }
+    
+    // disable Naggle's algorithm
+    int flag = 1;
+    setsockopt(
+        fd,
+        IPPROTO_TCP,
+        TCP_NODELAY,
+        (char*)&flag,
+        sizeof(int));
+    
+    // writes only ever go as far as the socket takes them (see flush())
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    
+    pthread_mutex_lock(&conns_mutex);
+    
+    int slot = free_slots.back();
+    free_slots.pop_back();
+    
+    Connection conn(fd);
+    conn.msg_mutex = &mutex;
+    conn.msg_queue = &messages;
+    conn.pool = &pool;
+    conns[slot] = conn;
+    
+    live_index[slot] = live.size();
+    live.push_back(slot);
+    
+    pthread_mutex_unlock(&conns_mutex);
+    
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = slot;
+    
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl");
+        remove_connection(slot);
+    }
+}
+
+void Server::remove_connection(int slot)
+{
+    pthread_mutex_lock(&conns_mutex);
+    
+    if(live_index[slot] < 0)
+    {
+        pthread_mutex_unlock(&conns_mutex);
+        return; // already gone
+    }
+    
+    // (closing takes it out of the epoll set as well)
+    close(conns[slot].fd);
+    out_total -= conns[slot].out_bytes;
+    conns[slot] = Connection();
+    
+    // the last live slot takes its place in the list
+    int index = live_index[slot];
+    int last = live.back();
+    live[index] = last;
+    live_index[last] = index;
+    live.pop_back();
+    live_index[slot] = -1;
+    
+    free_slots.push_back(slot);
+    
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+void Server::enqueue(int slot, const unsigned char* data, size_t size,
+    bool sync)
+{
+    Connection& conn = conns[slot];
+    
+    if(conn.overflowed)
+        return;
+    
+    // behind: the new sync replaces the ones not yet started on
+    if(sync && conn.out_bytes > SERVER_OUT_HIGH_WATER)
+    {
+        deque<OutgoingMessage> kept;
         
-        int status = poll(&pollfds[0], pollfds.size(), 500);
+        for(size_t i = 0; i < conn.out.size(); i++)
+        {
+            OutgoingMessage& m = conn.out[i];
+            
+            if(m.sync && !(i == 0 && conn.out_offset > 0))
+            {
+                conn.out_bytes -= m.bytes.size();
+                out_total -= m.bytes.size();
+                dropped_syncs++;
+                continue;
+            }
+            
+            kept.push_back(OutgoingMessage());
+            kept.back().bytes.swap(m.bytes);
+            kept.back().sync = m.sync;
+        }
         
-        if(status == 0)
+        conn.out.swap(kept);
+    }
+    
+    size_t framed = sizeof(uint32_t) + size;
+    
+    if(conn.out_bytes + framed > SERVER_OUT_LIMIT)
+    {
+        // the network thread disconnects it (see flush())
+        out_total -= conn.out_bytes;
+        conn.out.clear();
+        conn.out_offset = 0;
+        conn.out_bytes = 0;
+        conn.overflowed = true;
+        overflows++;
+        return;
+    }
+    
+    uint32_t length = htonl((uint32_t)size);
+    
+    conn.out.push_back(OutgoingMessage());
+    OutgoingMessage& m = conn.out.back();
+    m.sync = sync;
+    m.bytes.resize(framed);
+    memcpy(&m.bytes[0], &length, sizeof(length));
+    if(size)
+        memcpy(&m.bytes[sizeof(length)], data, size);
+    
+    conn.out_bytes += framed;
+    out_total += framed;
+}
+
+void Server::broadcast(const unsigned char* data, size_t size, bool sync)
+{
+    pthread_mutex_lock(&conns_mutex);
+    
+    for(size_t i = 0; i < live.size(); i++)
+        enqueue(live[i], data, size, sync);
+    
+    pthread_mutex_unlock(&conns_mutex);
+    
+    uint64_t one = 1;
+    ssize_t unused = write(send_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+void Server::send_sync(const Message& m)
+{
+    broadcast(m.bytes.size() ? &m.bytes[0] : NULL, m.bytes.size(), true);
+}
+
+void Server::send_to(const Message& from, const Message& m)
+{
+    pthread_mutex_lock(&conns_mutex);
+    
+    for(size_t i = 0; i < live.size(); i++)
+    {
+        if(conns[live[i]].fd == from.fd)
         {
-            // timeout
-            //cout << "Timeout\n";
-            continue;
+            enqueue(live[i], m.bytes.size() ? &m.bytes[0] : NULL,
+                m.bytes.size(), false);
         }
+    }
+    
+    pthread_mutex_unlock(&conns_mutex);
+    
+    uint64_t one = 1;
+    ssize_t unused = write(send_fd, &one, sizeof(one));
+    (void)unused;
+}
+
+bool Server::flush(int slot)
+{
+    pthread_mutex_lock(&conns_mutex);
+    
+    Connection& conn = conns[slot];
+    bool open = !conn.overflowed;
+    
+    while(open && conn.out.size())
+    {
+        struct iovec iov[SERVER_IOV_MAX];
+        size_t count = 0;
         
-        if(status < 0)
+        for(size_t i = 0; i < conn.out.size() && count < SERVER_IOV_MAX; i++)
         {
-            perror("poll");
-            exit(EXIT_FAILURE);
+            size_t skip = i == 0 ? conn.out_offset : 0;
+            
+            iov[count].iov_base = &conn.out[i].bytes[skip];
+            iov[count].iov_len = conn.out[i].bytes.size() - skip;
+            count++;
         }
         
-        // handle new connection
-        if(pollfds[0].revents & POLLIN)
+        // (sendmsg rather than writev for MSG_NOSIGNAL: a client that
+        // went away mustn't take the server with it)
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        
+        ssize_t written = sendmsg(conn.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        
+        if(written < 0)
         {
-            // listen socket always in position 0; new connection detected
-            pollfd new_connection;
-            memset(&new_connection, 0, sizeof(new_connection));
+            if(errno == EINTR)
+                continue;
             
-            new_connection.fd = accept(pollfds[0].fd, NULL, NULL);
-            new_connection.events = POLLIN;
+            // full; EPOLLOUT comes when there's room
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             
-            if(new_connection.fd < 0)
-            {
-                perror("accept");
-            }
-            else
+            perror("sendmsg");
+            open = false;
+            break;
+        }
+        
+        conn.out_bytes -= written;
+        out_total -= written;
+        
+        size_t left = written;
+        while(left)
+        {
+            size_t rest = conn.out.front().bytes.size() - conn.out_offset;
+            
+            if(left < rest)
             {
-                // disable Naggle's algorithm
-                int flag = 1;
-                setsockopt(
-                    new_connection.fd,
-                    IPPROTO_TCP,
-                    TCP_NODELAY,
-                    (char*)&flag,
-                    sizeof(int));
-                    
-                pollfds.push_back(new_connection);
-                
-                Connection conn(new_connection.fd);
-                conn.msg_mutex = &mutex;
-                conn.msg_queue = &messages;
-                
-                conns.push_back(conn);
+                conn.out_offset += left;
+                break;
             }
+            
+            left -= rest;
+            conn.out.pop_front();
+            conn.out_offset = 0;
+        }
+    }
+    
+    pthread_mutex_unlock(&conns_mutex);
+    
+    return open;
+}
+
+void Server::update_stats()
+{
+    if(!stats)
+        return;
+    
+    pthread_mutex_lock(&conns_mutex);
+    
+    size_t most = 0;
+    for(size_t i = 0; i < live.size(); i++)
+    {
+        if(conns[live[i]].out_bytes > most)
+            most = conns[live[i]].out_bytes;
+    }
+    
+    stats->set("net.queued_bytes", out_total);
+    stats->set("net.max_client_queued_bytes", most);
+    
+    if(dropped_syncs)
+        stats->add("net.dropped_syncs", dropped_syncs);
+    if(overflows)
+        stats->add("net.slow_disconnects", overflows);
+    
+    dropped_syncs = 0;
+    overflows = 0;
+    
+    pthread_mutex_unlock(&conns_mutex);
+}
+
+void Server::loop()
+{
+    struct epoll_event events[64];
+    
+    while(true)
+    {
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        
+        if(count < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
         }
         
-        // parse data from all connections
-        for(size_t i = 1; i < pollfds.size(); i++)
+        bool received = false;
+        
+        for(int i = 0; i < count; i++)
         {
-            if(pollfds[i].revents & POLLIN)
+            uint32_t tag = events[i].data.u32;
+            
+            if(tag == EVENT_QUIT)
             {
-                unsigned char bytes[4096];
-                ssize_t size = recv(
-                    pollfds[i].fd, 
-                    &bytes[0], 
-                    sizeof(bytes), 
-                    MSG_DONTWAIT);
+                for(size_t j = live.size(); j > 0; j--)
+                    remove_connection(live[j-1]);
+            
+                return;
+            }
+            
+            if(tag == EVENT_SEND)
+            {
+                uint64_t value;
+                ssize_t unused = read(send_fd, &value, sizeof(value));
+                (void)unused;
                 
-                if(size < 0)
+                // (remove_connection() changes live, so backwards)
+                for(size_t j = live.size(); j > 0; j--)
                 {
-                    perror("recv");
+                    int slot = live[j-1];
+                    
+                    if(!flush(slot))
+                        remove_connection(slot);
                 }
                 
-                if(size <= 0)
+                update_stats();
+                continue;
+            }
+            
+            if(tag == EVENT_LISTEN)
+            {
+                // new connections detected
+                while(true)
                 {
-                    close(pollfds[i].fd);
-                    pollfds[i].fd = 0;
-                    continue;
+                    int fd = accept(listen_fd, NULL, NULL);
+                    
+                    if(fd >= 0)
+                    {
+                        add_connection(fd);
+                        continue;
+                    }
+                    
+                    if(errno == EINTR)
+                        continue;
+                    
+                    if(errno != EAGAIN && errno != EWOULDBLOCK)
+                        perror("accept");
+                    
+                    break;
                 }
                 
-                conns[i].on_data(size, bytes);
+                continue;
             }
-        }
-        
-        // remove disconnected sockets
-        for(size_t i = pollfds.size()-1; i > 0; i--)
-        {
-            if(pollfds[i].fd == 0)
+                    
+            // (an event for a slot closed earlier in this batch)
+            if(live_index[tag] < 0)
+                continue;
+                
+            uint32_t what = events[i].events;
+            uint32_t hung_up = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+            bool open = true;
+            
+            // whatever is waiting is read even if the client has hung up
+            // after sending it
+            if(what & (EPOLLIN | hung_up))
             {
-                pollfds.erase(pollfds.begin() + i);
-                conns.erase(conns.begin() + i);
+                open = conns[tag].receive();
+                received = true;
             }
+                
+            // room for more of its queue
+            if(open && (what & EPOLLOUT))
+                open = flush(tag);
+            
+            if(!open || (what & hung_up))
+                remove_connection(tag);
         }
         
+        if(received && wakeup)
+            wakeup->signal();
+        
     } // while(true)
 }
 
@@ -201,6 +676,7 @@ void Client::start_thread()
     server_connection.fd = sock_fd;
     server_connection.msg_queue = &messages;
     server_connection.msg_mutex = &mutex;
+    server_connection.pool = &pool;
     
     // ----------------------------------------
     
@@ -234,26 +710,15 @@ void Client::loop()
             continue; // timeout
         
         // new data is waiting!
-        unsigned char bytes[4096];
-        ssize_t size = recv(
-            pfd.fd, 
-            &bytes[0], 
-            sizeof(bytes), 
-            MSG_DONTWAIT);
-        
-        if(size < 0)
-        {
-            perror("recv");
-        }
-        
-        if(size <= 0)
+        if(!server_connection.receive())
         {
             close(pfd.fd);
             cout << "FIXME: Reconnect?\n";
             exit(EXIT_FAILURE);
         }
         
-        server_connection.on_data(size, bytes);
+        if(wakeup)
+            wakeup->signal();
     }
 }
 
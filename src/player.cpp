@@ -1,5 +1,6 @@
 #include "player.h"
 #include "util.h"
+#include "prewarp.h"
 
 #include <iostream>
 #include <string>
@@ -14,28 +15,40 @@ void Player::start_threads()
     if(type == NT_SERVER)
     {
         server = new Server();
+        server->stats = &stats;
         nt = server;
+        nt->wakeup = &wakeup;
         nt->start_thread();
             
+        if(clock_sync.enabled)
+            clock_sync.start_server();
+            
         bool ok = decoder.open(video_path);
         
         if(!ok)
             exit(EXIT_FAILURE);
         
+        setup_polar_packing();
         decoder.add_fillable_frames(24*5);
         decoder.start_thread();
     }
     else if(type == NT_HEADLESS)
     {
         server = new Server();
+        server->stats = &stats;
         nt = server;
+        nt->wakeup = &wakeup;
         nt->start_thread();
         
+        if(clock_sync.enabled)
+            clock_sync.start_server();
+        
         bool ok = decoder.open(video_path);
         
         if(!ok)
             exit(EXIT_FAILURE);
         
+        setup_polar_packing();
         decoder.add_fillable_frames(24*5);
         decoder.start_thread();
     }
@@ -43,15 +56,23 @@ void Player::start_threads()
     {
         client = new Client(server_address, VIDEO_SPHERE_PORT);
         nt = client;
+        nt->wakeup = &wakeup;
         nt->start_thread();
         
+        // started before anything else so it has settled by the time
+        // playback does
+        if(clock_sync.enabled)
+            clock_sync.start_client(server_address, &stats);
+        
         nt->send("HELLO");
         
         cout << "Waiting for path...\n";
         
         string path = "";
+        bool have_time = false; // (now can be 0 while the start is held)
+        vector<Message> early; // anything else sent on HELLO
         
-        while(path == "" || now == 0)
+        while(path == "" || !have_time)
         {
             vector<Message> msgs;
             client->get_messages(msgs);
@@ -72,6 +93,7 @@ void Player::start_threads()
                         case 'S':
                             now = m.read_int64();
                             start = av_gettime_relative() - now;
+                            have_time = true;
                             break;
                             
                         case 'P':
@@ -83,6 +105,12 @@ void Player::start_threads()
                                 mc_client.setup_data();
                             }
                             break;
+                            
+                        default:
+                            // handled first thing in the main loop
+                            m.rewind();
+                            early.push_back(m);
+                            break;
                     }
                 }
                 catch(ParseError pe)
@@ -92,6 +120,10 @@ void Player::start_threads()
             }
         }
         
+        commands.take(early, clock_sync);
+        for(size_t i = 0; i < early.size(); i++)
+            commands.push(0, early[i]);
+        
         // explicitly passed path overrides network request
         if(video_path.size() > 0)
         {
@@ -114,6 +146,7 @@ void Player::start_threads()
                 exit(EXIT_FAILURE);   
             }
             
+            setup_polar_packing();
             decoder.add_fillable_frames(24*5);
             decoder.start_thread();
             
@@ -177,7 +210,7 @@ void parse_args(Player& player, int argc, char* argv[])
     for(int i = 0; i < argc; i++)
         cerr << "ARG " << i << " : " << argv[i] << '\n';
     
-    bool config_mode_is_calvr = false;
+    bool& config_mode_is_calvr = player.config_calvr;
     
     for(int i = 0; i < argc; i++)
     {
@@ -338,6 +371,255 @@ void parse_args(Player& player, int argc, char* argv[])
             continue;
         }
         
+        if(argv[i] == string("--aa"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected 'none', 'supersample', or 'mip' after --aa");
+            
+            if(argv[i] == string("none"))
+                player.aa_mode = AA_NONE;
+            else if(argv[i] == string("supersample"))
+                player.aa_mode = AA_SUPERSAMPLE;
+            else if(argv[i] == string("mip"))
+                player.aa_mode = AA_MIPMAP;
+            else
+                fatal("--aa followed by something other than 'none', 'supersample', or 'mip'");
+            
+            continue;
+        }
+        
+        if(argv[i] == string("--projection"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected projection type after --projection");
+            
+            if(argv[i] == string("equirect"))
+                player.projection = PROJECTION_EQUIRECT;
+            else if(argv[i] == string("cubemap"))
+                player.projection = PROJECTION_CUBEMAP;
+            else if(argv[i] == string("eac"))
+                player.projection = PROJECTION_EAC;
+            else
+                fatal("--projection followed by something other than 'equirect', 'cubemap', or 'eac'");
+            
+            player.projection_set = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--render-threads"))
+        {
+            player.render_threads = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--decoupled-render"))
+        {
+            player.decoupled_render = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--polar-decimation"))
+        {
+            player.polar_decimation = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--tile-size"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected tile size in texels after --tile-size");
+            
+            bool ok = parse_int(player.tile_size, argv[i]);
+            if(!ok || player.tile_size < 64)
+                fatal("--tile-size must be an integer of at least 64");
+            
+            continue;
+        }
+        
+        if(argv[i] == string("--cubemap"))
+        {
+            player.cubemap = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--dynamic-resolution"))
+        {
+            player.dynamic_resolution = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--min-scale"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected minimum resolution scale after --min-scale");
+            
+            bool ok = parse_float(player.scaler.min_scale, argv[i]);
+            if(!ok || player.scaler.min_scale <= 0.0 || 
+                player.scaler.min_scale > 1.0)
+            {
+                fatal("--min-scale must be a number in (0, 1]");
+            }
+            continue;
+        }
+        
+        if(argv[i] == string("--refresh-rate"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected display refresh rate (Hz) after --refresh-rate");
+            
+            float hz = 0;
+            bool ok = parse_float(hz, argv[i]);
+            if(!ok || hz <= 0)
+                fatal("Failed to parse refresh rate");
+            
+            player.scaler.budget_ms = 1000.0 / hz;
+            player.governor.budget_ms = 1000.0 / hz;
+            player.vblank.period = 1000000.0 / hz;
+            continue;
+        }
+        
+        if(argv[i] == string("--auto-quality"))
+        {
+            player.governor.enabled = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--no-clock-sync"))
+        {
+            player.clock_sync.enabled = false;
+            continue;
+        }
+        
+        if(argv[i] == string("--swap-barrier"))
+        {
+            player.swap_barrier.enabled = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--upload-thread"))
+        {
+            player.upload_thread = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--upload-ring"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected number of frames after --upload-ring");
+            
+            bool ok = parse_int(player.upload_ring, argv[i]);
+            if(!ok || player.upload_ring < 2)
+                fatal("--upload-ring must be an integer of at least 2");
+            
+            player.upload_thread = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--shader-cache"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected directory or \"off\" after --shader-cache");
+            
+            if(argv[i] == string("off"))
+                player.shader_cache = "";
+            else
+                player.shader_cache = argv[i];
+            
+            continue;
+        }
+        
+        if(argv[i] == string("--cpu-render"))
+        {
+            player.cpu_render = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--cpu-threads"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected number of threads after --cpu-threads");
+            
+            bool ok = parse_int(player.cpu_threads, argv[i]);
+            if(!ok || player.cpu_threads < 1)
+                fatal("--cpu-threads must be a positive integer");
+            
+            player.cpu_render = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--offscreen"))
+        {
+            player.offscreen = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--bench"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected number of frames after --bench");
+            
+            bool ok = parse_int(player.bench_frames, argv[i]);
+            if(!ok || player.bench_frames < 1)
+                fatal("--bench must be a positive integer");
+            
+            continue;
+        }
+        
+        if(argv[i] == string("--ready-frames"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected number of frames after --ready-frames");
+            
+            bool ok = parse_int(player.ready.frames, argv[i]);
+            if(!ok || player.ready.frames < 1)
+                fatal("--ready-frames must be a positive integer");
+            
+            player.ready.enabled = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--dump-frames"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected directory after --dump-frames");
+            
+            player.dump_dir = argv[i];
+            continue;
+        }
+        
+        if(argv[i] == string("--prewarp"))
+        {
+            i++;
+            if(i >= argc)
+                fatal("expected directory after --prewarp");
+            
+            player.prewarp_dir = argv[i];
+            continue;
+        }
+        
+        if(argv[i] == string("--prewarped"))
+        {
+            player.prewarped = true;
+            continue;
+        }
+        
+        if(argv[i] == string("--stats"))
+        {
+            player.stats.enabled = true;
+            continue;
+        }
+        
         if(argv[i] == string("--loop") || argv[i] == string("looping"))
         {
             player.looping = true;
@@ -358,6 +640,15 @@ void parse_args(Player& player, int argc, char* argv[])
     }
     
     // sanity checks
+    if(!player.prewarp_dir.empty())
+    {
+        // renders every host's screens offline; nothing else applies
+        if(player.video_path.size()==0 || player.config_path.size()==0)
+            fatal("--prewarp needs both --video [path] and --config [path]");
+        
+        return;
+    }
+    
     if(player.type == NT_UNDEFINED)
         fatal("must use one of --server, --client, or --headless as an argument!");
     
@@ -405,6 +696,13 @@ void parse_args(Player& player, int argc, char* argv[])
         if(player.screen_config.size() == 0)
             fatal("Failed to find any screens in config file for host: " +
                 player.hostname);
+        
+        // before --monitor picks out one screen, which keeps its place
+        if(player.prewarped)
+        {
+            layout_prewarp(player.screen_config, player.prewarp_width,
+                player.prewarp_height);
+        }
     }
     
     if(!mc_group_ip.empty())
@@ -431,15 +729,96 @@ void parse_args(Player& player, int argc, char* argv[])
         
         player.use_multicast = true;
     }
+    
+    // multicast clients get their frames from mc_client, not the decoder
+    if(player.upload_thread && player.use_multicast && 
+        player.type == NT_CLIENT)
+    {
+        cerr << "--upload-thread ignored for multicast clients\n";
+        player.upload_thread = false;
+    }
+}
+
+void on_window_refresh(GLFWwindow* window)
+{
+    // the main loop only redraws when something changed
+    Player* player = (Player*)glfwGetWindowUserPointer(window);
+    player->redraw_requested = true;
 }
 
 void on_window_resize(GLFWwindow* window, int w, int h)
 {
-    glViewport(0,0,w,h);
+    // callbacks come from glfwPollEvents() on the main thread, which
+    // doesn't own any context with --render-threads or
+    // --decoupled-render, so the viewport is set by render_window()
+    Player* player = (Player*)glfwGetWindowUserPointer(window);
+    
+    for(size_t i = 0; i < player->windows.size(); i++)
+    {
+        if(player->windows[i]->glfw_window == window)
+            player->windows[i]->on_resize(w, h);
+    }
+    
+    on_window_refresh(window);
+}
+
+void Player::setup_polar_packing()
+{
+    if(!polar_decimation)
+        return;
+    
+    Projection p = projection_set ? projection : decoder.projection;
+    
+    if(type == NT_SERVER)
+    {
+        // the server window shows the frame as it is
+        cerr << "--polar-decimation ignored on the server\n";
+        polar_decimation = false;
+        return;
+    }
+    
+    if(p != PROJECTION_EQUIRECT)
+    {
+        cerr << "--polar-decimation only applies to equirect video; ignoring it\n";
+        polar_decimation = false;
+        return;
+    }
+    
+    if(aa_mode == AA_MIPMAP)
+    {
+        // mipmaps would blend unrelated packed rows together
+        cerr << "--polar-decimation can't be used with --aa mip; ignoring it\n";
+        polar_decimation = false;
+        return;
+    }
+    
+    // top/bottom stereo frames have a pole at both ends of each half
+    int images = (stereo || stereo_type != STEREO_NONE) ? 2 : 1;
+    
+    polar.setup(decoder.codec_context->width, decoder.codec_context->height,
+        images);
+    decoder.polar_packing = &polar;
+    
+    cout << "Polar decimation: uploading " << polar.packed_height << " of " 
+         << polar.height << " rows (" << polar.bands.size() << " bands)\n";
 }
 
 void Player::create_windows()
 {
+    if(offscreen)
+    {
+        for(size_t i = 0; i < screen_config.size(); i++)
+        {
+            Window_* w = new Window_();
+            w->create_offscreen(screen_config[i].pixel_width, 
+                screen_config[i].pixel_height, 
+                windows.empty() ? NULL : windows[0]);
+            windows.push_back(w);
+        }
+        
+        return;
+    }
+    
     int monitor_count = 0;
     GLFWmonitor** monitors = glfwGetMonitors(&monitor_count);
     
@@ -529,7 +908,9 @@ void Player::create_windows()
         if(share_context == NULL)
             share_context = window;
         
+        glfwSetWindowUserPointer(window, this);
         glfwSetWindowSizeCallback(window, on_window_resize);
+        glfwSetWindowRefreshCallback(window, on_window_refresh);
         
         Window_* w = new Window_();
         w->glfw_window = window;
@@ -628,13 +1009,24 @@ void Player::seek(int64_t target)
         seek.write_char('S');
         seek.write_int64(target);
         
-        server->send(seek);
+        // comes back to seek_now() here when it's due
+        schedule_command(seek);
+        
+        if(ready.enabled)
+            schedule_command(ready.begin(hostname, READY_SEEK_TIMEOUT));
         
         string time_description = describe_seek(
             target, decoder.duration, decoder.time_base);
         cout << "Seek to: " << time_description << "\n";
+        
+        return;
     }
     
+    seek_now(target);
+}
+
+void Player::seek_now(int64_t target)
+{
     start = av_gettime_relative() - target;
     now = target;
     
@@ -655,3 +1047,17 @@ void Player::seek(int64_t target)
     #endif
 }
 
+void Player::schedule_command(const Message& command)
+{
+    int64_t at = av_gettime_relative() + COMMAND_LEAD;
+
+    Message m;
+    m.write_char('A');
+    m.write_int64(at);
+    m.bytes.insert(m.bytes.end(), command.bytes.begin(),
+        command.bytes.end());
+    
+    server->send(m);
+    commands.push(at, command);
+}
+
@@ -0,0 +1,170 @@
+#include "polar.h"
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+// sample-polar.frag has room for this many bands
+#define MAX_POLAR_BANDS 16
+
+// narrowest a row may get, in pixels
+#define MIN_POLAR_ROW_WIDTH 32
+
+void PolarPacking::setup(int width, int height, int images)
+{
+    this->width = width;
+    this->height = height;
+    
+    bands.clear();
+    
+    int image_rows = height / images;
+    int half = image_rows / 2; // rows from a pole to the equator
+    
+    // most decimation that still divides the width evenly
+    int max_shift = 0;
+    while(width % (2 << max_shift) == 0 && 
+        (width >> (max_shift+1)) >= MIN_POLAR_ROW_WIDTH &&
+        2*(max_shift+1)+1 <= MAX_POLAR_BANDS / images)
+    {
+        max_shift++;
+    }
+    
+    // rows from the pole at each shift
+    vector<int> rows_at(max_shift+1, 0);
+    
+    for(int d = 0; d < half; d++)
+    {
+        double lat = M_PI/2 * (1.0 - (d + 0.5) / half);
+        double c = cos(lat);
+        
+        int shift = 0;
+        while(shift < max_shift && c <= 1.0 / (2 << shift))
+            shift++;
+        
+        rows_at[shift]++;
+    }
+    
+    // each band has to fill whole packed rows; rows left over go to the
+    // next band towards the equator, which keeps more of them
+    for(int k = max_shift; k > 0; k--)
+    {
+        int extra = rows_at[k] % (1 << k);
+        rows_at[k] -= extra;
+        rows_at[k-1] += extra;
+    }
+    
+    int packed_row = 0;
+    
+    for(int i = 0; i < images; i++)
+    {
+        int row = i * image_rows;
+        int image_end = (i == images-1) ? height : row + image_rows;
+        
+        // north, pole first
+        for(int k = max_shift; k > 0; k--)
+        {
+            if(rows_at[k] == 0)
+                continue;
+            
+            PolarBand band = {row, rows_at[k], 1 << k, packed_row};
+            bands.push_back(band);
+            
+            row += band.rows;
+            packed_row += band.rows / band.per_row;
+        }
+        
+        int middle_rows = image_end - row;
+        for(int k = 1; k <= max_shift; k++)
+            middle_rows -= rows_at[k];
+        
+        PolarBand middle = {row, middle_rows, 1, packed_row};
+        bands.push_back(middle);
+        
+        row += middle.rows;
+        packed_row += middle.rows;
+        
+        // south, pole last
+        for(int k = 1; k <= max_shift; k++)
+        {
+            if(rows_at[k] == 0)
+                continue;
+            
+            PolarBand band = {row, rows_at[k], 1 << k, packed_row};
+            bands.push_back(band);
+            
+            row += band.rows;
+            packed_row += band.rows / band.per_row;
+        }
+    }
+    
+    packed_height = packed_row;
+}
+
+void PolarPacking::pack(unsigned char* rgb, int linesize) const
+{
+    // bands go top to bottom and never pack to below where they came from,
+    // so every row is read before anything is written over it
+    for(size_t b = 0; b < bands.size(); b++)
+    {
+        const PolarBand& band = bands[b];
+        
+        int per = band.per_row;
+        int out_width = width / per;
+        
+        for(int j = 0; j < band.rows; j++)
+        {
+            unsigned char* src = rgb + (band.first_row + j) * linesize;
+            unsigned char* dst = rgb + (band.packed_row + j/per) * linesize
+                + 3 * (j % per) * out_width;
+            
+            if(per == 1)
+            {
+                if(dst != src)
+                    memmove(dst, src, 3*width);
+                
+                continue;
+            }
+            
+            // box filter; dst never gets ahead of src within a row
+            for(int x = 0; x < out_width; x++)
+            {
+                for(int ch = 0; ch < 3; ch++)
+                {
+                    int sum = 0;
+                    
+                    for(int s = 0; s < per; s++)
+                        sum += src[3*(x*per + s) + ch];
+                    
+                    dst[3*x + ch] = (sum + per/2) / per;
+                }
+            }
+        }
+    }
+}
+
+void PolarPacking::set_uniforms(GLuint program) const
+{
+    GLfloat first_row[MAX_POLAR_BANDS];
+    GLfloat per_row[MAX_POLAR_BANDS];
+    GLfloat packed_row[MAX_POLAR_BANDS];
+    
+    for(size_t i = 0; i < bands.size(); i++)
+    {
+        first_row[i]  = bands[i].first_row;
+        per_row[i]    = bands[i].per_row;
+        packed_row[i] = bands[i].packed_row;
+    }
+    
+    glUseProgram(program);
+    
+    glUniform1i(glGetUniformLocation(program, "band_count"), bands.size());
+    glUniform1fv(glGetUniformLocation(program, "band_first_row"), 
+        bands.size(), first_row);
+    glUniform1fv(glGetUniformLocation(program, "band_per_row"), 
+        bands.size(), per_row);
+    glUniform1fv(glGetUniformLocation(program, "band_packed_row"), 
+        bands.size(), packed_row);
+    glUniform3f(glGetUniformLocation(program, "video_size"), 
+        width, height, packed_height);
+}
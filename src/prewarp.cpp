@@ -0,0 +1,187 @@
+#include "prewarp.h"
+#include "player.h"
+#include "encoder.h"
+#include "util.h"
+
+#include <iostream>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+void layout_prewarp(vector<ScreenConfig>& screens, int& width, int& height)
+{
+    width = 0;
+    height = 0;
+    
+    for(size_t i = 0; i < screens.size(); i++)
+    {
+        screens[i].stream_x = width;
+        width += screens[i].pixel_width;
+        
+        if(screens[i].pixel_height > height)
+            height = screens[i].pixel_height;
+    }
+    
+    width += width & 1;
+    height += height & 1;
+}
+
+// one output stream
+struct PrewarpHost
+{
+    string name;
+    vector<ScreenConfig> screens;
+    
+    int width;
+    int height;
+    
+    vector<unsigned char> image;  // whole stream frame, RGB
+    vector<unsigned char> screen; // one screen, as CpuRenderer draws it
+    
+    Encoder encoder;
+    
+    PrewarpHost() : width(0), height(0) {}
+};
+
+void run_prewarp(Player& player)
+{
+    if(player.stereo)
+        fatal("--prewarp only renders mono screens");
+    
+    Decoder& decoder = player.decoder;
+    
+    if(!decoder.open(player.video_path))
+        fatal("Can't open " + player.video_path);
+    
+    Projection projection = player.projection_set ?
+        player.projection : decoder.projection;
+    
+    if(projection != PROJECTION_EQUIRECT)
+        fatal("--prewarp only reads equirect video");
+    
+    vector<string> names = list_config_hosts(player.config_path);
+    if(names.empty())
+        fatal("No hosts found in " + player.config_path);
+    
+    mkdir(player.prewarp_dir.c_str(), 0755);
+    
+    AVRational frame_rate =
+        decoder.format_context->streams[decoder.video_stream_index]->
+            avg_frame_rate;
+    
+    vector<PrewarpHost> hosts(names.size());
+    
+    for(size_t i = 0; i < hosts.size(); i++)
+    {
+        PrewarpHost& host = hosts[i];
+        host.name = names[i];
+        
+        if(player.config_calvr)
+            parse_calvr_screen_config(host.screens, player.config_path,
+                host.name);
+        else
+            parse_screen_config(host.screens, player.config_path, host.name);
+        
+        layout_prewarp(host.screens, host.width, host.height);
+        
+        // parts of the frame no screen covers stay black
+        host.image.assign(host.width * host.height * 3, 0);
+        
+        string path = player.prewarp_dir + "/" + host.name + ".mp4";
+        
+        cout << "Pre-warping " << host.screens.size() << " screens of "
+             << host.name << " into " << path << " (" << host.width << "x"
+             << host.height << ")\n";
+        
+        host.encoder.open(path, host.width, host.height, decoder.time_base,
+            frame_rate);
+    }
+    
+    decoder.add_fillable_frames(24);
+    decoder.start_thread();
+    
+    player.cpu_renderer.start(player.cpu_threads);
+    
+    int frames = 0;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int64_t start = av_gettime_relative();
+    
+    while(true)
+    {
+        DecoderFrame df = decoder.get_frame();
+        
+        if(!df.frame)
+        {
+            decoder.lock();
+            bool done = decoder.decoded_all_flag;
+            decoder.unlock();
+            
+            if(done)
+                break;
+            
+            av_usleep(500);
+            continue;
+        }
+        
+        AVFrame* frame = df.frame;
+        
+        // encoders want strictly increasing timestamps
+        int64_t pts = frame->pts;
+        if(pts == AV_NOPTS_VALUE)
+            pts = frames;
+        if(last_pts != AV_NOPTS_VALUE && pts <= last_pts)
+            pts = last_pts + 1;
+        last_pts = pts;
+        
+        player.cpu_renderer.set_source(frame->data[0],
+            decoder.codec_context->width, decoder.codec_context->height);
+        
+        for(size_t i = 0; i < hosts.size(); i++)
+        {
+            PrewarpHost& host = hosts[i];
+            
+            for(size_t s = 0; s < host.screens.size(); s++)
+            {
+                const ScreenConfig& sc = host.screens[s];
+                
+                host.screen.resize(sc.pixel_width * sc.pixel_height * 3);
+                player.cpu_renderer.render(sc, 0.0, 0.0, &host.screen[0],
+                    sc.pixel_width, sc.pixel_height);
+                
+                for(int y = 0; y < sc.pixel_height; y++)
+                {
+                    memcpy(&host.image[(y * host.width + sc.stream_x) * 3],
+                        &host.screen[y * sc.pixel_width * 3],
+                        sc.pixel_width * 3);
+                }
+            }
+            
+            host.encoder.write(&host.image[0], pts);
+        }
+        
+        decoder.return_frame(df);
+        frames++;
+        
+        if(frames % 100 == 0)
+        {
+            double seconds = (av_gettime_relative() - start) / 1000000.0;
+            cout << "Pre-warped " << frames << " frames ("
+                 << frames / seconds << " fps)\n";
+        }
+    }
+    
+    player.cpu_renderer.stop();
+    
+    for(size_t i = 0; i < hosts.size(); i++)
+        hosts[i].encoder.close();
+    
+    cout << "Pre-warped " << frames << " frames for " << hosts.size()
+         << " hosts\n";
+}
@@ -0,0 +1,194 @@
+#include "quality.h"
+
+#include <sstream>
+#include <iomanip>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// frames to average before a node's time is worth sending
+#define QUALITY_MIN_SAMPLES 30
+
+// how long after a change before deciding again (lets every node switch
+// and settle into the new mode)
+#define QUALITY_HOLD (5 * 1000000)
+
+// nodes that haven't reported for this long have probably gone away
+#define QUALITY_STALE (3 * 1000000)
+
+// how long a node's time in a better mode is trusted after leaving it
+#define QUALITY_MEMORY (300 * 1000000LL)
+
+const char* quality_mode_name(int mode)
+{
+    switch(mode)
+    {
+        case QUALITY_PLAIN: return "plain";
+        case QUALITY_AA:    return "aa";
+    }
+    
+    return "unknown";
+}
+
+void QualityGovernor::report(double gpu_ms, double cpu_ms)
+{
+    double ms = gpu_ms > cpu_ms ? gpu_ms : cpu_ms;
+    
+    pthread_mutex_lock(&mutex);
+    
+    if(ms > frame_ms)
+        frame_ms = ms;
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void QualityGovernor::update(Stats& stats)
+{
+    pthread_mutex_lock(&mutex);
+    
+    if(samples == 0)
+        average_ms = frame_ms;
+    else
+        average_ms = 0.9 * average_ms + 0.1 * frame_ms;
+    
+    samples++;
+    frame_ms = 0.0;
+    
+    stats.set("quality.frame_ms", average_ms);
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void QualityGovernor::set_mode(int mode)
+{
+    pthread_mutex_lock(&mutex);
+    
+    if(mode != this->mode)
+    {
+        this->mode = mode;
+        samples = 0;
+        frame_ms = 0.0;
+    }
+    
+    pending_mode = -1;
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+bool QualityGovernor::measurement(int& mode, double& ms)
+{
+    pthread_mutex_lock(&mutex);
+    
+    bool ready = samples >= QUALITY_MIN_SAMPLES;
+    mode = this->mode;
+    ms = average_ms;
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return ready;
+}
+
+void QualityGovernor::on_report(const string& host, int mode, double ms)
+{
+    pthread_mutex_lock(&mutex);
+    
+    NodeQuality& node = nodes[host];
+    node.mode = mode;
+    node.ms[mode] = ms;
+    node.when[mode] = av_gettime_relative();
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+int QualityGovernor::decide()
+{
+    pthread_mutex_lock(&mutex);
+    
+    int64_t wall = av_gettime_relative();
+    
+    if(pending_mode >= 0 || wall - last_change < QUALITY_HOLD)
+    {
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    
+    int count = 0;
+    bool headroom = true;
+    string slowest;
+    double slowest_ms = 0.0;
+    
+    map<string, NodeQuality>::iterator it;
+    for(it = nodes.begin(); it != nodes.end(); it++)
+    {
+        NodeQuality& node = it->second;
+        
+        if(node.mode < 0 || wall - node.when[node.mode] > QUALITY_STALE)
+            continue;
+        
+        // still measuring the mode before the last change
+        if(node.mode != mode)
+        {
+            pthread_mutex_unlock(&mutex);
+            return -1;
+        }
+        
+        count++;
+        
+        double ms = node.ms[mode];
+        if(ms > slowest_ms)
+        {
+            slowest_ms = ms;
+            slowest = it->first;
+        }
+        
+        if(mode == QUALITY_PLAIN)
+        {
+            // trust what anti-aliasing cost this node last time it was
+            // tried, otherwise only try it with lots of room to spare
+            if(wall - node.when[QUALITY_AA] < QUALITY_MEMORY)
+            {
+                if(node.ms[QUALITY_AA] > 0.75 * budget_ms)
+                    headroom = false;
+            }
+            else if(ms > 0.5 * budget_ms)
+                headroom = false;
+        }
+    }
+    
+    int result = -1;
+    
+    ostringstream why;
+    why << fixed << setprecision(1);
+    
+    if(count > 0 && mode == QUALITY_AA && slowest_ms > 0.9 * budget_ms)
+    {
+        result = QUALITY_PLAIN;
+        why << slowest << " took " << slowest_ms << " ms of the "
+            << budget_ms << " ms budget";
+    }
+    else if(count > 0 && mode == QUALITY_PLAIN && headroom)
+    {
+        result = QUALITY_AA;
+        why << "every node has room to spare (slowest: " << slowest
+            << " at " << slowest_ms << " ms of " << budget_ms << " ms)";
+    }
+    
+    if(result >= 0)
+    {
+        reason = why.str();
+        last_change = wall;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+void QualityGovernor::schedule(int mode)
+{
+    pthread_mutex_lock(&mutex);
+    pending_mode = mode;
+    pthread_mutex_unlock(&mutex);
+}
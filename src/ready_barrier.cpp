@@ -0,0 +1,80 @@
+#include "ready_barrier.h"
+
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+Message ReadyBarrier::begin(const string& self, int64_t timeout)
+{
+    last_round++;
+    waiting = true;
+    started = av_gettime_relative();
+    deadline = started + timeout;
+    
+    members.insert(self);
+    ready.clear();
+    
+    Message hold;
+    hold.write_char('H');
+    hold.write_int32(last_round);
+    hold.write_int32(frames);
+    
+    return hold;
+}
+
+void ReadyBarrier::on_hold(int round)
+{
+    holding = true;
+    this->round = round;
+    reported = false;
+}
+
+void ReadyBarrier::on_ready(const string& host, int round)
+{
+    // a late answer still brings a dropped node back for the next round
+    members.insert(host);
+    
+    if(waiting && round == last_round)
+        ready.insert(host);
+}
+
+bool ReadyBarrier::complete(vector<string>& stragglers)
+{
+    if(!waiting)
+        return false;
+    
+    bool everyone = true;
+    
+    set<string>::iterator it;
+    for(it = members.begin(); it != members.end(); it++)
+    {
+        if(!ready.count(*it))
+            everyone = false;
+    }
+    
+    if(!everyone && av_gettime_relative() < deadline)
+        return false;
+    
+    stragglers.clear();
+    
+    for(it = members.begin(); it != members.end(); it++)
+    {
+        if(!ready.count(*it))
+            stragglers.push_back(*it);
+    }
+    
+    for(size_t i = 0; i < stragglers.size(); i++)
+        members.erase(stragglers[i]);
+    
+    waiting = false;
+    
+    return true;
+}
+
+void ReadyBarrier::on_release(int round)
+{
+    if(round == this->round)
+        holding = false;
+}
@@ -0,0 +1,1037 @@
+#include "render.h"
+#include "player.h"
+
+#include <iostream>
+#include <ctime>
+#include <cmath>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+GLuint get_program(Player& player, size_t index, GLint Window_::* program)
+{
+    Window_* window = player.windows[index];
+    
+    // only this window's thread ever sets its own programs
+    if(window->*program)
+        return window->*program;
+    
+    pthread_mutex_lock(&player.program_mutex);
+    
+    // uniforms belong to the program, not the context, so windows drawn
+    // by different threads each need their own copy; the shader cache
+    // keeps the extra links cheap
+    for(size_t i = 0; i < player.windows.size() && !player.render_threads;
+        i++)
+    {
+        if(i != index && player.windows[i]->*program &&
+            window->shares_objects_with(*player.windows[i]))
+        {
+            window->*program = player.windows[i]->*program;
+            break;
+        }
+    }
+    
+    if(!(window->*program))
+    {
+        const ProgramSpec* spec = NULL;
+        for(size_t i = 0; i < player.programs.size(); i++)
+        {
+            if(player.programs[i].program == program)
+                spec = &player.programs[i];
+        }
+        
+        if(!spec)
+            fatal("get_program: no shaders given for program");
+        
+        GLuint sp = load_shaders(spec->files);
+        
+        // uniforms a program doesn't have are simply ignored
+        glUseProgram(sp);
+        glUniform1i(glGetUniformLocation(sp, "video_texture"), 0);
+        glUniform1i(glGetUniformLocation(sp, "video_cube"), 1);
+        
+        if(player.tiled)
+            player.tile_grid.set_uniforms(sp);
+        
+        if(player.decoder.polar_packing)
+            player.polar.set_uniforms(sp);
+        
+        window->*program = sp;
+    }
+    
+    pthread_mutex_unlock(&player.program_mutex);
+    
+    return window->*program;
+}
+
+static void upload_frame(Player& player, const RenderFrame& rf)
+{
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
+        rf.width, rf.height,
+        0, GL_RGB, GL_UNSIGNED_BYTE, rf.pixels);
+    
+    // with --cubemap the mipmaps are made on the cube instead
+    if(player.aa_mode == AA_MIPMAP && !player.cubemap)
+        glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+// redraws the equirect texture bound to unit 0 into the window's cubemap,
+// one face at a time
+static void convert_to_cube(Player& player, size_t index, int video_width)
+{
+    Window_* window = player.windows[index];
+    
+    // an earlier window has already redrawn the shared cube from this
+    // frame; binding it again picks up what that window's context drew
+    if(window->cube_owner != (int)index)
+    {
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, window->cube_tex);
+        glActiveTexture(GL_TEXTURE0);
+        
+        return;
+    }
+    
+    // a quarter of the equirect width per face keeps the equator at about
+    // the same texel density; the poles get far fewer (wasted) texels
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_CUBE_MAP_TEXTURE_SIZE, &max_size);
+    
+    int size = video_width / 4;
+    if(size > max_size)
+        size = max_size;
+    
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, window->cube_tex);
+    
+    if(size != window->cube_size)
+    {
+        for(int face = 0; face < 6; face++)
+        {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGB,
+                size, size, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        }
+        
+        window->cube_size = size;
+    }
+    
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    GLint sp = get_program(player, index, &Window_::equirect_to_cube_program);
+    glUseProgram(sp);
+    GLint face_ = glGetUniformLocation(sp, "face");
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, window->cube_fbo);
+    glViewport(0, 0, size, size);
+    
+    for(int face = 0; face < 6; face++)
+    {
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, window->cube_tex, 0);
+        
+        glUniform1i(face_, face);
+        
+        glBegin(GL_QUADS);
+            glVertex2f(-1, -1);
+            glVertex2f( 1, -1);
+            glVertex2f( 1,  1);
+            glVertex2f(-1,  1);
+        glEnd();
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    
+    if(player.aa_mode == AA_MIPMAP)
+        glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+    
+    // the other windows' contexts only see the new faces once flushed
+    if(player.windows.size() > 1)
+        glFlush();
+    
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// --cpu-render: projects the screen with CpuRenderer and puts the result
+// on the window with glDrawPixels, which any GL can do
+static void draw_window_cpu(Player& player, size_t index, 
+    const RenderFrame& rf)
+{
+    Window_* window = player.windows[index];
+    
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    int width = viewport[2];
+    int height = viewport[3];
+    
+    window->cpu_image.resize(width * height * 3);
+    player.cpu_renderer.render(player.screen_config[index], rf.theta, 
+        rf.phi, &window->cpu_image[0], width, height);
+    
+    // rows come top first, so draw downwards from the top left
+    glDisable(GL_TEXTURE_2D);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelZoom(1.0, -1.0);
+    glRasterPos2f(-1, 1);
+    glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, 
+        &window->cpu_image[0]);
+    glPixelZoom(1.0, 1.0);
+    glEnable(GL_TEXTURE_2D);
+}
+
+// --prewarped: the window's screen sits at stream_x in the host's frame,
+// already projected, so it's only copied (stretched if the window's size
+// differs from the config's)
+static void draw_window_prewarped(Player& player, size_t index,
+    const RenderFrame& rf)
+{
+    glUseProgram(get_program(player, index, rf.shader_program));
+    
+    const ScreenConfig& sc = player.screen_config[index];
+    
+    float left = (float)sc.stream_x / player.prewarp_width;
+    float right = (float)(sc.stream_x + sc.pixel_width) / player.prewarp_width;
+    float bottom = (float)sc.pixel_height / player.prewarp_height;
+    
+    // the frame's first row is its top, at texture coordinate 0
+    glBegin(GL_QUADS);
+        glTexCoord2f(left, 0);
+        glVertex2f(-1, 1);
+        glTexCoord2f(left, bottom);
+        glVertex2f(-1, -1);
+        glTexCoord2f(right, bottom);
+        glVertex2f(1,-1);
+        glTexCoord2f(right, 0);
+        glVertex2f(1,1);
+    glEnd();
+}
+
+void draw_window(Player& player, size_t index, const RenderFrame& rf)
+{
+    if(player.cpu_render)
+    {
+        draw_window_cpu(player, index, rf);
+        return;
+    }
+    
+    if(player.prewarped)
+    {
+        draw_window_prewarped(player, index, rf);
+        return;
+    }
+    
+    GLuint sp = get_program(player, index, rf.shader_program);
+    glUseProgram(sp);
+    
+    GLint theta_ = glGetUniformLocation(sp, "theta");
+    GLint phi_   = glGetUniformLocation(sp, "phi");
+    GLint pos = glGetAttribLocation(sp, "pos_in");
+    
+    const ScreenConfig& sc = player.screen_config[index];
+    
+    GLint roll_    = glGetUniformLocation(sp, "roll");
+    GLint pitch_   = glGetUniformLocation(sp, "pitch");
+    GLint heading_ = glGetUniformLocation(sp, "heading");
+    GLint originX_ = glGetUniformLocation(sp, "originX");
+    GLint originY_ = glGetUniformLocation(sp, "originY");
+    GLint originZ_ = glGetUniformLocation(sp, "originZ");
+    GLint width_   = glGetUniformLocation(sp, "width");
+    GLint height_  = glGetUniformLocation(sp, "height");
+    
+    // for 'pos', using convention where x goes to the right, y goes in,
+    // and z goes up.
+    glUniform1f(theta_, rf.theta);
+    glUniform1f(phi_, rf.phi);
+    
+    glUniform1f(roll_, sc.roll);
+    glUniform1f(pitch_, sc.pitch);
+    glUniform1f(heading_, sc.heading);
+    glUniform1f(originX_, sc.originX);
+    glUniform1f(originY_, sc.originY);
+    glUniform1f(originZ_, sc.originZ);
+    glUniform1f(width_, sc.width);
+    glUniform1f(height_, sc.height);
+    
+    if(player.stereo_type == STEREO_TOP_BOTTOM_INTERLEAVED)
+    {
+        // interleaved top/bottom stereo
+        // a single quad: the shader picks the eye from the row parity
+        glBegin(GL_QUADS);
+            glVertexAttrib3f(pos, -1, 1, 0);
+            glVertex2f(-1, 1);
+            glVertexAttrib3f(pos, -1, -1, 0);
+            glVertex2f(-1, -1);
+            glVertexAttrib3f(pos, 1, -1, 0);
+            glVertex2f(1,-1);
+            glVertexAttrib3f(pos, 1, 1, 0);
+            glVertex2f(1,1);
+        glEnd();
+    }
+    else if(player.server || !player.stereo)
+    {
+        if(player.stereo_type == STEREO_HALF_TOP)
+        {
+            GLint stereo_  = 
+                glGetUniformLocation(sp, "stereo_half");
+            
+            glUniform1f(stereo_, 1.0);
+        }
+        else if(player.stereo_type == STEREO_HALF_BOTTOM)
+        {
+            GLint stereo_  = 
+                glGetUniformLocation(sp, "stereo_half");
+                
+            glUniform1f(stereo_, 0.0);                
+        }
+    
+        glBegin(GL_QUADS);
+            // top left
+            //glVertexAttrib3f(pos, -11, 2*1.5, 6);
+            glVertexAttrib3f(pos, -1, 1, 0);
+            glTexCoord2f(0, 0); // only used by server
+            glVertex2f(-1, 1);
+            
+            // bottom left
+            //glVertexAttrib3f(pos, -11, 2*1.5, -6);
+            glVertexAttrib3f(pos, -1, -1, 0);
+            glTexCoord2f(0, 1);
+            glVertex2f(-1, -1);
+            
+            // bottom right
+            //glVertexAttrib3f(pos, 11, 2*1.5, -6);
+            glVertexAttrib3f(pos, 1, -1, 0);
+            glTexCoord2f(1,1);
+            glVertex2f(1,-1);
+            
+            // top right
+            //glVertexAttrib3f(pos, 11, 2*1.5, 6);
+            glVertexAttrib3f(pos, 1, 1, 0);
+            glTexCoord2f(1, 0);
+            glVertex2f(1,1);            
+        glEnd();
+    }
+    else
+    {
+        // top/bottom stereo
+        GLint stereo_  = 
+            glGetUniformLocation(sp, "stereo_half");
+            
+        glUniform1f(stereo_, 1.0);
+        glBegin(GL_QUADS);
+            glVertexAttrib3f(pos, -1, 1, 0);
+            glVertex2f(-1, 1);
+            glVertexAttrib3f(pos, -1, -1, 0);
+            glVertex2f(-1, 0);
+            glVertexAttrib3f(pos, 1, -1, 0);
+            glVertex2f(1,0);
+            glVertexAttrib3f(pos, 1, 1, 0);
+            glVertex2f(1,1);
+        glEnd();
+            
+        glUniform1f(stereo_, 0.0);
+        glBegin(GL_QUADS);
+            glVertexAttrib3f(pos, -1, 1, 0);
+            glVertex2f(-1, 0);
+            glVertexAttrib3f(pos, -1, -1, 0);
+            glVertex2f(-1, -1);
+            glVertexAttrib3f(pos, 1, -1, 0);
+            glVertex2f(1,-1);
+            glVertexAttrib3f(pos, 1, 1, 0);
+            glVertex2f(1,0);
+        glEnd();
+    }
+}
+
+void ResolutionScaler::report(double gpu_ms, double cpu_ms)
+{
+    pthread_mutex_lock(&mutex);
+    
+    if(gpu_ms > frame_gpu_ms)
+        frame_gpu_ms = gpu_ms;
+    
+    if(cpu_ms > frame_cpu_ms)
+        frame_cpu_ms = cpu_ms;
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void ResolutionScaler::update(Stats& stats)
+{
+    pthread_mutex_lock(&mutex);
+    
+    double ms = frame_gpu_ms > frame_cpu_ms ? frame_gpu_ms : frame_cpu_ms;
+    
+    if(average_ms < 0)
+        average_ms = ms;
+    else
+        average_ms = 0.9 * average_ms + 0.1 * ms;
+    
+    stats.set("render.gpu_ms", frame_gpu_ms);
+    stats.set("render.cpu_ms", frame_cpu_ms);
+    
+    frame_gpu_ms = 0.0;
+    frame_cpu_ms = 0.0;
+    
+    if(cooldown > 0)
+    {
+        cooldown--;
+    }
+    else if(average_ms > 0.85 * budget_ms)
+    {
+        under_count = 0;
+        
+        // a few slow frames in a row: back off quickly
+        if(++over_count >= 5 && scale > min_scale)
+        {
+            scale *= 0.9;
+            if(scale < min_scale)
+                scale = min_scale;
+            
+            over_count = 0;
+            cooldown = 30;
+        }
+    }
+    else if(average_ms < 0.6 * budget_ms)
+    {
+        over_count = 0;
+        
+        // plenty of headroom for about a second: creep back up
+        if(++under_count >= 60 && scale < 1.0)
+        {
+            scale *= 1.05;
+            if(scale > 1.0)
+                scale = 1.0;
+            
+            under_count = 0;
+            cooldown = 30;
+        }
+    }
+    else
+    {
+        over_count = 0;
+        under_count = 0;
+    }
+    
+    stats.set("render.scale", scale);
+    stats.set("render.frame_ms", average_ms);
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void VblankPredictor::on_present(int64_t when, Stats& stats)
+{
+    pthread_mutex_lock(&mutex);
+    
+    if(last == 0)
+    {
+        base = when;
+        last = when;
+        
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    
+    // frames may skip vblanks (idle, or a slow draw), so the spacing is
+    // divided by the number of periods it spans. Until the estimate has
+    // settled (e.g. a 50 Hz display with the 60 Hz default) it follows
+    // faster and takes bigger corrections.
+    double delta = when - last;
+    int n = (int)(delta / period + 0.5);
+    
+    double tolerance = samples < 30 ? 0.3 : 0.1;
+    double gain = samples < 30 ? 0.1 : 0.02;
+    
+    if(n >= 1 && n <= 8)
+    {
+        double measured = delta / n;
+        if(fabs(measured - period) < tolerance * period)
+            period += gain * (measured - period);
+    }
+    
+    last = when;
+    
+    // how far this presentation was from the nearest grid point, and pull
+    // the grid a little towards it
+    double grid = base + floor((when - base) / period + 0.5) * period;
+    double error = when - grid;
+    
+    base = grid + 0.1 * error;
+    jitter = 0.95 * jitter + 0.05 * fabs(error);
+    samples++;
+    
+    stats.set("present.period_ms", period / 1000.0);
+    stats.set("present.jitter_ms", jitter / 1000.0);
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+int64_t VblankPredictor::predict(int64_t now)
+{
+    pthread_mutex_lock(&mutex);
+    
+    int64_t result = now;
+    
+    if(samples >= 10)
+        result = (int64_t)(base + ceil((now - base) / period) * period);
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+// reads the GL_TIME_ELAPSED query issued two frames ago (if finished) and
+// starts a new one. Returns the old result in milliseconds, or -1.
+static double begin_gpu_timer(Window_* window)
+{
+    if(!GLEW_ARB_timer_query)
+        return -1;
+    
+    if(!window->time_query[0])
+        glGenQueries(2, window->time_query);
+    
+    int i = window->time_query_index;
+    double result = -1;
+    
+    if(window->time_query_pending[i])
+    {
+        GLint available = 0;
+        glGetQueryObjectiv(window->time_query[i],
+            GL_QUERY_RESULT_AVAILABLE, &available);
+        
+        if(available)
+        {
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(window->time_query[i], GL_QUERY_RESULT, &ns);
+            result = ns / 1000000.0;
+        }
+    }
+    
+    glBeginQuery(GL_TIME_ELAPSED, window->time_query[i]);
+    window->time_query_pending[i] = true;
+    
+    return result;
+}
+
+static void end_gpu_timer(Window_* window)
+{
+    if(!GLEW_ARB_timer_query)
+        return;
+    
+    glEndQuery(GL_TIME_ELAPSED);
+    window->time_query_index ^= 1;
+}
+
+// redirects drawing into the window's offscreen buffer at scale * the
+// current viewport. Interleaved stereo depends on the parity of window
+// rows, so only its width is scaled.
+static void begin_scaled(Player& player, Window_* window, float scale, 
+    GLint viewport[4], int& scaled_w, int& scaled_h)
+{
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    int w = viewport[2];
+    int h = viewport[3];
+    
+    // allocated at full size so that changing the scale never reallocates
+    if(!window->scale_fbo || 
+        window->scale_fbo_width != w || window->scale_fbo_height != h)
+    {
+        if(!window->scale_fbo)
+        {
+            glGenFramebuffers(1, &window->scale_fbo);
+            glGenRenderbuffers(1, &window->scale_rbo);
+        }
+        
+        glBindRenderbuffer(GL_RENDERBUFFER, window->scale_rbo);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGB8, w, h);
+        
+        glBindFramebuffer(GL_FRAMEBUFFER, window->scale_fbo);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+            GL_RENDERBUFFER, window->scale_rbo);
+        
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != 
+            GL_FRAMEBUFFER_COMPLETE)
+        {
+            cerr << "Warning: incomplete framebuffer for dynamic resolution\n";
+        }
+        
+        window->scale_fbo_width = w;
+        window->scale_fbo_height = h;
+    }
+    
+    scaled_w = (int)(w * scale);
+    scaled_h = (int)(h * scale);
+    
+    if(player.stereo_type == STEREO_TOP_BOTTOM_INTERLEAVED)
+        scaled_h = h;
+    
+    if(scaled_w < 1)
+        scaled_w = 1;
+    if(scaled_h < 1)
+        scaled_h = 1;
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, window->scale_fbo);
+    glViewport(0, 0, scaled_w, scaled_h);
+}
+
+// stretches the offscreen buffer over the window and restores the viewport
+static void end_scaled(Window_* window, GLint viewport[4],
+    int scaled_w, int scaled_h)
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, window->scale_fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    
+    glBlitFramebuffer(
+        0, 0, scaled_w, scaled_h,
+        viewport[0], viewport[1], 
+        viewport[0] + viewport[2], viewport[1] + viewport[3],
+        GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+// brings the window's tiles up to date with the newest frame: all of them,
+// or with tile_culling only the ones its screen shows right now (which can
+// change without a new frame as the view turns)
+static void prepare_tiles(Player& player, size_t index, const RenderFrame& rf)
+{
+    TiledTexture& tiles = player.windows[index]->tiles;
+    
+    if(rf.pixels)
+        tiles.set_frame(rf.pixels);
+    
+    const vector<bool>* needed = NULL;
+    
+    if(player.tile_culling)
+    {
+        int images = (player.stereo || player.stereo_type != STEREO_NONE) ?
+            2 : 1;
+        
+        // see interleaved-stereo.frag
+        float eye_offset = 0.0;
+        if(player.stereo_type == STEREO_TOP_BOTTOM_INTERLEAVED)
+            eye_offset = 0.9 * 2.0 / 30.0 * M_PI/8.0;
+        
+        visible_tiles(player.tile_grid, player.screen_config[index],
+            rf.theta, rf.phi, images, eye_offset, tiles.visible);
+        
+        needed = &tiles.visible;
+    }
+    
+    glActiveTexture(GL_TEXTURE2);
+    int uploaded = tiles.update(player.tile_grid, needed);
+    glActiveTexture(GL_TEXTURE0);
+    
+    player.stats.add("tiles.uploaded", uploaded);
+}
+
+// picks the texture to draw from: the frame's slot in the upload ring if it
+// has one, otherwise whatever is already bound (uploading pixels into it).
+// With --cubemap a new frame is then converted into the window's cube.
+void prepare_texture(Player& player, size_t index, const RenderFrame& rf)
+{
+    // the CPU reads the frame straight from memory
+    if(player.cpu_render)
+    {
+        if(rf.pixels)
+            player.cpu_renderer.set_source(rf.pixels, rf.width, rf.height);
+        
+        return;
+    }
+    
+    if(player.tiled)
+    {
+        prepare_tiles(player, index, rf);
+        
+        if(player.cubemap && rf.pixels)
+            convert_to_cube(player, index, rf.width);
+        
+        return;
+    }
+    
+    if(rf.frame.slot >= 0)
+        player.uploader.bind(rf.frame.slot, index);
+    else if(rf.pixels)
+        upload_frame(player, rf);
+    else
+        return; // cube (if any) is already up to date
+    
+    if(player.cubemap)
+        convert_to_cube(player, index, rf.width);
+}
+
+void render_window(Player& player, size_t index, const RenderFrame& rf)
+{
+    // resized since the last draw (see on_window_resize())
+    int w, h;
+    if(player.windows[index]->take_resize(w, h))
+        glViewport(0, 0, w, h);
+    
+    if(!player.dynamic_resolution && !player.governor.enabled)
+    {
+        prepare_texture(player, index, rf);
+        draw_window(player, index, rf);
+        
+        if(player.upload_thread)
+            player.uploader.after_draw(index);
+        
+        return;
+    }
+    
+    Window_* window = player.windows[index];
+    
+    int64_t cpu_start = av_gettime_relative();
+    double gpu_ms = begin_gpu_timer(window);
+    
+    prepare_texture(player, index, rf);
+    
+    if(player.dynamic_resolution)
+    {
+        GLint viewport[4];
+        int scaled_w, scaled_h;
+    
+        begin_scaled(player, window, player.scaler.get_scale(), viewport,
+            scaled_w, scaled_h);
+        draw_window(player, index, rf);
+        end_scaled(window, viewport, scaled_w, scaled_h);
+    }
+    else
+        draw_window(player, index, rf);
+    
+    if(player.upload_thread)
+        player.uploader.after_draw(index);
+    
+    end_gpu_timer(window);
+    
+    double cpu_ms = (av_gettime_relative() - cpu_start) / 1000.0;
+    
+    // gpu_ms is from two frames ago, which is close enough for a trend
+    if(player.dynamic_resolution)
+        player.scaler.report(gpu_ms, cpu_ms);
+    
+    if(player.governor.enabled)
+        player.governor.report(gpu_ms, cpu_ms);
+}
+
+void retire_frame(Player& player, DecoderFrame& displayed, DecoderFrame drawn)
+{
+    if(drawn.slot < 0 && !player.tiled && !player.cpu_render)
+    {
+        // pixels were copied into the window textures already
+        if(drawn.frame)
+            player.decoder.return_frame(drawn);
+        
+        return;
+    }
+    
+    // windows keep drawing from the newest slot until another frame
+    // replaces it, so only the one before that can be released
+    if(displayed.frame)
+        player.return_frame(displayed);
+    
+    displayed = drawn;
+}
+
+void render_all_windows(Player& player, const RenderFrame& rf)
+{
+    for(size_t i = 0; i < player.windows.size(); i++)
+    {
+        player.windows[i]->make_current();
+        render_window(player, i, rf);
+    }
+    
+    if(player.swap_barrier.fd >= 0)
+    {
+        // the other nodes are told this one is ready, so it has to be
+        for(size_t i = 0; i < player.windows.size(); i++)
+        {
+            player.windows[i]->make_current();
+            glFinish();
+        }
+        
+        player.swap_barrier.wait(player.stats);
+    }
+    
+    // swap all together after drawing
+    for(size_t i = 0; i < player.windows.size(); i++)
+    {
+        player.windows[i]->swap_buffers();
+    }
+    
+    player.vblank.on_present(player.windows[0]->present_time(),
+        player.stats);
+    
+    if(player.dynamic_resolution)
+        player.scaler.update(player.stats);
+    
+    if(player.governor.enabled)
+        player.governor.update(player.stats);
+}
+
+
+static void* render_thread_main(void* arg)
+{
+    RenderThreadArg* rta = (RenderThreadArg*)arg;
+    rta->threads->loop(rta->index);
+    
+    return NULL;
+}
+
+void RenderThreads::start(Player* player)
+{
+    this->player = player;
+    
+    size_t count = player->windows.size();
+    
+    pthread_barrier_init(&start_barrier, NULL, count+1);
+    pthread_barrier_init(&swap_barrier,  NULL, count);
+    pthread_barrier_init(&wall_barrier,  NULL, count);
+    pthread_barrier_init(&done_barrier,  NULL, count+1);
+    
+    // a context can only be current on one thread at a time, so hand
+    // them all over to the render threads
+    for(size_t i = 0; i < count; i++)
+        player->windows[i]->release_current();
+    
+    threads.resize(count);
+    args.resize(count);
+    
+    for(size_t i = 0; i < count; i++)
+    {
+        args[i].threads = this;
+        args[i].index = i;
+        
+        pthread_create(&threads[i], NULL, render_thread_main, &args[i]);
+    }
+}
+
+void RenderThreads::render(const RenderFrame& rf)
+{
+    frame = rf;
+    
+    pthread_barrier_wait(&start_barrier); // go!
+    pthread_barrier_wait(&done_barrier);  // wait for every window to swap
+    
+    if(player->dynamic_resolution)
+        player->scaler.update(player->stats);
+    
+    if(player->governor.enabled)
+        player->governor.update(player->stats);
+}
+
+void RenderThreads::stop()
+{
+    if(threads.size() == 0)
+        return;
+    
+    exit_flag = true;
+    pthread_barrier_wait(&start_barrier);
+    
+    for(size_t i = 0; i < threads.size(); i++)
+    {
+        void* return_value; // unused
+        pthread_join(threads[i], &return_value);
+    }
+    
+    threads.clear();
+    
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&swap_barrier);
+    pthread_barrier_destroy(&wall_barrier);
+    pthread_barrier_destroy(&done_barrier);
+}
+
+void RenderThreads::loop(size_t index)
+{
+    Window_* window = player->windows[index];
+    window->make_current();
+    
+    while(true)
+    {
+        pthread_barrier_wait(&start_barrier);
+        
+        // frame and exit_flag are not touched by the main thread again
+        // until everyone has passed done_barrier
+        if(exit_flag)
+            break;
+        
+        render_window(*player, index, frame);
+        
+        // make sure this GPU is done before the others are told to flip,
+        // otherwise the barrier only lines up command submission
+        glFinish();
+        
+        pthread_barrier_wait(&swap_barrier);
+        
+        // once every window here has drawn, one thread waits for the rest
+        // of the wall on everyone's behalf
+        if(player->swap_barrier.enabled)
+        {
+            if(index == 0)
+                player->swap_barrier.wait(player->stats);
+            
+            pthread_barrier_wait(&wall_barrier);
+        }
+        
+        window->swap_buffers();
+        
+        if(index == 0)
+            player->vblank.on_present(window->present_time(), 
+                player->stats);
+        
+        pthread_barrier_wait(&done_barrier);
+    }
+    
+    window->release_current();
+}
+
+
+static void* render_loop_main(void* arg)
+{
+    RenderLoop* render_loop = (RenderLoop*)arg;
+    render_loop->loop();
+    
+    return NULL;
+}
+
+void RenderLoop::start(Player* player, RenderThreads* window_threads)
+{
+    this->player = player;
+    this->window_threads = window_threads;
+    
+    if(!window_threads)
+    {
+        for(size_t i = 0; i < player->windows.size(); i++)
+            player->windows[i]->release_current();
+    }
+    
+    running = true;
+    pthread_create(&thread, NULL, render_loop_main, this);
+}
+
+void RenderLoop::publish(const RenderFrame& rf)
+{
+    DecoderFrame superseded;
+    
+    pthread_mutex_lock(&mutex);
+    
+    RenderFrame merged = rf;
+    
+    if(has_pending && !rf.pixels && !rf.frame.frame)
+    {
+        // nothing new to upload -- keep the upload still waiting
+        merged.pixels = pending.pixels;
+        merged.width  = pending.width;
+        merged.height = pending.height;
+        merged.frame  = pending.frame;
+    }
+    else if(has_pending && pending.frame.frame)
+    {
+        // newer video frame arrived before the old one was drawn
+        superseded = pending.frame;
+    }
+    
+    pending = merged;
+    has_pending = true;
+    
+    pthread_cond_signal(&published);
+    pthread_mutex_unlock(&mutex);
+    
+    if(superseded.frame)
+        player->return_frame(superseded);
+}
+
+void RenderLoop::wait_taken(int64_t max_wait)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    
+    deadline.tv_nsec += (max_wait % 1000000) * 1000;
+    deadline.tv_sec  += max_wait / 1000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    
+    pthread_mutex_lock(&mutex);
+    
+    while(has_pending && !exit_flag)
+    {
+        if(pthread_cond_timedwait(&taken, &mutex, &deadline) != 0)
+            break; // timed out
+    }
+    
+    pthread_mutex_unlock(&mutex);
+}
+
+void RenderLoop::stop()
+{
+    if(!running)
+        return;
+    
+    pthread_mutex_lock(&mutex);
+    exit_flag = true;
+    pthread_cond_signal(&published);
+    pthread_mutex_unlock(&mutex);
+    
+    void* return_value; // unused
+    pthread_join(thread, &return_value);
+    running = false;
+    
+    if(has_pending && pending.frame.frame)
+        player->return_frame(pending.frame);
+    
+    if(displayed.frame)
+        player->return_frame(displayed);
+    
+    has_pending = false;
+    displayed = DecoderFrame();
+}
+
+void RenderLoop::loop()
+{
+    while(true)
+    {
+        pthread_mutex_lock(&mutex);
+        
+        while(!has_pending && !exit_flag)
+            pthread_cond_wait(&published, &mutex);
+        
+        if(exit_flag)
+        {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        
+        RenderFrame rf = pending;
+        
+        has_pending = false;
+        pending.pixels = NULL;
+        pending.frame = DecoderFrame();
+        
+        pthread_cond_signal(&taken);
+        pthread_mutex_unlock(&mutex);
+        
+        // multicast frames are double buffered by mc_client rather than
+        // the decoder, so they have to be polled from the thread that
+        // uploads them
+        if(player->use_multicast && player->type == NT_CLIENT)
+        {
+            player->mc_client.player_poll();
+            
+            rf.pixels = &player->mc_client.buffer[0][0];
+            rf.width = player->mc_client.width;
+            rf.height = player->mc_client.height;
+        }
+        
+        if(window_threads)
+            window_threads->render(rf);
+        else
+            render_all_windows(*player, rf);
+        
+        retire_frame(*player, displayed, rf.frame);
+    }
+}
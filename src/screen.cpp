@@ -224,3 +224,28 @@ void parse_calvr_screen_config(vector<ScreenConfig>& screens_out,
     }
 }
 
+
+vector<string> list_config_hosts(string filename)
+{
+    using namespace rapidxml;
+    
+    string xml_source = slurp(filename);
+    
+    xml_document<> doc;
+    doc.parse<0>(&xml_source[0]);
+    
+    vector<string> hosts;
+    
+    xml_node<>* node;
+    
+    for(node = doc.first_node("LOCAL"); node; node = node->next_sibling("LOCAL"))
+    {
+        xml_attribute<char>* attr = node->first_attribute("host");
+        if(!attr)
+            continue;
+        
+        hosts.push_back(attr->value());
+    }
+    
+    return hosts;
+}
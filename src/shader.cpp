@@ -1,17 +1,196 @@
 #include "shader.h"
 #include "util.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
 using namespace std;
 
+struct EmbeddedShader
+{
+    const char* filename;
+    const char* source;
+};
+
+// generated from shaders/ by the Makefile
+static const EmbeddedShader embedded_shaders[] = {
+#include "shaders.inc"
+    {NULL, NULL}
+};
+
+static string shader_cache_dir;
+
+string shader_source(const string& filename)
+{
+    for(size_t i = 0; embedded_shaders[i].filename; i++)
+    {
+        if(filename == embedded_shaders[i].filename)
+            return embedded_shaders[i].source;
+    }
+    
+    return slurp(filename);
+}
+
+void set_shader_cache(const string& dir)
+{
+    shader_cache_dir = dir;
+}
+
+string default_shader_cache()
+{
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    if(xdg && *xdg)
+        return string(xdg) + "/video_sphere";
+    
+    const char* home = getenv("HOME");
+    if(home && *home)
+        return string(home) + "/.cache/video_sphere";
+    
+    return "";
+}
+
+// 64 bit FNV-1a, continued from hash
+static uint64_t fnv1a(uint64_t hash, const string& data)
+{
+    // include the terminator so that "ab"+"c" and "a"+"bc" differ
+    for(size_t i = 0; i <= data.size(); i++)
+    {
+        hash ^= (unsigned char)data.c_str()[i];
+        hash *= 1099511628211ULL;
+    }
+    
+    return hash;
+}
+
+static string gl_string(GLenum name)
+{
+    const GLubyte* str = glGetString(name);
+    return str ? (const char*)str : "";
+}
+
+// cache file for a program linked from sources on the current driver.
+// Binaries are only valid for the exact driver that made them, so its
+// vendor, renderer and version are part of the key.
+static string cache_path(const vector<string>& filenames, 
+    const vector<string>& sources)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv1a(hash, gl_string(GL_VENDOR));
+    hash = fnv1a(hash, gl_string(GL_RENDERER));
+    hash = fnv1a(hash, gl_string(GL_VERSION));
+    
+    for(size_t i = 0; i < filenames.size(); i++)
+    {
+        hash = fnv1a(hash, filenames[i]);
+        hash = fnv1a(hash, sources[i]);
+    }
+    
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    
+    return shader_cache_dir + "/" + name;
+}
+
+// loads a cached binary into program; false if there is none or the driver
+// rejects it (e.g. after an update that kept the version string)
+static bool load_cached_program(GLuint program, const string& path)
+{
+    ifstream file(path.c_str(), ios::binary);
+    if(file.fail())
+        return false;
+    
+    stringstream buffer;
+    buffer << file.rdbuf();
+    string data = buffer.str();
+    
+    GLenum format = 0;
+    if(data.size() <= sizeof(format))
+        return false;
+    
+    memcpy(&format, data.data(), sizeof(format));
+    
+    glProgramBinary(program, format, data.data() + sizeof(format), 
+        data.size() - sizeof(format));
+    
+    GLint success = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &success);
+    
+    return success == GL_TRUE;
+}
+
+// writes the linked program's binary to path. Failures only cost the
+// next start its speedup, so they're silent.
+static void save_cached_program(GLuint program, const string& path)
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    
+    if(length <= 0)
+        return;
+    
+    vector<char> data(sizeof(GLenum) + length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, NULL, &format, 
+        &data[sizeof(GLenum)]);
+    memcpy(&data[0], &format, sizeof(format));
+    
+    // both levels of ~/.cache/video_sphere may be missing
+    size_t slash = shader_cache_dir.rfind('/');
+    if(slash != string::npos && slash > 0)
+        mkdir(shader_cache_dir.substr(0, slash).c_str(), 0755);
+    mkdir(shader_cache_dir.c_str(), 0755);
+    
+    // written under another name and renamed into place, so that a
+    // process starting at the same time never reads half a binary
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    string tmp_path = path + suffix;
+    
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if(!file)
+        return;
+    
+    bool ok = fwrite(&data[0], 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    
+    if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+        unlink(tmp_path.c_str());
+}
+
 GLuint load_shaders(vector<string> filenames)
 {
     GLint program = glCreateProgram();
     
+    vector<string> sources;
     for(size_t i = 0; i < filenames.size(); i++)
+        sources.push_back(shader_source(filenames[i]));
+    
+    bool use_cache = !shader_cache_dir.empty() && 
+        GLEW_ARB_get_program_binary;
+    
+    string path;
+    if(use_cache)
     {
-        string src = slurp(filenames[i]);
-        const char* src_c = src.c_str();
+        path = cache_path(filenames, sources);
+        
+        if(load_cached_program(program, path))
+            return program;
+        
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, 
+            GL_TRUE);
+    }
+    
+    vector<GLuint> shaders;
+    
+    for(size_t i = 0; i < filenames.size(); i++)
+    {
+        const char* src_c = sources[i].c_str();
         
         GLint type = 0;
         
@@ -52,6 +231,7 @@ GLuint load_shaders(vector<string> filenames)
         }
         
         glAttachShader(program, shader);
+        shaders.push_back(shader);
     }    
     
     glLinkProgram(program);
@@ -74,6 +254,16 @@ GLuint load_shaders(vector<string> filenames)
         exit(EXIT_FAILURE);
     }
     
+    // the program keeps what it needs of them
+    for(size_t i = 0; i < shaders.size(); i++)
+    {
+        glDetachShader(program, shaders[i]);
+        glDeleteShader(shaders[i]);
+    }
+    
+    if(use_cache)
+        save_cached_program(program, path);
+    
     return program;
 }
 
@@ -0,0 +1,219 @@
+#include "state_sync.h"
+
+#include <cstring>
+#include <cstdlib>
+using namespace std;
+
+static void put32(unsigned char* p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static void put64(unsigned char* p, uint64_t value)
+{
+    put32(p, (uint32_t)(value >> 32));
+    put32(p + 4, (uint32_t)value);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get64(const unsigned char* p)
+{
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+void StateSnapshot::write(Message& m) const
+{
+    m.bytes.resize(STATE_SIZE);
+    unsigned char* p = &m.bytes[0];
+    
+    uint32_t theta_bits, phi_bits;
+    memcpy(&theta_bits, &theta, sizeof(theta_bits));
+    memcpy(&phi_bits, &phi, sizeof(phi_bits));
+    
+    p[0] = 'F';
+    p[1] = STATE_VERSION;
+    p[2] = (paused ? STATE_PAUSED : 0) | (holding ? STATE_HOLDING : 0);
+    p[3] = 0;
+    put32(p + 4, seq);
+    put64(p + 8, now);
+    put64(p + 16, wall);
+    put64(p + 24, frame);
+    put32(p + 32, seeks);
+    put32(p + 36, theta_bits);
+    put32(p + 40, phi_bits);
+}
+
+bool StateSnapshot::read(const Message& m)
+{
+    if(m.bytes.size() < STATE_SIZE || m.bytes[0] != 'F' ||
+        m.bytes[1] != STATE_VERSION)
+    {
+        return false;
+    }
+    
+    const unsigned char* p = &m.bytes[0];
+    
+    paused = p[2] & STATE_PAUSED;
+    holding = p[2] & STATE_HOLDING;
+    seq = get32(p + 4);
+    now = (int64_t)get64(p + 8);
+    wall = (int64_t)get64(p + 16);
+    frame = (int64_t)get64(p + 24);
+    seeks = get32(p + 32);
+    
+    uint32_t theta_bits = get32(p + 36);
+    uint32_t phi_bits = get32(p + 40);
+    memcpy(&theta, &theta_bits, sizeof(theta));
+    memcpy(&phi, &phi_bits, sizeof(phi));
+    
+    return true;
+}
+
+bool StateSync::due(const StateSnapshot& s)
+{
+    if(next_seq == 0)
+        return true; // (none sent yet)
+    
+    // (playback time jumping, from the audio clock say, counts as a
+    // change too)
+    return s.theta != last.theta || s.phi != last.phi ||
+        s.paused != last.paused || s.holding != last.holding ||
+        s.seeks != last.seeks || s.wall - last_sent_wall > STATE_INTERVAL ||
+        llabs(s.now - last_sent) > STATE_INTERVAL;
+}
+
+void StateSync::sent(StateSnapshot& s)
+{
+    s.seq = next_seq++;
+    last = s;
+    last_sent = s.now;
+    last_sent_wall = s.wall;
+}
+
+bool StateSync::take(vector<Message>& messages, StateSnapshot& s)
+{
+    bool found = false;
+    size_t kept = 0;
+    
+    for(size_t i = 0; i < messages.size(); i++)
+    {
+        Message& m = messages[i];
+        
+        if(m.size() == 0 || m.bytes[0] != 'F')
+        {
+            if(kept != i)
+                messages[kept] = m;
+            
+            kept++;
+            continue;
+        }
+        
+        StateSnapshot candidate;
+        if(!candidate.read(m))
+            continue;
+        
+        // (by difference, so the count can wrap)
+        if(have_seq && (int32_t)(candidate.seq - last_seq) <= 0)
+            continue; // superseded
+        
+        have_seq = true;
+        last_seq = candidate.seq;
+        s = candidate;
+        found = true;
+    }
+    
+    messages.resize(kept);
+    
+    return found;
+}
+
+bool StateSync::in_step(const StateSnapshot& s, bool paused, bool pending,
+    int64_t wall, bool& resync)
+{
+    resync = false;
+    
+    if(s.seeks == seeks && s.paused == paused)
+    {
+        joined = true;
+        mismatch_since = 0;
+        return true;
+    }
+    
+    // the commands that bring this node in line are on their way
+    if(pending)
+    {
+        mismatch_since = 0;
+        return false;
+    }
+    
+    // (a node that has just joined hasn't seen the seeks before it)
+    if(!joined)
+        mismatch_since = wall - STATE_RESYNC;
+    
+    if(mismatch_since == 0)
+    {
+        mismatch_since = wall;
+        return false;
+    }
+    
+    if(wall - mismatch_since < STATE_RESYNC)
+        return false;
+    
+    seeks = s.seeks;
+    joined = true;
+    mismatch_since = 0;
+    resync = true;
+    
+    return true;
+}
+
+void StateSync::schedule_view(int64_t at, float theta, float phi)
+{
+    if(theta == last_theta && phi == last_phi)
+        return;
+    
+    PendingView view;
+    view.at = at;
+    view.theta = theta;
+    view.phi = phi;
+    
+    // (at only goes backwards if the clock estimate does)
+    while(views.size() && views.back().at > at)
+        views.pop_back();
+    
+    views.push_back(view);
+    last_theta = theta;
+    last_phi = phi;
+}
+
+bool StateSync::pop_view(int64_t present, float& theta, float& phi)
+{
+    bool found = false;
+    
+    while(views.size() && views.front().at <= present)
+    {
+        theta = views.front().theta;
+        phi = views.front().phi;
+        views.pop_front();
+        found = true;
+    }
+    
+    return found;
+}
+
+bool StateSync::next_view(int64_t& at)
+{
+    if(views.empty())
+        return false;
+    
+    at = views.front().at;
+    return true;
+}
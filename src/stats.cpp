@@ -0,0 +1,45 @@
+#include "stats.h"
+
+#include <iostream>
+#include <iomanip>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+void Stats::print_if_due()
+{
+    if(!enabled)
+        return;
+    
+    int64_t now = av_gettime_relative();
+    
+    if(now - last_print < interval)
+        return;
+    
+    last_print = now;
+    
+    pthread_mutex_lock(&mutex);
+    
+    cout << "--- stats ---\n";
+    
+    for(map<string,double>::iterator it = values.begin();
+        it != values.end(); it++)
+    {
+        cout << "  " << left << setw(28) << it->first << " "
+             << fixed << setprecision(3) << it->second << '\n';
+    }
+    
+    for(map<string,string>::iterator it = notes.begin(); 
+        it != notes.end(); it++)
+    {
+        cout << "  " << left << setw(28) << it->first << " " 
+             << it->second << '\n';
+    }
+    
+    cout.unsetf(ios::floatfield);
+    cout << right;
+    
+    pthread_mutex_unlock(&mutex);
+}
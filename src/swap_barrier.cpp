@@ -0,0 +1,307 @@
+#include "swap_barrier.h"
+
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+using namespace std;
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// packets: type, then seq (big endian), then (ready only) the host name
+#define BARRIER_READY   'B'
+#define BARRIER_RELEASE 'G'
+#define BARRIER_HEADER  5
+#define BARRIER_MAX_HOST 64
+
+// nodes that haven't been ready for this long aren't waited for
+#define BARRIER_MEMBER_TIMEOUT 1000000
+
+static void write_packet(unsigned char* packet, char type, uint32_t seq)
+{
+    packet[0] = type;
+    packet[1] = (seq >> 24) & 0xFF;
+    packet[2] = (seq >> 16) & 0xFF;
+    packet[3] = (seq >>  8) & 0xFF;
+    packet[4] = seq & 0xFF;
+}
+
+static uint32_t read_seq(const unsigned char* packet)
+{
+    return ((uint32_t)packet[1] << 24) | ((uint32_t)packet[2] << 16) |
+        ((uint32_t)packet[3] << 8) | packet[4];
+}
+
+void SwapBarrier::setup_node(const string& server_address, const string& host)
+{
+    this->host = host.substr(0, BARRIER_MAX_HOST);
+    
+    struct hostent* he;
+    
+    if((he = gethostbyname(server_address.c_str())) == NULL)
+    {
+        perror("gethostbyname");
+        exit(EXIT_FAILURE);
+    }
+    
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    memcpy(&server_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    
+    if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void SwapBarrier::wait(Stats& stats)
+{
+    if(fd < 0)
+        return;
+    
+    int64_t start = av_gettime_relative();
+    
+    unsigned char packet[BARRIER_HEADER + BARRIER_MAX_HOST];
+    
+    // releases that came too late for their round are of no use now
+    while(recv(fd, packet, sizeof(packet), MSG_DONTWAIT) > 0)
+        ;
+    
+    seq++;
+    
+    write_packet(packet, BARRIER_READY, seq);
+    memcpy(packet + BARRIER_HEADER, host.data(), host.size());
+    
+    sendto(fd, packet, BARRIER_HEADER + host.size(), 0,
+        (struct sockaddr*)&server_addr, sizeof(server_addr));
+    
+    bool released = false;
+    
+    while(!released)
+    {
+        int64_t left = start + timeout - av_gettime_relative();
+        if(left <= 0)
+            break;
+        
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        if(poll(&pfd, 1, (int)((left + 999) / 1000)) <= 0)
+            continue;
+        
+        ssize_t size = recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+        
+        if(size >= BARRIER_HEADER && packet[0] == BARRIER_RELEASE &&
+            read_seq(packet) == seq)
+        {
+            released = true;
+        }
+    }
+    
+    double wait_ms = (av_gettime_relative() - start) / 1000.0;
+    
+    stats.set("barrier.wait_ms", wait_ms);
+    
+    if(!released)
+        stats.add("barrier.timeouts", 1);
+}
+
+
+static void* swap_barrier_thread_main(void* arg)
+{
+    SwapBarrier* barrier = (SwapBarrier*)arg;
+    barrier->loop();
+    
+    return NULL;
+}
+
+void SwapBarrier::start_server(Stats* stats)
+{
+    this->stats = stats;
+    
+    if((server_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    
+    unsigned int yes = 1;
+    
+    if(setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
+    {
+        perror("setsockopt SO_REUSEADDR");
+        exit(EXIT_FAILURE);
+    }
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    
+    if(bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+    
+    running = true;
+    pthread_create(&thread, NULL, swap_barrier_thread_main, this);
+}
+
+void SwapBarrier::stop()
+{
+    if(!running)
+        return;
+    
+    exit_flag = true;
+    
+    void* unused;
+    pthread_join(thread, &unused);
+    
+    close(server_fd);
+    server_fd = -1;
+    running = false;
+}
+
+void SwapBarrier::release(int64_t now)
+{
+    unsigned char packet[BARRIER_HEADER];
+    
+    string first, last;
+    int64_t first_time = 0;
+    int64_t last_time = 0;
+    
+    map<string, BarrierMember>::iterator it;
+    for(it = members.begin(); it != members.end(); it++)
+    {
+        BarrierMember& member = it->second;
+        
+        if(member.waiting)
+        {
+            write_packet(packet, BARRIER_RELEASE, member.seq);
+            sendto(server_fd, packet, sizeof(packet), 0,
+                (struct sockaddr*)&member.addr, sizeof(member.addr));
+            
+            if(first.empty() || member.arrived < first_time)
+            {
+                first = it->first;
+                first_time = member.arrived;
+            }
+            
+            if(last.empty() || member.arrived > last_time)
+            {
+                last = it->first;
+                last_time = member.arrived;
+            }
+            
+            member.waiting = false;
+        }
+        else if(now - member.last_seen < BARRIER_MEMBER_TIMEOUT)
+        {
+            // the round timed out waiting for this one
+            stats->add("barrier.held_by." + it->first, 1);
+            stats->add("barrier.missed." + it->first, 1);
+            last.clear();
+        }
+    }
+    
+    // only a round everyone made has a meaningful last arrival
+    if(!last.empty() && last != first)
+    {
+        stats->add("barrier.held_by." + last, 1);
+        stats->set("barrier.spread_ms", (last_time - first_time) / 1000.0);
+    }
+}
+
+void SwapBarrier::loop()
+{
+    unsigned char packet[BARRIER_HEADER + BARRIER_MAX_HOST];
+    
+    // when the first member of the current round became ready, or 0
+    int64_t round_start = 0;
+    
+    while(!exit_flag)
+    {
+        int wait_ms = 100;
+        
+        if(round_start)
+        {
+            int64_t left = round_start + timeout/2 - av_gettime_relative();
+            wait_ms = left > 0 ? (int)((left + 999) / 1000) : 0;
+        }
+        
+        pollfd pfd;
+        pfd.fd = server_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        int status = poll(&pfd, 1, wait_ms);
+        int64_t now = av_gettime_relative();
+        
+        if(status > 0)
+        {
+            struct sockaddr_in from;
+            socklen_t from_size = sizeof(from);
+            
+            ssize_t size = recvfrom(server_fd, packet, sizeof(packet),
+                MSG_DONTWAIT, (struct sockaddr*)&from, &from_size);
+            
+            if(size >= BARRIER_HEADER && packet[0] == BARRIER_READY)
+            {
+                string name((const char*)packet + BARRIER_HEADER,
+                    size - BARRIER_HEADER);
+                
+                BarrierMember& member = members[name];
+                member.addr = from;
+                member.last_seen = now;
+                member.seq = read_seq(packet);
+                member.waiting = true;
+                member.arrived = now;
+                
+                if(!round_start)
+                    round_start = now;
+            }
+        }
+        else if(status < 0 && errno != EINTR)
+        {
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        
+        if(!round_start)
+            continue;
+        
+        // everyone still around is ready, or the round has gone on long
+        // enough
+        bool complete = true;
+        
+        map<string, BarrierMember>::iterator it;
+        for(it = members.begin(); it != members.end(); it++)
+        {
+            BarrierMember& member = it->second;
+            
+            if(!member.waiting &&
+                now - member.last_seen < BARRIER_MEMBER_TIMEOUT)
+            {
+                complete = false;
+            }
+        }
+        
+        if(complete || now - round_start >= timeout/2)
+        {
+            release(now);
+            round_start = 0;
+        }
+    }
+}
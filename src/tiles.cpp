@@ -0,0 +1,371 @@
+#include "tiles.h"
+
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+#ifndef TURN
+#define TURN (2*M_PI)
+#endif
+
+// points sampled across each screen, per side
+#define VISIBLE_SAMPLES 32
+
+void TileGrid::setup(int frame_width, int frame_height, int layer_size)
+{
+    this->frame_width = frame_width;
+    this->frame_height = frame_height;
+    
+    int most = layer_size - 2; // room for the border
+    
+    columns = (frame_width + most - 1) / most;
+    rows = (frame_height + most - 1) / most;
+    
+    // same size tiles all round rather than a sliver at the end
+    tile_width = (frame_width + columns - 1) / columns;
+    tile_height = (frame_height + rows - 1) / rows;
+}
+
+void TileGrid::set_uniforms(GLuint program) const
+{
+    glUseProgram(program);
+    
+    // unit 0 keeps the single texture, unit 1 the --cubemap cube
+    glUniform1i(glGetUniformLocation(program, "video_tiles"), 2);
+    
+    glUniform2f(glGetUniformLocation(program, "tile_grid"), columns, rows);
+    glUniform2f(glGetUniformLocation(program, "tile_size"), 
+        tile_width, tile_height);
+    glUniform2f(glGetUniformLocation(program, "frame_size"), 
+        frame_width, frame_height);
+}
+
+void TiledTexture::create(const TileGrid& grid)
+{
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGB8, 
+        grid.tile_width + 2, grid.tile_height + 2, grid.count(),
+        0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    
+    tile_serial.assign(grid.count(), -1);
+}
+
+// copies a w x h block at (sx, sy) of the frame to (dx, dy) of a layer
+static void upload_block(const TileGrid& grid, const unsigned char* pixels,
+    int layer, int sx, int sy, int w, int h, int dx, int dy)
+{
+    const unsigned char* start = pixels + 3 * (sy * grid.frame_width + sx);
+    
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, dx, dy, layer, w, h, 1,
+        GL_RGB, GL_UNSIGNED_BYTE, start);
+}
+
+static void upload_tile(const TileGrid& grid, const unsigned char* pixels,
+    int column, int row)
+{
+    int layer = row * grid.columns + column;
+    
+    int x0 = column * grid.tile_width;
+    int y0 = row * grid.tile_height;
+    int w = min(grid.tile_width, grid.frame_width - x0);
+    int h = min(grid.tile_height, grid.frame_height - y0);
+    
+    // border: wraps around horizontally, repeats the edge vertically
+    int left = (x0 - 1 + grid.frame_width) % grid.frame_width;
+    int right = (x0 + w) % grid.frame_width;
+    int top = max(y0 - 1, 0);
+    int bottom = min(y0 + h, grid.frame_height - 1);
+    
+    upload_block(grid, pixels, layer, x0,    y0,     w, h, 1,   1);
+    upload_block(grid, pixels, layer, left,  y0,     1, h, 0,   1);
+    upload_block(grid, pixels, layer, right, y0,     1, h, w+1, 1);
+    
+    upload_block(grid, pixels, layer, left,  top,    1, 1, 0,   0);
+    upload_block(grid, pixels, layer, x0,    top,    w, 1, 1,   0);
+    upload_block(grid, pixels, layer, right, top,    1, 1, w+1, 0);
+    
+    upload_block(grid, pixels, layer, left,  bottom, 1, 1, 0,   h+1);
+    upload_block(grid, pixels, layer, x0,    bottom, w, 1, 1,   h+1);
+    upload_block(grid, pixels, layer, right, bottom, 1, 1, w+1, h+1);
+}
+
+int TiledTexture::update(const TileGrid& grid, const vector<bool>* needed)
+{
+    if(!pixels)
+        return 0;
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, grid.frame_width);
+    
+    int uploaded = 0;
+    
+    for(int row = 0; row < grid.rows; row++)
+    {
+        for(int column = 0; column < grid.columns; column++)
+        {
+            int i = row * grid.columns + column;
+            
+            if(needed && !(*needed)[i])
+                continue;
+            
+            if(tile_serial[i] == serial)
+                continue; // up to date
+            
+            upload_tile(grid, pixels, column, row);
+            tile_serial[i] = serial;
+            uploaded++;
+        }
+    }
+    
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    
+    return uploaded;
+}
+
+
+// --- visibility -------------------------------------------------------------
+
+// column-major, same as rotationMatrix() in simple-mono.vert
+static void rotation_matrix(float ax, float ay, float az, float angle, 
+    float m[16])
+{
+    float len = sqrt(ax*ax + ay*ay + az*az);
+    float x = ax / len;
+    float y = ay / len;
+    float z = az / len;
+    
+    float s = -sin(angle);
+    float c = cos(angle);
+    float oc = 1.0 - c;
+    
+    m[0]  = oc*x*x + c;   m[1]  = oc*x*y - z*s; m[2]  = oc*z*x + y*s;
+    m[4]  = oc*x*y + z*s; m[5]  = oc*y*y + c;   m[6]  = oc*y*z - x*s;
+    m[8]  = oc*z*x - y*s; m[9]  = oc*y*z + x*s; m[10] = oc*z*z + c;
+    
+    m[3] = m[7] = m[11] = m[12] = m[13] = m[14] = 0.0;
+    m[15] = 1.0;
+}
+
+static void multiply(const float a[16], const float b[16], float out[16])
+{
+    for(int col = 0; col < 4; col++)
+    {
+        for(int row = 0; row < 4; row++)
+        {
+            float sum = 0.0;
+            for(int k = 0; k < 4; k++)
+                sum += a[k*4 + row] * b[col*4 + k];
+            
+            out[col*4 + row] = sum;
+        }
+    }
+}
+
+static void rotate(const float m[16], const float v[3], float out[3])
+{
+    for(int row = 0; row < 3; row++)
+        out[row] = m[row] * v[0] + m[4 + row] * v[1] + m[8 + row] * v[2];
+}
+
+// pos of simple-mono.vert for a point of the screen (-1 to 1 across it)
+struct ScreenPoints
+{
+    const ScreenConfig& sc;
+    float rph[16];
+    float view[16];
+    
+    ScreenPoints(const ScreenConfig& sc, float theta, float phi) : sc(sc)
+    {
+        float r[16], p[16], h[16];
+        rotation_matrix(0, 1, 0, sc.roll * M_PI / 180.0, r);
+        rotation_matrix(1, 0, 0, sc.pitch * M_PI / 180.0, p);
+        rotation_matrix(0, 0, 1, sc.heading * M_PI / 180.0, h);
+        
+        float hp[16];
+        multiply(h, p, hp);
+        multiply(hp, r, rph);
+        
+        float t[16], f[16];
+        rotation_matrix(0, 0, 1, theta, t);
+        rotation_matrix(1, 0, 0, phi, f);
+        multiply(t, f, view);
+    }
+    
+    void at(float x, float y, float out[3]) const
+    {
+        float corner_offset[3] = {sc.width/2 * x, 0, sc.height/2 * y};
+        
+        float p[3];
+        rotate(rph, corner_offset, p);
+        
+        p[0] += sc.originX;
+        p[1] += sc.originY;
+        p[2] += sc.originZ;
+        
+        rotate(view, p, out);
+    }
+};
+
+// texture position of a direction, as in projection-equirect.frag
+static void direction_to_uv(const float d[3], float eye_offset, 
+    float& u, float& v)
+{
+    float len = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+    
+    float lon = atan2(d[1], d[0]) - eye_offset;
+    lon = fmod(lon + 2*TURN, TURN);
+    
+    float z = max(-1.0f, min(1.0f, d[2] / len));
+    float lat = asin(z);
+    
+    u = 1.0 - lon / TURN;
+    v = 1.0 - (lat / (0.25*TURN) + 1.0) / 2.0;
+}
+
+static void tile_of(const TileGrid& grid, float u, float v, int image, 
+    int images, int& column, int& row)
+{
+    float x = (u - floor(u)) * grid.frame_width;
+    float y = (v + image) / images * grid.frame_height;
+    
+    column = min(int(x) / grid.tile_width, grid.columns - 1);
+    row = max(0, min(int(y) / grid.tile_height, grid.rows - 1));
+}
+
+// marks the tiles between two tiles that hold neighbouring sample points,
+// going the short way around
+static void mark_between(const TileGrid& grid, int c1, int r1, int c2, 
+    int r2, vector<bool>& visible)
+{
+    int dc = c2 - c1;
+    if(dc > grid.columns / 2)
+        dc -= grid.columns;
+    else if(dc < -grid.columns / 2)
+        dc += grid.columns;
+    
+    int step = dc < 0 ? -1 : 1;
+    
+    for(int i = 0; i <= abs(dc); i++)
+    {
+        int c = ((c1 + i*step) % grid.columns + grid.columns) % grid.columns;
+        
+        for(int r = min(r1, r2); r <= max(r1, r2); r++)
+            visible[r * grid.columns + c] = true;
+    }
+}
+
+// whether the ray from the viewer along d goes through the screen
+static bool sees_direction(const ScreenPoints& points, const float d[3])
+{
+    float p0[3], px[3], py[3];
+    points.at(0, 0, p0);
+    points.at(1, 0, px);
+    points.at(0, 1, py);
+    
+    float a[3], b[3];
+    for(int i = 0; i < 3; i++)
+    {
+        a[i] = px[i] - p0[i];
+        b[i] = py[i] - p0[i];
+    }
+    
+    // p0 + x*a + y*b = t*d, by Cramer's rule
+    #define DET3(c0, c1, c2) ( \
+        c0[0]*(c1[1]*c2[2] - c1[2]*c2[1]) - \
+        c1[0]*(c0[1]*c2[2] - c0[2]*c2[1]) + \
+        c2[0]*(c0[1]*c1[2] - c0[2]*c1[1]))
+    
+    float nd[3] = {-d[0], -d[1], -d[2]};
+    float np0[3] = {-p0[0], -p0[1], -p0[2]};
+    
+    float det = DET3(a, b, nd);
+    if(fabs(det) < 1e-9)
+        return false;
+    
+    float x = DET3(np0, b, nd) / det;
+    float y = DET3(a, np0, nd) / det;
+    float t = DET3(a, b, np0) / det;
+    
+    #undef DET3
+    
+    return t > 0 && fabs(x) <= 1.0 && fabs(y) <= 1.0;
+}
+
+void visible_tiles(const TileGrid& grid, const ScreenConfig& sc,
+    float theta, float phi, int images, float eye_offset,
+    vector<bool>& visible)
+{
+    visible.assign(grid.count(), false);
+    
+    ScreenPoints points(sc, theta, phi);
+    
+    const int n = VISIBLE_SAMPLES + 1;
+    int offsets = eye_offset != 0.0 ? 2 : 1;
+    
+    for(int image = 0; image < images; image++)
+    {
+        for(int o = 0; o < offsets; o++)
+        {
+            vector<int> columns(n*n), rows(n*n);
+            
+            for(int j = 0; j < n; j++)
+            {
+                for(int i = 0; i < n; i++)
+                {
+                    float d[3];
+                    points.at(2.0*i/(n-1) - 1.0, 2.0*j/(n-1) - 1.0, d);
+                    
+                    float u, v;
+                    direction_to_uv(d, o * eye_offset, u, v);
+                    tile_of(grid, u, v, image, images, 
+                        columns[j*n + i], rows[j*n + i]);
+                }
+            }
+            
+            // the screen covers everything between neighbouring points
+            for(int j = 0; j < n; j++)
+            {
+                for(int i = 0; i < n; i++)
+                {
+                    int k = j*n + i;
+                    
+                    if(i+1 < n)
+                        mark_between(grid, columns[k], rows[k], 
+                            columns[k+1], rows[k+1], visible);
+                    
+                    if(j+1 < n)
+                        mark_between(grid, columns[k], rows[k], 
+                            columns[k+n], rows[k+n], visible);
+                }
+            }
+        }
+        
+        // a pole on screen shows every longitude around it
+        float north[3] = {0, 0, 1};
+        float south[3] = {0, 0, -1};
+        
+        int column, row;
+        
+        if(sees_direction(points, north))
+        {
+            tile_of(grid, 0, 0, image, images, column, row);
+            for(int c = 0; c < grid.columns; c++)
+                visible[row * grid.columns + c] = true;
+        }
+        
+        if(sees_direction(points, south))
+        {
+            tile_of(grid, 0, 0.999999, image, images, column, row);
+            for(int c = 0; c < grid.columns; c++)
+                visible[row * grid.columns + c] = true;
+        }
+    }
+}
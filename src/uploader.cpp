@@ -0,0 +1,418 @@
+#include "uploader.h"
+#include "player.h"
+#include "util.h"
+
+#include <iostream>
+#include <unistd.h>
+using namespace std;
+
+static void* upload_thread_main(void* arg)
+{
+    UploadThread* uploader = (UploadThread*)arg;
+    uploader->loop();
+    
+    return NULL;
+}
+
+void UploadGroup::make_current()
+{
+    if(glfw_window)
+        glfwMakeContextCurrent(glfw_window);
+    else if(egl_context != EGL_NO_CONTEXT)
+    {
+        eglBindAPI(EGL_OPENGL_API);
+        eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context);
+    }
+    else
+        glXMakeCurrent(display, pbuffer, glx_context);
+}
+
+void UploadGroup::release_current()
+{
+    if(glfw_window)
+        glfwMakeContextCurrent(NULL);
+    else if(egl_context != EGL_NO_CONTEXT)
+    {
+        eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, 
+            EGL_NO_CONTEXT);
+    }
+    else
+        glXMakeCurrent(display, None, NULL);
+}
+
+static UploadGroup create_upload_group(Window_* window)
+{
+    UploadGroup group;
+    
+    if(window->glfw_window)
+    {
+        glfwWindowHint(GLFW_VISIBLE, false);
+        group.glfw_window = glfwCreateWindow(16, 16, "Video Sphere Upload",
+            NULL, window->glfw_window);
+        glfwWindowHint(GLFW_VISIBLE, true);
+        
+        if(!group.glfw_window)
+            fatal("Failed to create upload context!");
+        
+        return group;
+    }
+    
+    if(window->egl_context != EGL_NO_CONTEXT)
+    {
+        EGLint pbuffer_attribs[] =
+        {
+            EGL_WIDTH,  16,
+            EGL_HEIGHT, 16,
+            EGL_NONE
+        };
+        
+        group.egl_display = window->egl_display;
+        group.egl_surface = eglCreatePbufferSurface(window->egl_display,
+            window->egl_config, pbuffer_attribs);
+        
+        eglBindAPI(EGL_OPENGL_API);
+        group.egl_context = eglCreateContext(window->egl_display,
+            window->egl_config, window->egl_context, NULL);
+        
+        if(group.egl_surface == EGL_NO_SURFACE || 
+            group.egl_context == EGL_NO_CONTEXT)
+        {
+            fatal("Failed to create upload context!");
+        }
+        
+        return group;
+    }
+    
+    // the context needs something to be current on; a pbuffer will do as
+    // long as the window's config supports one
+    int drawable_type = 0;
+    glXGetFBConfigAttrib(window->display, window->fb_config,
+        GLX_DRAWABLE_TYPE, &drawable_type);
+    
+    if(!(drawable_type & GLX_PBUFFER_BIT))
+        fatal("Upload thread: X11 window's GLX config has no pbuffer support");
+    
+    int pbuffer_attribs[] =
+    {
+        GLX_PBUFFER_WIDTH,  16,
+        GLX_PBUFFER_HEIGHT, 16,
+        None
+    };
+    
+    group.display = window->display;
+    group.pbuffer = glXCreatePbuffer(window->display, window->fb_config,
+        pbuffer_attribs);
+    
+    group.glx_context = glXCreateNewContext(
+        window->display,
+        window->fb_config,
+        GLX_RGBA_TYPE,
+        window->glx_context, // share textures and sync objects
+        True);
+    
+    if(!group.pbuffer || !group.glx_context)
+        fatal("Failed to create upload context!");
+    
+    return group;
+}
+
+void UploadThread::start(Player* player, size_t ring_size)
+{
+    this->player = player;
+    
+    width = player->decoder.codec_context->width;
+    height = player->decoder.codec_context->height;
+    
+    if(player->decoder.polar_packing)
+        height = player->polar.packed_height;
+    
+    int glfw_group = -1;
+    int egl_group = -1;
+    
+    for(size_t i = 0; i < player->windows.size(); i++)
+    {
+        Window_* w = player->windows[i];
+        bool egl = w->egl_context != EGL_NO_CONTEXT;
+        
+        if(w->glfw_window && glfw_group >= 0)
+        {
+            window_group.push_back(glfw_group);
+            continue;
+        }
+        
+        if(egl && egl_group >= 0)
+        {
+            window_group.push_back(egl_group);
+            continue;
+        }
+        
+        window_group.push_back(groups.size());
+        
+        if(w->glfw_window)
+            glfw_group = groups.size();
+        else if(egl)
+            egl_group = groups.size();
+        
+        groups.push_back(create_upload_group(w));
+    }
+    
+    bound_slot.resize(player->windows.size(), -1);
+    
+    slots.resize(ring_size);
+    
+    for(size_t i = 0; i < slots.size(); i++)
+    {
+        slots[i].textures.resize(groups.size(), 0);
+        slots[i].upload_done.resize(groups.size(), NULL);
+        slots[i].draw_done.resize(player->windows.size(), NULL);
+    }
+    
+    pthread_create(&thread, NULL, upload_thread_main, this);
+}
+
+DecoderFrame UploadThread::get_frame()
+{
+    DecoderFrame result;
+    
+    pthread_mutex_lock(&mutex);
+    
+    if(ready_slots.size())
+    {
+        int i = ready_slots.front();
+        ready_slots.pop_front();
+        
+        slots[i].ready = false;
+        slots[i].in_use = true;
+        
+        result = slots[i].frame;
+        result.slot = i;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+void UploadThread::return_frame(DecoderFrame df)
+{
+    pthread_mutex_lock(&mutex);
+    
+    UploadSlot& slot = slots[df.slot];
+    slot.in_use = false;
+    slot.frame = DecoderFrame();
+    
+    pthread_cond_signal(&condition);
+    pthread_mutex_unlock(&mutex);
+    
+    df.slot = -1;
+    player->decoder.return_frame(df);
+}
+
+bool UploadThread::drained()
+{
+    Decoder& decoder = player->decoder;
+    
+    decoder.lock();
+    bool decoder_done = decoder.decoded_all_flag && 
+        decoder.showable_frames.size() == 0;
+    decoder.unlock();
+    
+    pthread_mutex_lock(&mutex);
+    bool result = decoder_done && !uploading && ready_slots.size() == 0;
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+size_t UploadThread::frames_waiting()
+{
+    pthread_mutex_lock(&mutex);
+    size_t result = ready_slots.size() + (uploading ? 1 : 0);
+    pthread_mutex_unlock(&mutex);
+    
+    return result;
+}
+
+void UploadThread::bind(int slot, size_t window_index)
+{
+    pthread_mutex_lock(&mutex);
+    
+    int g = window_group[window_index];
+    GLuint texture = slots[slot].textures[g];
+    GLsync fence = slots[slot].upload_done[g];
+    
+    pthread_mutex_unlock(&mutex);
+    
+    // GPU side wait only: the CPU carries on queueing the draw
+    if(fence)
+        glWaitSync(fence, 0, GL_TIMEOUT_IGNORED);
+    
+    glBindTexture(GL_TEXTURE_2D, texture);
+    bound_slot[window_index] = slot;
+}
+
+void UploadThread::after_draw(size_t window_index)
+{
+    int slot = bound_slot[window_index];
+    
+    if(slot < 0)
+        return;
+    
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    
+    pthread_mutex_lock(&mutex);
+    
+    GLsync old = slots[slot].draw_done[window_index];
+    slots[slot].draw_done[window_index] = fence;
+    
+    pthread_mutex_unlock(&mutex);
+    
+    if(old)
+        glDeleteSync(old);
+}
+
+void UploadThread::stop()
+{
+    if(slots.size() == 0)
+        return;
+    
+    pthread_mutex_lock(&mutex);
+    exit_flag = true;
+    pthread_cond_signal(&condition);
+    pthread_mutex_unlock(&mutex);
+    
+    void* return_value; // unused
+    pthread_join(thread, &return_value);
+}
+
+void UploadThread::loop()
+{
+    // textures are created in the upload contexts; they are visible to the
+    // windows through sharing
+    for(size_t g = 0; g < groups.size(); g++)
+    {
+        groups[g].make_current();
+        
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            glGenTextures(1, &slots[i].textures[g]);
+            glBindTexture(GL_TEXTURE_2D, slots[i].textures[g]);
+            
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            
+            if(player->aa_mode == AA_MIPMAP && !player->cubemap)
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+                
+                if(GLEW_EXT_texture_filter_anisotropic)
+                {
+                    GLfloat max_aniso = 1.0;
+                    glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_aniso);
+                    glTexParameterf(GL_TEXTURE_2D, 
+                        GL_TEXTURE_MAX_ANISOTROPY_EXT, max_aniso);
+                }
+            }
+            else
+            {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, 
+                    GL_LINEAR);
+            }
+            
+            // storage once; every upload after this is a glTexSubImage2D
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0,
+                GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        }
+        
+        glFinish();
+        groups[g].release_current();
+    }
+    
+    pthread_mutex_lock(&mutex);
+    
+    while(!exit_flag)
+    {
+        // find a slot that isn't queued or on screen
+        int free_slot = -1;
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            if(!slots[i].ready && !slots[i].in_use)
+            {
+                free_slot = i;
+                break;
+            }
+        }
+        
+        if(free_slot < 0)
+        {
+            // ring is full; wait for the control loop to release one
+            pthread_cond_wait(&condition, &mutex);
+            continue;
+        }
+        
+        uploading = true;
+        pthread_mutex_unlock(&mutex);
+        
+        DecoderFrame df = player->decoder.get_frame();
+        
+        if(!df.frame)
+        {
+            pthread_mutex_lock(&mutex);
+            uploading = false;
+            pthread_mutex_unlock(&mutex);
+            
+            // decoder hasn't caught up
+            usleep(1000);
+            
+            pthread_mutex_lock(&mutex);
+            continue;
+        }
+        
+        UploadSlot& slot = slots[free_slot];
+        
+        for(size_t g = 0; g < groups.size(); g++)
+        {
+            groups[g].make_current();
+            
+            // don't overwrite the texture until every window in this group
+            // is done drawing from it (GPU side wait)
+            for(size_t w = 0; w < window_group.size(); w++)
+            {
+                if(window_group[w] != (int)g || !slot.draw_done[w])
+                    continue;
+                
+                glWaitSync(slot.draw_done[w], 0, GL_TIMEOUT_IGNORED);
+            }
+            
+            if(slot.upload_done[g])
+                glDeleteSync(slot.upload_done[g]);
+            
+            glBindTexture(GL_TEXTURE_2D, slot.textures[g]);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                GL_RGB, GL_UNSIGNED_BYTE, df.frame->data[0]);
+            
+            // with --cubemap the mipmaps are made on the cube instead
+            if(player->aa_mode == AA_MIPMAP && !player->cubemap)
+                glGenerateMipmap(GL_TEXTURE_2D);
+            
+            slot.upload_done[g] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            
+            // the fence has to reach the GPU before another context can
+            // wait on it
+            glFlush();
+            
+            groups[g].release_current();
+        }
+        
+        pthread_mutex_lock(&mutex);
+        
+        slot.frame = df;
+        slot.ready = true;
+        ready_slots.push_back(free_slot);
+        uploading = false;
+    }
+    
+    pthread_mutex_unlock(&mutex);
+}
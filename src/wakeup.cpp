@@ -0,0 +1,50 @@
+#include "wakeup.h"
+#include "util.h"
+
+#include <GLFW/glfw3.h>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+void Wakeup::setup()
+{
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    
+    if(fd < 0)
+        fatal("Failed to create eventfd");
+}
+
+void Wakeup::signal()
+{
+    if(fd < 0)
+        return;
+    
+    uint64_t one = 1;
+    ssize_t unused = write(fd, &one, sizeof(one));
+    (void)unused;
+    
+    if(use_glfw)
+        glfwPostEmptyEvent();
+}
+
+void Wakeup::wait(int64_t timeout)
+{
+    if(use_glfw)
+        glfwWaitEventsTimeout(timeout / 1000000.0);
+    else
+    {
+        pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        
+        // round up so that a short wait doesn't turn into a busy loop
+        poll(&pfd, 1, (int)((timeout + 999) / 1000));
+    }
+    
+    // reset the count; it only matters that something happened
+    uint64_t count;
+    ssize_t unused = read(fd, &count, sizeof(count));
+    (void)unused;
+}
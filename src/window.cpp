@@ -1,6 +1,20 @@
 #include "window.h"
+
+#define GLFW_EXPOSE_NATIVE_X11
+#include <GLFW/glfw3native.h>
+
+#include <EGL/eglext.h>
+#include <cstring>
+#include <cstdlib>
 using namespace std;
 
+extern "C" {
+#include <libavutil/time.h>
+}
+
+typedef Bool (*GetSyncValuesOML)(Display* display, GLXDrawable drawable,
+    int64_t* ust, int64_t* msc, int64_t* sbc);
+
 
 void Window_::create_x11(
     const char* display_string, 
@@ -44,6 +58,7 @@ void Window_::create_x11(
     }
     
     GLXFBConfig fb = fbc[0];
+    fb_config = fb; // for creating shared contexts later
     
     XFree(fbc);
     
@@ -125,4 +140,131 @@ void Window_::create_x11(
     glXMakeCurrent(display, x11_window, glx_context);
 }
 
+void Window_::create_offscreen(int w, int h, const Window_* share)
+{
+    if(share)
+        egl_display = share->egl_display;
+    else
+    {
+        // Mesa's surfaceless platform needs neither an X server nor a GPU,
+        // so it works on CI boxes with nothing but llvmpipe
+        #ifdef EGL_PLATFORM_SURFACELESS_MESA
+        const char* client_extensions = 
+            eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = 
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+            eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+        if(client_extensions && get_platform_display &&
+            strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+        {
+            egl_display = get_platform_display(
+                EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        }
+        #endif
+        
+        if(egl_display == EGL_NO_DISPLAY)
+            egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        
+        if(egl_display == EGL_NO_DISPLAY || 
+            !eglInitialize(egl_display, NULL, NULL))
+        {
+            fatal("create_offscreen: Failed to initialize EGL");
+        }
+    }
+    
+    if(!eglBindAPI(EGL_OPENGL_API))
+        fatal("create_offscreen: EGL has no desktop OpenGL");
+    
+    EGLint config_attribs[] =
+    {
+        EGL_SURFACE_TYPE,    EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE,        8,
+        EGL_GREEN_SIZE,      8,
+        EGL_BLUE_SIZE,       8,
+        EGL_DEPTH_SIZE,      24,
+        EGL_STENCIL_SIZE,    8,
+        EGL_NONE
+    };
+    
+    EGLint config_count = 0;
+    if(!eglChooseConfig(egl_display, config_attribs, &egl_config, 1, 
+        &config_count) || config_count == 0)
+    {
+        fatal("create_offscreen: No EGL config with pbuffer support");
+    }
+    
+    EGLint pbuffer_attribs[] =
+    {
+        EGL_WIDTH,  w,
+        EGL_HEIGHT, h,
+        EGL_NONE
+    };
+    
+    egl_surface = eglCreatePbufferSurface(egl_display, egl_config,
+        pbuffer_attribs);
+    
+    if(egl_surface == EGL_NO_SURFACE)
+        fatal("create_offscreen: Failed to create pbuffer");
+    
+    // no attributes: a compatibility context, which the shaders'
+    // glBegin() drawing needs
+    egl_context = eglCreateContext(egl_display, egl_config,
+        share ? share->egl_context : EGL_NO_CONTEXT, NULL);
+    
+    if(egl_context == EGL_NO_CONTEXT)
+        fatal("create_offscreen: Failed to create EGL context");
+    
+    make_current();
+    glViewport(0, 0, w, h);
+}
 
+int64_t Window_::present_time()
+{
+    int64_t now = av_gettime_relative();
+    
+    Display* dpy = NULL;
+    GLXDrawable drawable = 0;
+    
+    if(glfw_window)
+    {
+        dpy = glfwGetX11Display();
+        drawable = glfwGetX11Window(glfw_window);
+    }
+    else if(x11_window)
+    {
+        dpy = display;
+        drawable = x11_window;
+    }
+    
+    if(!dpy)
+        return now;
+    
+    static GetSyncValuesOML get_sync_values = (GetSyncValuesOML)
+        glXGetProcAddress((const GLubyte*)"glXGetSyncValuesOML");
+    
+    if(oml_sync < 0)
+    {
+        const char* extensions = glXQueryExtensionsString(dpy,
+            DefaultScreen(dpy));
+        
+        oml_sync = get_sync_values && extensions &&
+            strstr(extensions, "GLX_OML_sync_control");
+    }
+    
+    if(!oml_sync)
+        return now;
+    
+    int64_t ust, msc, sbc;
+    if(!get_sync_values(dpy, drawable, &ust, &msc, &sbc))
+        return now;
+    
+    // UST is CLOCK_MONOTONIC microseconds on Linux, as is
+    // av_gettime_relative(), but it isn't guaranteed to be
+    if(ust > now || now - ust > 1000000)
+        return now;
+    
+    return ust;
+}